@@ -1,4 +1,8 @@
+#include <chrono>
 #include <cassert>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "acceptor.hh"
 #include "eventloop.hh"
@@ -6,11 +10,20 @@
 
 namespace axn {
 
+namespace {
+
+int IdleFd() {
+    return ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+} // unnamed namespace
+
 Acceptor::Acceptor(EventLoop& loop, const InetAddr& addr)
     : loop_{loop},
       listen_addr_{addr},
       poll_fd_{loop_, NonBlockTcpSocket()},
-      sk_op_{poll_fd_.Fd()} {
+      sk_op_{poll_fd_.Fd()},
+      idle_fd_{IdleFd()} {
     sk_op_.SetReuseAddr(true);
     sk_op_.SetReusePort(true);
     sk_op_.Bind(addr);
@@ -20,6 +33,9 @@ Acceptor::Acceptor(EventLoop& loop, const InetAddr& addr)
 Acceptor::~Acceptor() {
     loop_.AssertInLoopThread();
     poll_fd_.RemoveFromLoop();
+    loop_.CancelTimer(resume_timer_);
+    if (idle_fd_ >= 0)
+        ::close(idle_fd_);
 }
 
 void Acceptor::Listen() {
@@ -29,14 +45,52 @@ void Acceptor::Listen() {
 }
 
 void Acceptor::HandleAccept() {
-    std::pair<int, InetAddr> conn_pair = sk_op_.Accept();
-    if (conn_pair.first < 0) {
-        // TODO: The idle file trick seems not perfect so maybe a soft limit
-        // should be used?
-    } else {
+    loop_.AssertInLoopThread();
+    new_conns_.clear();
+    for (int i = 0; i < accept_batch_; ++i) {
+        std::pair<int, InetAddr> conn_pair = sk_op_.Accept();
+        if (conn_pair.first >= 0) {
+            new_conns_.push_back(conn_pair);
+            continue;
+        }
+        if (errno == EMFILE || errno == ENFILE) {
+            if (!HandleFdExhaustion())
+                break;
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            // EAGAIN, or errors which can not be solved by retrying.
+            break;
+        }
+    }
+    if (!new_conns_.empty()) {
         assert(new_conn_cb_);
-        new_conn_cb_(conn_pair.first, conn_pair.second);
+        new_conn_cb_(new_conns_);
+    }
+}
+
+bool Acceptor::HandleFdExhaustion() {
+    if (idle_fd_ >= 0) {
+        LOG_WARN << "Acceptor(" << this << ") runs out of fds, "
+                 << "reject a pending connection";
+        ::close(idle_fd_);
+        int sk = ::accept(poll_fd_.Fd(), nullptr, nullptr);
+        if (sk >= 0)
+            ::close(sk);
+        idle_fd_ = IdleFd();
+        if (idle_fd_ >= 0)
+            return true;
     }
+    // The reserved fd is lost to another thread. Stop watching the listening
+    // socket for a while instead of spinning.
+    using namespace std::chrono_literals;
+    LOG_ERROR << "Acceptor(" << this << ") runs out of fds, "
+              << "pause accepting for 100 ms";
+    poll_fd_.DisableReading();
+    resume_timer_ = loop_.RunAfter(100ms, [this]() {
+        if (idle_fd_ < 0)
+            idle_fd_ = IdleFd();
+        poll_fd_.EnableReading();
+    });
+    return false;
 }
 
 }
@@ -1,12 +1,15 @@
 #ifndef _AXN_ACCEPTOR_HH_
 #define _AXN_ACCEPTOR_HH_
 
+#include <vector>
+#include <utility>
 #include <functional>
 #include <boost/core/noncopyable.hpp>
 
 #include "pollfd.hh"
 #include "inetaddr.hh"
 #include "socketop.hh"
+#include "timerid.hh"
 
 namespace axn {
 
@@ -15,21 +18,37 @@ class EventLoop;
 
 class Acceptor : private boost::noncopyable {
 public:
-    using NewConnCallback = std::function<void(int, const InetAddr&)>;
+    // Sockets and peer addresses accepted in one reading event.
+    using NewConns = std::vector<std::pair<int, InetAddr>>;
+    using NewConnCallback = std::function<void(const NewConns&)>;
 
     Acceptor(EventLoop& loop, const InetAddr& addr);
     ~Acceptor();
+    EventLoop& OwnerLoop() const { return loop_; }
     void SetNewConnCallback(NewConnCallback cb) { new_conn_cb_ = cb; }
+    // Maximum number of connections accepted in one reading event.
+    void SetAcceptBatch(int n) { accept_batch_ = n; }
+    // See SocketOp::SetIncomingCpu().
+    void SetIncomingCpu(int cpu) { sk_op_.SetIncomingCpu(cpu); }
     void Listen();
 
 private:
     void HandleAccept();
+    // Run out of fds. Return false if accepting has to be paused.
+    bool HandleFdExhaustion();
 
     EventLoop& loop_;
     InetAddr listen_addr_;
     PollFd poll_fd_;
     SocketOp sk_op_;
     NewConnCallback new_conn_cb_{};
+    int accept_batch_{16};
+    NewConns new_conns_{};
+    // Reserved fd which is released to accept and close pending connections
+    // when fds run out, or the level-triggered listening socket will keep the
+    // loop busy.
+    int idle_fd_;
+    TimerId resume_timer_{};
 };
 
 }
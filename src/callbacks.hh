@@ -1,6 +1,7 @@
 #ifndef _AXN_CALLBACKS_HH_
 #define _AXN_CALLBACKS_HH_
 
+#include <cstddef>
 #include <functional>
 #include <memory>
 #include <string>
@@ -8,11 +9,37 @@
 namespace axn {
 
 class TcpConn;
+class ChainBuffer;
 using TcpConnPtr = std::shared_ptr<TcpConn>;
+// Immutable message shared by the sending connections, which keep a
+// reference instead of a copy until it is sent.
+using SharedBuffer = std::shared_ptr<const std::string>;
 using ConnectedCallback = std::function<void(TcpConnPtr)>;
 using DisconnectedCallback = std::function<void(TcpConnPtr)>;
 using RecvCallback = std::function<void(TcpConnPtr, std::string)>;
+// Zero-copy alternative of RecvCallback. It gets the receiving buffer itself
+// and consumes as much as it can handle. The rest, e.g., a partial frame, is
+// kept for the next call with the bytes arriving later.
+using RecvBufferCallback = std::function<void(TcpConnPtr, ChainBuffer&)>;
 using WriteCompCallback = std::function<void(TcpConnPtr)>;
+// Called once when the unsent bytes buffered by a connection reach the high
+// mark, with their size, and once when they fall back to the low mark.
+using HighWaterMarkCallback = std::function<void(TcpConnPtr, std::size_t)>;
+using LowWaterMarkCallback = std::function<void(TcpConnPtr)>;
+// Called in the owner loop once the file range of TcpConn::SendFile() has
+// been written, with true, or dropped for closing or an error, with false.
+// The file may be closed from then on.
+using SendFileCallback = std::function<void(TcpConnPtr, bool)>;
+
+// What to do with a message whose unsent bytes would take the sending
+// buffer over its limit.
+enum class OverflowPolicy {
+    // Close the connection, e.g., a client too slow to keep up with.
+    kClose,
+    // Discard the message, e.g., a stale update. A message partly written
+    // has all the rest buffered anyway, so no message is ever cut.
+    kDrop
+};
 
 }
 #endif
@@ -0,0 +1,90 @@
+#include <cassert>
+#include <cerrno>
+
+#include "epoll_poller.hh"
+#include "pollfd.hh"
+#include "eventloop.hh"
+#include "util/log.hh"
+
+namespace axn {
+
+EpollPoller::EpollPoller(EventLoop& loop, std::size_t max_events_once)
+    : loop_{loop},
+      epfd_{::epoll_create1(EPOLL_CLOEXEC)},
+      events_{max_events_once} {
+    if (epfd_ < 0)
+        LOG_FATAL << "Creating epoll fd failed with errno " << errno
+                  << ": " << StrError(errno);
+}
+
+void EpollPoller::Poll(int timeout, std::vector<PollFd*>& ready_fds) {
+    int ready_num = ::epoll_wait(
+                        epfd_, &*events_.begin(), events_.size(), timeout);
+    if (ready_num < 0 && errno != EINTR)
+        LOG_FATAL << "epoll_wait() failed with errno " << errno
+                  << ": " << StrError(errno);
+    LOG_DEBUG << "Poll: " << ready_num << " events ready";
+    // Prepare ready fds.
+    ready_fds.clear();
+    for (int i = 0; i < ready_num; ++i) {
+        PollFd* fdp = static_cast<PollFd*>(events_[i].data.ptr);
+        fdp->SetRevents(events_[i].events);
+        ready_fds.push_back(fdp);
+    }
+    // There may be more ready fds than we could fetch.
+    if (static_cast<std::size_t>(ready_num) == events_.size())
+        events_.resize(events_.size() * 2);
+}
+
+void EpollPoller::UpdateFd(PollFd* fdp) {
+    loop_.AssertInLoopThread();
+    int fd = fdp->Fd();
+    assert(fd >= 0);
+    if (static_cast<std::size_t>(fd) >= fds_.size())
+        fds_.resize(fd + 1, nullptr);
+    if (fds_[fd] == nullptr) {
+        // A new one.
+        fds_[fd] = fdp;
+        EpollCtl(EPOLL_CTL_ADD, fdp);
+    } else if (fdp->CareNoEvent()) {
+        // TODO: Optimization
+        fds_[fd] = nullptr;
+        EpollCtl(EPOLL_CTL_DEL, fdp);
+    } else {
+        EpollCtl(EPOLL_CTL_MOD, fdp);
+    }
+}
+
+void EpollPoller::RemoveFd(PollFd* fdp) {
+    loop_.AssertInLoopThread();
+    int fd = fdp->Fd();
+    if (static_cast<std::size_t>(fd) < fds_.size() && fds_[fd] != nullptr) {
+        fds_[fd] = nullptr;
+        EpollCtl(EPOLL_CTL_DEL, fdp);
+    }
+}
+
+void EpollPoller::EpollCtl(int op, PollFd* fdp) {
+    LOG_DEBUG << "Poller: " << EpollOpToStr(op) << " fd " << fdp->Fd()
+              << " with events: " << fdp->EventsToStr();
+    CountCtl();
+    struct epoll_event event;
+    event.events = fdp->Events();
+    event.data.ptr = fdp;
+    int ctl_ret = ::epoll_ctl(epfd_, op, fdp->Fd(), &event);
+    if (ctl_ret < 0)
+        LOG_FATAL << "epoll_ctl() failed with errno " << errno
+                  << ": " << StrError(errno);
+}
+
+std::string EpollPoller::EpollOpToStr(int op) {
+    switch (op) {
+        case EPOLL_CTL_ADD: return "ADD";
+        case EPOLL_CTL_MOD: return "MOD";
+        case EPOLL_CTL_DEL: return "DEL";
+        default:
+            assert(false);
+    }
+}
+
+}
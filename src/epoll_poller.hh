@@ -0,0 +1,39 @@
+#ifndef _AXN_EPOLL_POLLER_HH_
+#define _AXN_EPOLL_POLLER_HH_
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "poller.hh"
+
+namespace axn {
+
+class EpollPoller : public Poller {
+public:
+    // The number of events fetched by one epoll_wait() starts from
+    // max_events_once and doubles whenever a full batch is returned.
+    EpollPoller(EventLoop& loop, std::size_t max_events_once = 16);
+    ~EpollPoller() override {
+        ::close(epfd_);
+    }
+    void Poll(int timeout, std::vector<PollFd*>& ready_fds) override;
+    void UpdateFd(PollFd* fdp) override;
+    void RemoveFd(PollFd* fdp) override;
+    bool SupportsEdgeTriggered() const override { return true; }
+
+private:
+    static std::string EpollOpToStr(int op);
+    void EpollCtl(int op, PollFd* fdp);
+
+    EventLoop& loop_;
+    int epfd_;
+    std::vector<struct epoll_event> events_;
+    // Registered PollFds indexed by fd.
+    std::vector<PollFd*> fds_{};
+};
+
+}
+#endif
@@ -2,13 +2,16 @@
 #include <cassert>
 #include <cerrno>
 #include <cstdint>
+#include <utility>
 #include <boost/format.hpp>
 #include <sys/eventfd.h>
+#include <sched.h>
 #include <unistd.h>
 
 #include "eventloop.hh"
 #include "poller.hh"
 #include "pollfd.hh"
+#include "timerqueue.hh"
 #include "util/log.hh"
 
 namespace axn {
@@ -26,12 +29,29 @@ int EventFd() {
     return fd;
 }
 
+// Maximum number of buffers per request of batched I/O.
+constexpr int kMaxBatchedIov = 8;
+
 } // unnamed namespace
 
-EventLoop::EventLoop()
+struct EventLoop::IoBatch {
+    std::vector<Poller::IoRequest> reqs{};
+    std::vector<PollFd*> fds{};
+    std::vector<struct iovec> iovs{};
+    // Queued by QueueBatchedWrite() with their completions, and being
+    // flushed.
+    std::vector<std::pair<PollFd*, Functor>> writes{};
+    std::vector<std::pair<PollFd*, Functor>> flushing{};
+};
+
+EventLoop::EventLoop() : EventLoop{DefaultPollerBackend()} {}
+
+EventLoop::EventLoop(PollerBackend backend)
     : thread_id_{std::this_thread::get_id()},
-      pollerp_{std::make_unique<Poller>(*this)},
-      wakeup_fdp_{std::make_unique<PollFd>(*this, EventFd())} {
+      pollerp_{NewPoller(*this, backend)},
+      timer_queuep_{std::make_unique<TimerQueue>(*this)},
+      wakeup_fdp_{std::make_unique<PollFd>(*this, EventFd())},
+      io_batchp_{std::make_unique<IoBatch>()} {
     LOG_INFO << "EventLoop(" << this << ") Created";
     if (tlocal_loop != nullptr) {
         LOG_FATAL << "Thread(" << boost::format("%#018x") % thread_id_
@@ -51,13 +71,45 @@ EventLoop::~EventLoop() {
 
 void EventLoop::Loop() {
     while (!quit_) {
-        ready_fds_ = pollerp_->Poll(poll_timeout_);
+        pollerp_->Poll(poll_timeout_, ready_fds_);
+        Clock::time_point busy_begin = Clock::now();
         HandleEvents();
         ready_fds_.clear();
         DoPendingTasks();
+        DoAfterEventsTasks();
+        // Only written here so a relaxed load-store is enough.
+        busy_time_.store(busy_time_.load(std::memory_order_relaxed) +
+                         (Clock::now() - busy_begin).count(),
+                         std::memory_order_relaxed);
     }
 }
 
+void EventLoop::Quit() {
+    quit_ = true;
+    // The loop may be blocked in polling.
+    if (!IsInLoopThread())
+        Wakeup();
+}
+
+void EventLoop::CountIncomingCpu(int cpu) {
+    AssertInLoopThread();
+    if (cpu >= 0 && cpu == ::sched_getcpu())
+        incoming_cpu_hits_.fetch_add(1, std::memory_order_relaxed);
+    else
+        incoming_cpu_misses_.fetch_add(1, std::memory_order_relaxed);
+}
+
+constexpr std::size_t EventLoop::kReadScratchSize;
+
+char* EventLoop::ReadScratch() {
+    AssertInLoopThread();
+    // Allocated on the first use, so the loops without connections do not
+    // pay for it.
+    if (!read_scratch_)
+        read_scratch_.reset(new char[kReadScratchSize]);
+    return read_scratch_.get();
+}
+
 void EventLoop::AssertInLoopThread() {
 #ifndef NDEBUG
     if (!IsInLoopThread())
@@ -85,6 +137,23 @@ void EventLoop::RemovePollFd(PollFd* fdp) {
     pollerp_->RemoveFd(fdp);
 }
 
+bool EventLoop::SupportsEdgeTriggered() const {
+    return pollerp_->SupportsEdgeTriggered();
+}
+
+bool EventLoop::SupportsBatchedIo() const {
+    return pollerp_->SupportsBatchedIo();
+}
+
+void EventLoop::QueueBatchedWrite(PollFd* fdp, Functor done) {
+    AssertInLoopThread();
+    io_batchp_->writes.emplace_back(fdp, std::move(done));
+    // Flushed after the after-events tasks queued so far, e.g., those of the
+    // other connections corked automatically.
+    if (io_batchp_->writes.size() == 1)
+        RunAfterEvents([this]() { FlushBatchedWrites(); });
+}
+
 void EventLoop::RunInLoop(Functor f) {
     if (IsInLoopThread()) {
         f();
@@ -94,18 +163,42 @@ void EventLoop::RunInLoop(Functor f) {
 }
 
 void EventLoop::QueueInLoop(Functor f) {
-    {
-        std::lock_guard<std::mutex> lock{pending_tasks_mutex_};
-        pending_tasks_.emplace_back(std::move(f));
-    }
-    // We can't directly append it to the vector of pending functors so it
-    // should be done in the next loop.
-    if (!IsInLoopThread() || doing_pending_tasks_)
-        Wakeup();
+    pending_tasks_.Push(std::move(f));
+    WakeupIfNeeded();
+}
+
+void EventLoop::QueueInLoopBatch(std::vector<Functor> fs) {
+    pending_tasks_.PushBatch(fs.begin(), fs.end());
+    WakeupIfNeeded();
+}
+
+void EventLoop::RunAfterEvents(Functor f) {
+    AssertInLoopThread();
+    after_events_tasks_.push_back(std::move(f));
+}
+
+TimerId EventLoop::RunAt(Clock::time_point when, Functor f) {
+    return timer_queuep_->AddTimer(when, Clock::duration::zero(),
+                                   std::move(f));
+}
+
+TimerId EventLoop::RunAfter(Clock::duration delay, Functor f) {
+    return RunAt(Clock::now() + delay, std::move(f));
+}
+
+TimerId EventLoop::RunEvery(Clock::duration interval, Functor f) {
+    return timer_queuep_->AddTimer(Clock::now() + interval, interval,
+                                   std::move(f));
+}
+
+void EventLoop::CancelTimer(TimerId id) {
+    timer_queuep_->Cancel(id);
 }
 
 void EventLoop::HandleEvents() {
     event_handling_ = true;
+    if (pollerp_->SupportsBatchedIo())
+        DoIoAhead();
     for (const auto& fdp : ready_fds_) {
         cur_handling_fd_ = fdp;
         fdp->HandleEvent();
@@ -114,18 +207,113 @@ void EventLoop::HandleEvents() {
     event_handling_ = false;
 }
 
+void EventLoop::DoIoAhead() {
+    // Read and write for all the ready fds with one system call, so that
+    // their callbacks find the results instead of making one each.
+    IoBatch& batch = *io_batchp_;
+    batch.reqs.clear();
+    batch.fds.clear();
+    batch.iovs.resize(std::max(batch.iovs.size(),
+                               2 * ready_fds_.size() * kMaxBatchedIov));
+    for (PollFd* fdp : ready_fds_) {
+        if (fdp->Revents() & EPOLLIN)
+            AddBatchedIo(fdp, false);
+        if (fdp->Revents() & EPOLLOUT)
+            AddBatchedIo(fdp, true);
+    }
+    SubmitBatchedIo();
+}
+
+void EventLoop::FlushBatchedWrites() {
+    IoBatch& batch = *io_batchp_;
+    // The writes queued by the completions make another batch.
+    batch.flushing.swap(batch.writes);
+    batch.reqs.clear();
+    batch.fds.clear();
+    batch.iovs.resize(std::max(batch.iovs.size(),
+                               batch.flushing.size() * kMaxBatchedIov));
+    for (auto& write : batch.flushing)
+        AddBatchedIo(write.first, true);
+    SubmitBatchedIo();
+    for (auto& write : batch.flushing)
+        write.second();
+    batch.flushing.clear();
+}
+
+void EventLoop::AddBatchedIo(PollFd* fdp, bool write) {
+    IoBatch& batch = *io_batchp_;
+    struct iovec* iov = &batch.iovs[batch.reqs.size() * kMaxBatchedIov];
+    int iov_num = write ? fdp->WriteBufs(iov, kMaxBatchedIov)
+                        : fdp->ReadBufs(iov, kMaxBatchedIov);
+    if (iov_num <= 0)
+        return;
+    batch.reqs.push_back(Poller::IoRequest{fdp->Fd(), write, iov, iov_num,
+                                           0});
+    batch.fds.push_back(fdp);
+}
+
+void EventLoop::SubmitBatchedIo() {
+    IoBatch& batch = *io_batchp_;
+    if (batch.reqs.empty())
+        return;
+    pollerp_->SubmitIo(batch.reqs);
+    for (std::size_t i = 0; i < batch.reqs.size(); ++i) {
+        const Poller::IoRequest& req = batch.reqs[i];
+        // EAGAIN is expected, e.g., for a spurious readiness.
+        if (req.res < 0 && req.res != -EAGAIN && req.res != -EWOULDBLOCK)
+            LOG_ERROR << "Batched " << (req.write ? "writing" : "reading")
+                      << " on fd " << req.fd << " failed with errno "
+                      << -req.res << " : " << StrError(-req.res);
+        if (req.write)
+            batch.fds[i]->SetWriteResult(req.res);
+        else
+            batch.fds[i]->SetReadResult(req.res);
+    }
+}
+
 void EventLoop::DoPendingTasks() {
     doing_pending_tasks_ = true;
-    std::vector<Functor> workload{};
-    {
-        std::lock_guard<std::mutex> lock{pending_tasks_mutex_};
-        workload.swap(pending_tasks_);
+    // Reset it before draining so that a producer racing with us either has
+    // its task drained now or wakes up the next loop iteration.
+    wakeup_pending_.store(false);
+    // Tasks queued by the running tasks are left to the next loop iteration.
+    Functor f{};
+    while (pending_tasks_.Pop(f))
+        workload_.push_back(std::move(f));
+    // Release the captures of each task right after running it, so that a
+    // task can not unexpectedly hold the last reference to an object owned by
+    // another loop until the end of this batch.
+    for (auto& task : workload_) {
+        task();
+        task = nullptr;
     }
-    for (const auto& f : workload)
+    workload_.clear();
+    doing_pending_tasks_ = false;
+}
+
+void EventLoop::DoAfterEventsTasks() {
+    // Pending tasks queued by these ones are also left to the next loop
+    // iteration, which has to be woken up.
+    doing_pending_tasks_ = true;
+    // Tasks added by the running ones run in this round as well. Each is
+    // moved out first since the vector may grow meanwhile.
+    for (std::size_t i = 0; i < after_events_tasks_.size(); ++i) {
+        Functor f{std::move(after_events_tasks_[i])};
         f();
+    }
+    after_events_tasks_.clear();
     doing_pending_tasks_ = false;
 }
 
+void EventLoop::WakeupIfNeeded() {
+    // We can't directly append it to the vector of pending functors so it
+    // should be done in the next loop. The same goes for the tasks queued by
+    // the after-events tasks, which run after the queue is drained.
+    if ((!IsInLoopThread() || doing_pending_tasks_) &&
+        !wakeup_pending_.exchange(true))
+        Wakeup();
+}
+
 void EventLoop::Wakeup() {
     std::uint64_t one = 1;
     int n = ::write(wakeup_fdp_->Fd(), &one, sizeof(one));
@@ -3,33 +3,57 @@
 
 #include <vector>
 #include <thread>
+#include <chrono>
 #include <memory>
-#include <functional>
-#include <mutex>
 #include <atomic>
 #include <boost/core/noncopyable.hpp>
 
+#include "timerid.hh"
+#include "util/mpscqueue.hh"
+#include "util/task.hh"
+
 namespace axn {
 
 // Forward declaration.
 class PollFd;
 class Poller;
+class TimerQueue;
+enum class PollerBackend;
 
 class EventLoop : private boost::noncopyable {
 public:
-    using Functor = std::function<void()>;
+    // Move-only and allocation-free for typical captures.
+    using Functor = Task;
+    using Clock = std::chrono::steady_clock;
 
+    // Use DefaultPollerBackend().
     EventLoop();
+    explicit EventLoop(PollerBackend backend);
     ~EventLoop();
 
     // Trivial getters/setters.
+    // Timers do not rely on the poll timeout. The default of 10s only
+    // bounds the delay of a missed wakeup.
     void SetPollTimeOut(int timeout) { poll_timeout_ = timeout; }
-    void Quit() { quit_ = true; }
 
     // Non-trivial member functions.
     void Loop();
+    // Thread safe.
+    void Quit();
     void RunInLoop(Functor f);
     void QueueInLoop(Functor f);
+    // Queue all the functors with at most one wakeup.
+    void QueueInLoopBatch(std::vector<Functor> fs);
+    // In loop thread only. Run f once the events and the pending tasks of
+    // this iteration have been handled, e.g., to flush the output gathered
+    // meanwhile.
+    void RunAfterEvents(Functor f);
+
+    // Timers. Thread safe.
+    TimerId RunAt(Clock::time_point when, Functor f);
+    TimerId RunAfter(Clock::duration delay, Functor f);
+    TimerId RunEvery(Clock::duration interval, Functor f);
+    void CancelTimer(TimerId id);
 
     // Helpers.
     bool IsInLoopThread() const {
@@ -37,16 +61,66 @@ public:
     void AssertInLoopThread();
     void UpdatePollFd(PollFd* fdp);
     void RemovePollFd(PollFd* fdp);
+    bool SupportsEdgeTriggered() const;
+    // Whether the poller does the socket I/O of many fds with one system
+    // call. If so, the loop reads and writes ahead for the ready fds before
+    // handling their events, see PollFd::SetIoBufSource().
+    bool SupportsBatchedIo() const;
+    // In loop thread only, with batched I/O. Write from the buffers of fdp
+    // together with the other fds queued in this round after the events,
+    // then run done, which has to keep fdp in this loop until then.
+    void QueueBatchedWrite(PollFd* fdp, Functor done);
+
+    // Load statistics, readable from any thread.
+    // Number of connected TcpConn objects owned by this loop.
+    int ConnNum() const { return conn_num_.load(std::memory_order_relaxed); }
+    void AddConnNum(int delta) {
+        conn_num_.fetch_add(delta, std::memory_order_relaxed); }
+    // Total time spent on handling events and pending tasks, i.e., not
+    // blocked in polling.
+    Clock::duration BusyTime() const {
+        return Clock::duration{busy_time_.load(std::memory_order_relaxed)}; }
+    // Whether the packets of the new connections were processed on the cpu
+    // running this loop. Cache lines of such connections need not move.
+    void CountIncomingCpu(int cpu);
+    long IncomingCpuHits() const {
+        return incoming_cpu_hits_.load(std::memory_order_relaxed); }
+    long IncomingCpuMisses() const {
+        return incoming_cpu_misses_.load(std::memory_order_relaxed); }
+
+    // Scratch space shared by the connections of this loop for reading, so
+    // that they need not keep large receiving buffers. Its content is only
+    // valid until the handler using it returns.
+    static constexpr std::size_t kReadScratchSize = 65536;
+    char* ReadScratch();
+
+    // The cpu this loop is pinned to, -1 if not pinned. Set by
+    // EventLoopPool before looping.
+    void SetPinnedCpu(int cpu) { pinned_cpu_ = cpu; }
+    int PinnedCpu() const { return pinned_cpu_; }
 
 private:
+    // Buffers and requests of batched I/O.
+    struct IoBatch;
+
     void HandleEvents();
     void DoPendingTasks();
+    void DoAfterEventsTasks();
     void Wakeup();
+    // Wake up the loop unless a wakeup is already pending.
+    void WakeupIfNeeded();
     void HandleWakeupFdReading();
+    // Batched I/O.
+    void DoIoAhead();
+    void FlushBatchedWrites();
+    void AddBatchedIo(PollFd* fdp, bool write);
+    void SubmitBatchedIo();
 
     std::thread::id thread_id_;
     // Use unique_ptr to reduce header dependencies.
     std::unique_ptr<Poller> pollerp_;
+    // It has to be declared after pollerp_ for its PollFd.
+    std::unique_ptr<TimerQueue> timer_queuep_;
     std::vector<PollFd*> ready_fds_{};
     PollFd* cur_handling_fd_{nullptr};
     int poll_timeout_{10000};
@@ -54,10 +128,22 @@ private:
     std::atomic_bool quit_{false};
     std::atomic_bool event_handling_{false};
     // Variables for pending tasks.
-    mutable std::mutex pending_tasks_mutex_{};
-    std::vector<Functor> pending_tasks_{};
+    MpscQueue<Functor> pending_tasks_{};
+    std::vector<Functor> workload_{};
+    std::vector<Functor> after_events_tasks_{};
     std::unique_ptr<PollFd> wakeup_fdp_;
     std::atomic_bool doing_pending_tasks_{false};
+    // Set by the first producer after the loop starts draining the queue so
+    // that successive producers skip writing to the wakeup fd.
+    std::atomic_bool wakeup_pending_{false};
+    // Load statistics.
+    std::atomic<int> conn_num_{0};
+    std::atomic<Clock::rep> busy_time_{0};
+    std::atomic<long> incoming_cpu_hits_{0};
+    std::atomic<long> incoming_cpu_misses_{0};
+    int pinned_cpu_{-1};
+    std::unique_ptr<IoBatch> io_batchp_;
+    std::unique_ptr<char[]> read_scratch_{};
 };
 
 }
@@ -1,10 +1,23 @@
 #include <cassert>
+#include <algorithm>
 
 #include "eventloop_pool.hh"
 #include "eventloop.hh"
+#include "util/affinity.hh"
+#include "util/log.hh"
 
 namespace axn {
 
+namespace {
+
+// Length of the period in which the busy ratio of the loops is measured.
+constexpr auto kBusySamplePeriod = std::chrono::milliseconds{100};
+// Busy ratios closer than this are considered the same, or all the new
+// connections of a period would go to the same loop.
+constexpr double kBusyRatioTolerance = 0.05;
+
+} // unnamed namespace
+
 EventLoopPool::~EventLoopPool() {
     // std::thread can only be destructed after being joined or detached.
     if (running_)
@@ -19,12 +32,22 @@ void EventLoopPool::SetThreadNum(int n) {
 void EventLoopPool::Start() {
     running_ = true;
     for (int i = 0; i < thread_num_; ++i) {
-        thread_pool_.emplace_back([&]() { LoopThreadFunc(); });
+        thread_pool_.emplace_back([this, i]() { LoopThreadFunc(i); });
     }
     std::unique_lock<std::mutex> lock{loop_pool_mutex_};
     while (loop_pool_.size() != thread_num_) {
         loop_pool_ready_.wait(lock);
     }
+    for (EventLoop* loopp : loop_pool_) {
+        int cpu = loopp->PinnedCpu();
+        if (cpu < 0)
+            continue;
+        if (cpu >= static_cast<int>(cpu_loops_.size()))
+            cpu_loops_.resize(cpu + 1, nullptr);
+        // The first one wins if several loops share a cpu.
+        if (cpu_loops_[cpu] == nullptr)
+            cpu_loops_[cpu] = loopp;
+    }
 }
 
 void EventLoopPool::Stop() {
@@ -37,19 +60,93 @@ void EventLoopPool::Stop() {
     }
     thread_pool_.clear();
     loop_pool_.clear();
+    cpu_loops_.clear();
 }
 
-EventLoop& EventLoopPool::GetNextLoop() {
-    if (thread_num_ == 0) {
+EventLoop& EventLoopPool::GetNextLoop(std::size_t key) {
+    if (thread_num_ == 0)
         return loop_;
-    } else {
-        next_id_ = (next_id_ + 1) % thread_num_;
-        return *loop_pool_[next_id_];
+    switch (policy_) {
+        case LoopSelectPolicy::kLeastConns:
+            return **std::min_element(loop_pool_.begin(), loop_pool_.end(),
+                                      [](EventLoop* lhs, EventLoop* rhs) {
+                                          return lhs->ConnNum() <
+                                                 rhs->ConnNum(); });
+        case LoopSelectPolicy::kLeastBusy:
+            return GetLeastBusyLoop();
+        case LoopSelectPolicy::kHashKey:
+            return *loop_pool_[key % loop_pool_.size()];
+        case LoopSelectPolicy::kIncomingCpu: {
+            EventLoop* loopp = GetLoopOnCpu(static_cast<int>(key));
+            return loopp != nullptr ? *loopp : GetRoundRobinLoop();
+        }
+        case LoopSelectPolicy::kRoundRobin:
+        default:
+            return GetRoundRobinLoop();
+    }
+}
+
+EventLoop* EventLoopPool::GetLoopOnCpu(int cpu) const {
+    if (cpu < 0 || cpu >= static_cast<int>(cpu_loops_.size()))
+        return nullptr;
+    return cpu_loops_[cpu];
+}
+
+EventLoop& EventLoopPool::GetRoundRobinLoop() {
+    next_id_ = (next_id_ + 1) % thread_num_;
+    return *loop_pool_[next_id_];
+}
+
+EventLoop& EventLoopPool::GetLeastBusyLoop() {
+    SampleBusyRatio();
+    std::size_t best = 0;
+    for (std::size_t i = 1; i < loop_pool_.size(); ++i) {
+        double diff = busy_ratios_[i] - busy_ratios_[best];
+        if (diff < -kBusyRatioTolerance ||
+            (diff <= kBusyRatioTolerance &&
+             loop_pool_[i]->ConnNum() < loop_pool_[best]->ConnNum()))
+            best = i;
+    }
+    return *loop_pool_[best];
+}
+
+void EventLoopPool::SampleBusyRatio() {
+    auto now = std::chrono::steady_clock::now();
+    if (last_busy_times_.size() != loop_pool_.size()) {
+        last_sample_ = now;
+        last_busy_times_.clear();
+        for (EventLoop* loopp : loop_pool_)
+            last_busy_times_.push_back(loopp->BusyTime());
+        busy_ratios_.assign(loop_pool_.size(), 0.0);
+        return;
     }
+    auto period = now - last_sample_;
+    if (period < kBusySamplePeriod)
+        return;
+    for (std::size_t i = 0; i < loop_pool_.size(); ++i) {
+        auto busy_time = loop_pool_[i]->BusyTime();
+        busy_ratios_[i] = static_cast<double>(
+                              (busy_time - last_busy_times_[i]).count()) /
+                          period.count();
+        last_busy_times_[i] = busy_time;
+    }
+    last_sample_ = now;
 }
 
-void EventLoopPool::LoopThreadFunc() {
+void EventLoopPool::LoopThreadFunc(int id) {
+    int cpu = -1;
+    if (!cpus_.empty()) {
+        cpu = cpus_[id % cpus_.size()];
+        if (PinThisThread(cpu))
+            LOG_INFO << "Loop thread " << id << " is pinned to cpu " << cpu
+                     << " on node " << CpuNode(cpu);
+        else
+            cpu = -1;
+    }
     EventLoop loop;
+    loop.SetPinnedCpu(cpu);
+    if (thread_init_cb_)
+        thread_init_cb_(loop);
     {
         std::lock_guard<std::mutex> lock{loop_pool_mutex_};
         loop_pool_.push_back(&loop);
@@ -6,6 +6,9 @@
 #include <condition_variable>
 #include <atomic>
 #include <thread>
+#include <functional>
+#include <chrono>
+#include <cstddef>
 #include <boost/core/noncopyable.hpp>
 
 namespace axn {
@@ -13,31 +16,72 @@ namespace axn {
 // Forward declaration.
 class EventLoop;
 
+// How GetNextLoop() assigns a loop.
+enum class LoopSelectPolicy {
+    kRoundRobin,
+    // The loop owning the fewest connections.
+    kLeastConns,
+    // The loop with the lowest busy ratio in the recent sampling period,
+    // breaking near ties with the number of connections.
+    kLeastBusy,
+    // The same key always maps to the same loop.
+    kHashKey,
+    // The key is a cpu and the loop pinned to it is selected, or round-robin
+    // if there is none.
+    kIncomingCpu
+};
+
 class EventLoopPool : private boost::noncopyable {
 public:
+    // Called in every loop thread before looping.
+    using ThreadInitCallback = std::function<void(EventLoop&)>;
+
     EventLoopPool(EventLoop& loop) : loop_{loop} {}
     ~EventLoopPool();
 
     void SetThreadNum(int n);
+    // Pin the i-th loop thread to cpus[i % cpus.size()]. The loop is created
+    // after pinning so that its memory, and that of the connections created
+    // in it, comes from the local NUMA node. Must be called before Start().
+    void SetCpuList(std::vector<int> cpus) { cpus_ = std::move(cpus); }
+    void SetThreadInitCallback(ThreadInitCallback cb) {
+        thread_init_cb_ = std::move(cb); }
+    void SetSelectPolicy(LoopSelectPolicy policy) { policy_ = policy; }
     bool IsRunning() const { return running_; }
     void Start();
     void Stop();
-    // Round-robin.
-    EventLoop& GetNextLoop();
+    // Select a loop with the policy. key is only used by kHashKey. Not
+    // thread safe.
+    EventLoop& GetNextLoop(std::size_t key = 0);
+    // The loop pinned to the cpu, or nullptr if there is none.
+    EventLoop* GetLoopOnCpu(int cpu) const;
     std::vector<EventLoop*> GetAllLoop() const { return loop_pool_; }
 
 private:
-    void LoopThreadFunc();
+    void LoopThreadFunc(int id);
+    EventLoop& GetRoundRobinLoop();
+    EventLoop& GetLeastBusyLoop();
+    // Sample the busy time of all loops if the last period has ended.
+    void SampleBusyRatio();
 
     EventLoop& loop_;
     // Normal bool may cause Stop() to be called twice.
     std::atomic_bool running_{false};
     int thread_num_{0};
     int next_id_{-1};
+    LoopSelectPolicy policy_{LoopSelectPolicy::kRoundRobin};
+    // For kLeastBusy.
+    std::chrono::steady_clock::time_point last_sample_{};
+    std::vector<std::chrono::steady_clock::duration> last_busy_times_{};
+    std::vector<double> busy_ratios_{};
     std::vector<std::thread> thread_pool_{};
     mutable std::mutex loop_pool_mutex_{};
     mutable std::condition_variable loop_pool_ready_{};
     std::vector<EventLoop*> loop_pool_{};
+    std::vector<int> cpus_{};
+    // Indexed by cpu.
+    std::vector<EventLoop*> cpu_loops_{};
+    ThreadInitCallback thread_init_cb_{};
 };
 
 }
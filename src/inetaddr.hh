@@ -23,6 +23,8 @@ public:
     // Get printable address.
     std::uint16_t Port() const;
     std::string Ip() const;
+    // IPv4 address in network byte order, e.g. for hashing.
+    std::uint32_t RawIp() const { return addr_.sin_addr.s_addr; }
 private:
     struct sockaddr_in addr_{};
 };
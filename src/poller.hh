@@ -1,13 +1,12 @@
 #ifndef _AXN_POLLER_HH_
 #define _AXN_POLLER_HH_
 
-#include <string>
-#include <map>
 #include <vector>
-#include <cstdlib>
+#include <memory>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <boost/core/noncopyable.hpp>
-#include <unistd.h>
-#include <sys/epoll.h>
 
 namespace axn {
 
@@ -15,25 +14,56 @@ namespace axn {
 class EventLoop;
 class PollFd;
 
+enum class PollerBackend {
+    kEpoll,
+    kUring
+};
+
+// I/O multiplexing interface used by EventLoop. All member functions are
+// called in the loop thread.
 class Poller : private boost::noncopyable {
 public:
-    Poller(EventLoop& loop, std::size_t max_events_once = 16);
-    ~Poller() {
-        ::close(epfd_);
-    }
-    std::vector<PollFd*> Poll(int timeout);
-    void UpdateFd(PollFd* fdp);
-    void RemoveFd(PollFd* fdp);
-
-private:
-    static std::string EpollOpToStr(int op);
-    void EpollCtl(int op, PollFd* fdp);
-
-    EventLoop& loop_;
-    int epfd_;
-    std::vector<struct epoll_event> events_;
-    std::map<int, PollFd*> fd_map_{};
+    // Reading or writing of a socket done by SubmitIo().
+    struct IoRequest {
+        int fd;
+        bool write;
+        const struct iovec* iov;
+        int iov_num;
+        // Bytes transferred, or -errno.
+        ssize_t res;
+    };
+
+    virtual ~Poller() = default;
+    // Fill ready_fds, which is owned by the caller and reused across calls
+    // so that polling does not allocate in steady state.
+    virtual void Poll(int timeout, std::vector<PollFd*>& ready_fds) = 0;
+    virtual void UpdateFd(PollFd* fdp) = 0;
+    virtual void RemoveFd(PollFd* fdp) = 0;
+    virtual bool SupportsEdgeTriggered() const = 0;
+    // Whether SubmitIo() does all the requests with a single system call.
+    virtual bool SupportsBatchedIo() const { return false; }
+    // Do the requests without blocking, like recvmsg() and sendmsg() with
+    // MSG_DONTWAIT, and set their results. One call per request by default.
+    virtual void SubmitIo(std::vector<IoRequest>& reqs);
+
+protected:
+    // Count one registration change for PollerCtlCount().
+    static void CountCtl();
 };
 
+// Create a poller of the given backend. Fall back to epoll if the kernel does
+// not support io_uring.
+std::unique_ptr<Poller> NewPoller(EventLoop& loop, PollerBackend backend);
+
+// Number of registration changes, i.e., epoll_ctl() calls or io_uring poll
+// requests, made by all pollers so far. For statistics.
+std::uint64_t PollerCtlCount();
+
+// Backend used by EventLoops created without specifying one. It is
+// initialized from the environment variable AXN_POLLER ("epoll" or "uring")
+// and defaults to epoll. Thread safe.
+PollerBackend DefaultPollerBackend();
+void SetDefaultPollerBackend(PollerBackend backend);
+
 }
 #endif
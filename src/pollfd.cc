@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <cassert>
+#include <cerrno>
 
 #include "pollfd.hh"
 #include "eventloop.hh"
@@ -32,9 +33,45 @@ void PollFd::HandleEvent() {
 }
 
 void PollFd::RemoveFromLoop() {
-    loop_.AssertInLoopThread();
+    loopp_->AssertInLoopThread();
     is_in_loop_ = false;
-    loop_.RemovePollFd(this);
+    loopp_->RemovePollFd(this);
+}
+
+void PollFd::MoveToLoop(EventLoop& loop) {
+    assert(!event_handling_);
+    RemoveFromLoop();
+    loopp_ = &loop;
+}
+
+int PollFd::ReadBufs(struct iovec* iov, int max_iov) {
+    read_done_ = false;
+    return io_buf_srcp_ ? io_buf_srcp_->ReadAheadIov(iov, max_iov) : 0;
+}
+
+int PollFd::WriteBufs(struct iovec* iov, int max_iov) {
+    write_done_ = false;
+    return io_buf_srcp_ ? io_buf_srcp_->WriteAheadIov(iov, max_iov) : 0;
+}
+
+bool PollFd::TakeReadResult(ssize_t* np) {
+    if (!read_done_)
+        return false;
+    read_done_ = false;
+    *np = read_res_ < 0 ? -1 : read_res_;
+    if (read_res_ < 0)
+        errno = static_cast<int>(-read_res_);
+    return true;
+}
+
+bool PollFd::TakeWriteResult(ssize_t* np) {
+    if (!write_done_)
+        return false;
+    write_done_ = false;
+    *np = write_res_ < 0 ? -1 : write_res_;
+    if (write_res_ < 0)
+        errno = static_cast<int>(-write_res_);
+    return true;
 }
 
 int PollFd::DetachFd() {
@@ -43,9 +80,9 @@ int PollFd::DetachFd() {
 }
 
 void PollFd::NotifyLoop() {
-    loop_.AssertInLoopThread();
+    loopp_->AssertInLoopThread();
     is_in_loop_ = true;
-    loop_.UpdatePollFd(this);
+    loopp_->UpdatePollFd(this);
 }
 
 std::string PollFd::EventsToStr(int events) {
@@ -63,6 +100,8 @@ std::string PollFd::EventsToStr(int events) {
     } else if (events & EPOLLHUP) {
         events_str_ += "HUP ";
     }
+    if (events & EPOLLET)
+        events_str_ += "ET ";
     return events_str_;
 }
 
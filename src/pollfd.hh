@@ -2,9 +2,13 @@
 #define _AXN_POLLFD_HH_
 
 #include <string>
-#include <functional>
 #include <boost/core/noncopyable.hpp>
 #include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "util/task.hh"
+#include "util/slabpool.hh"
 
 namespace axn {
 
@@ -12,34 +16,60 @@ namespace axn {
 class EventLoop;
 
 // Responsible for the management of the life cycle of the contained fd.
-class PollFd : private boost::noncopyable {
+class PollFd : public SlabPoolAllocated, private boost::noncopyable {
 public:
-    using EventCallback = std::function<void()>;
+    using EventCallback = Task;
+    // Owner of the buffers of batched I/O, e.g., a TcpConn. Each getter
+    // fills the buffers to read into or to write from, and returns their
+    // number, 0 for nothing.
+    class IoBufSource {
+    public:
+        virtual int ReadAheadIov(struct iovec* iov, int max_iov) = 0;
+        virtual int WriteAheadIov(struct iovec* iov, int max_iov) = 0;
+
+    protected:
+        ~IoBufSource() = default;
+    };
 
-    PollFd(EventLoop& loop, int fd) : loop_{loop}, fd_{fd} {}
+    PollFd(EventLoop& loop, int fd) : loopp_{&loop}, fd_{fd} {}
     ~PollFd();
 
     // Trivial getters and setters.
     int Fd() const { return fd_; }
     int Events() const { return events_; }
     void SetRevents(int revents) { revents_ = revents; }
+    int Revents() const { return revents_; }
     std::string EventsToStr() const { return EventsToStr(events_); }
     std::string ReventsToStr() const { return EventsToStr(revents_); }
 
     // Event switchers.
     void EnableReading() { events_ |= kETRead; NotifyLoop(); }
     void DisableReading() { events_ &= ~kETRead; NotifyLoop(); }
+    // Stop watching reading but keep the fd registered for the hang-up and
+    // error events, which would be lost with an empty mask removing the fd.
+    void PauseReading() {
+        events_ = (events_ & ~kETRead) | EPOLLHUP | EPOLLERR; NotifyLoop(); }
     void EnableWriting() { events_ |= kETWrite; NotifyLoop(); }
     void DisableWriting() { events_ &= ~kETWrite; NotifyLoop(); }
     void DisableRw() { events_ = 0; NotifyLoop(); }
+    // Watch reading, writing and peer closing at once in edge-triggered mode
+    // so that no more updates are needed until the fd is removed.
+    void EnableEdgeTriggered() {
+        events_ = kETRead | kETWrite | EPOLLRDHUP | EPOLLET; NotifyLoop(); }
     bool IsReading() const { return events_ & kETRead; }
     bool IsWriting() const { return events_ & kETWrite; }
+    bool IsEdgeTriggered() const { return events_ & EPOLLET; }
     bool CareNoEvent() const { return events_ == 0; }
 
     // Callback setters.
-    void SetReadCallback(EventCallback cb) { read_cb_ = cb; }
-    void SetWriteCallback(EventCallback cb) { write_cb_ = cb; }
-    void SetErrorCallback(EventCallback cb) { err_cb_ = cb; }
+    void SetReadCallback(EventCallback cb) { read_cb_ = std::move(cb); }
+    void SetWriteCallback(EventCallback cb) { write_cb_ = std::move(cb); }
+    void SetErrorCallback(EventCallback cb) { err_cb_ = std::move(cb); }
+    // Batched I/O, done by the loop for all the ready fds at once if the
+    // poller supports it. The source gives where to read into when the fd is
+    // readable and what to write when it is writable, if anything, and the
+    // results are kept until taken by the event callbacks.
+    void SetIoBufSource(IoBufSource* srcp) { io_buf_srcp_ = srcp; }
 
     // Non-trivial member functions.
     void HandleEvent();
@@ -49,6 +79,20 @@ public:
     void RemoveFromLoop();
     // Detach the life cycle of fd.
     int DetachFd();
+    // Stop watching the fd in the current loop and hand it over to the other
+    // one. Called in the current loop. AttachToLoop() has to be called later
+    // in the new loop to watch the same events again.
+    void MoveToLoop(EventLoop& loop);
+    void AttachToLoop() { if (!CareNoEvent()) NotifyLoop(); }
+    // For batched I/O. The buffer getters return 0 without a source.
+    int ReadBufs(struct iovec* iov, int max_iov);
+    int WriteBufs(struct iovec* iov, int max_iov);
+    void SetReadResult(ssize_t res) { read_res_ = res; read_done_ = true; }
+    void SetWriteResult(ssize_t res) { write_res_ = res; write_done_ = true; }
+    // Return false if nothing has been done. Otherwise *np is set like the
+    // return value of readv() or writev(), and so is errno on failure.
+    bool TakeReadResult(ssize_t* np);
+    bool TakeWriteResult(ssize_t* np);
 
 private:
     enum EventType {
@@ -59,13 +103,18 @@ private:
     void NotifyLoop();
     static std::string EventsToStr(int events);
 
-    EventLoop& loop_;
+    EventLoop* loopp_;
     int fd_;
     int events_{0};
     int revents_{0};
     EventCallback read_cb_{};
     EventCallback write_cb_{};
     EventCallback err_cb_{};
+    IoBufSource* io_buf_srcp_{nullptr};
+    ssize_t read_res_{0};
+    ssize_t write_res_{0};
+    bool read_done_{false};
+    bool write_done_{false};
     bool event_handling_{false};
     bool is_in_loop_{false};
     bool fd_detached_{false};
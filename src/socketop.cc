@@ -1,6 +1,7 @@
 #include <cerrno>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
+#include <sys/sendfile.h>
 
 #include "socketop.hh"
 #include "inetaddr.hh"
@@ -26,9 +27,13 @@ std::pair<int, InetAddr> SocketOp::Accept() {
     socklen_t addr_len = addr.SockAddrLen();
     int sk = ::accept4(sk_, addr.SockAddr(), &addr_len,
                        SOCK_NONBLOCK | SOCK_CLOEXEC);
-    if (sk < 0)
+    // EAGAIN is expected when accepting in a loop. Keep errno for the caller.
+    if (sk < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
         LOG_ERROR << "Accept() on socket " << sk_ << " failed with errno "
                   << errno << " : " << StrError(errno);
+        errno = saved_errno;
+    }
     return {sk, addr};
 }
 
@@ -44,17 +49,63 @@ int SocketOp::Connect(const InetAddr& addr) {
 
 ssize_t SocketOp::Recv(void* buf, std::size_t size) {
     ssize_t n = ::recv(sk_, buf, size, 0);
-    if (n < 0)
+    // EAGAIN is expected when draining an edge-triggered socket. Keep errno
+    // for the caller.
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
         LOG_ERROR << "Recv() on socket " << sk_ << " failed with errno "
                   << errno << " : " << StrError(errno);
+        errno = saved_errno;
+    }
     return n;
 }
 
 ssize_t SocketOp::Send(const void* buf, std::size_t size) {
     ssize_t n = ::send(sk_, buf, size, 0);
-    if (n < 0)
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
         LOG_ERROR << "Send() on socket " << sk_ << " failed with errno "
                   << errno << " : " << StrError(errno);
+        errno = saved_errno;
+    }
+    return n;
+}
+
+ssize_t SocketOp::Readv(const struct iovec* iov, int iov_num) {
+    ssize_t n = ::readv(sk_, iov, iov_num);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
+        LOG_ERROR << "Readv() on socket " << sk_ << " failed with errno "
+                  << errno << " : " << StrError(errno);
+        errno = saved_errno;
+    }
+    return n;
+}
+
+ssize_t SocketOp::Writev(const struct iovec* iov, int iov_num) {
+    // sendmsg() instead of writev() to keep the flags of send().
+    struct msghdr msg{};
+    msg.msg_iov = const_cast<struct iovec*>(iov);
+    msg.msg_iovlen = iov_num;
+    ssize_t n = ::sendmsg(sk_, &msg, 0);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
+        LOG_ERROR << "Writev() on socket " << sk_ << " failed with errno "
+                  << errno << " : " << StrError(errno);
+        errno = saved_errno;
+    }
+    return n;
+}
+
+ssize_t SocketOp::SendFile(int fd, off_t* offsetp, std::size_t size) {
+    ssize_t n = ::sendfile(sk_, fd, offsetp, size);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        int saved_errno = errno;
+        LOG_ERROR << "SendFile() of file " << fd << " on socket " << sk_
+                  << " failed with errno " << errno << " : "
+                  << StrError(errno);
+        errno = saved_errno;
+    }
     return n;
 }
 
@@ -118,6 +169,26 @@ InetAddr SocketOp::GetPeerAddr() const {
     return peer_addr;
 }
 
+void SocketOp::SetIncomingCpu(int cpu) {
+    int ret = ::setsockopt(sk_, SOL_SOCKET, SO_INCOMING_CPU, &cpu,
+                           static_cast<socklen_t>(sizeof(cpu)));
+    if (ret < 0)
+        LOG_ERROR << "SetIncomingCpu() on socket " << sk_
+                  << " failed with errno " << errno << " : " << StrError(errno);
+}
+
+int SocketOp::GetIncomingCpu() const {
+    int val_int;
+    socklen_t val_len = static_cast<socklen_t>(sizeof(val_int));
+    if (::getsockopt(sk_, SOL_SOCKET, SO_INCOMING_CPU, &val_int,
+                     &val_len) < 0) {
+        LOG_ERROR << "Failed to get incoming cpu on socket " << sk_
+                  << " with errno " << errno << " : " << StrError(errno);
+        return -1;
+    }
+    return val_int;
+}
+
 int SocketOp::GetError() const {
     int val_int;
     socklen_t val_len = static_cast<socklen_t>(sizeof(val_int));
@@ -4,6 +4,9 @@
 #include <utility>
 #include <cstdlib>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include "util/slabpool.hh"
 
 namespace axn {
 
@@ -11,7 +14,7 @@ namespace axn {
 class InetAddr;
 
 // Socket operator. It is not responsible for the life cycle of the socket.
-class SocketOp {
+class SocketOp : public SlabPoolAllocated {
 public:
     explicit SocketOp(int sk) : sk_{sk} {}
 
@@ -27,6 +30,12 @@ public:
     int Connect(const InetAddr& addr);
     ssize_t Recv(void* buf, std::size_t size);
     ssize_t Send(const void* buf, std::size_t size);
+    // Scatter/gather versions.
+    ssize_t Readv(const struct iovec* iov, int iov_num);
+    ssize_t Writev(const struct iovec* iov, int iov_num);
+    // Write size bytes of the file from *offsetp, which is advanced, with
+    // sendfile().
+    ssize_t SendFile(int fd, off_t* offsetp, std::size_t size);
     void ShutdownWrite();
 
     // Socket options wrappers.
@@ -34,11 +43,16 @@ public:
     void SetReuseAddr(bool val);
     void SetReusePort(bool val);
     void SetKeepAlive(bool val);
+    // For a listening socket in a SO_REUSEPORT group, prefer it for the
+    // connections whose packets are processed on the cpu.
+    void SetIncomingCpu(int cpu);
 
     // Get information.
     InetAddr GetLocalAddr() const;
     InetAddr GetPeerAddr() const;
     int GetError() const;
+    // The cpu processing the packets of the socket, or -1 if unknown.
+    int GetIncomingCpu() const;
     bool IsSelfConn() const;
 
 private:
@@ -1,4 +1,6 @@
 #include <mutex>
+#include <chrono>
+#include <algorithm>
 #include <cassert>
 
 #include "tcpclient.hh"
@@ -12,6 +14,7 @@
 namespace axn {
 
 using std::placeholders::_1;
+using namespace std::chrono_literals;
 
 class TcpClientImpl : public std::enable_shared_from_this<TcpClientImpl>,
                       private boost::noncopyable {
@@ -30,12 +33,22 @@ public:
     void SetDisconnectedCallback(DisconnectedCallback cb) {
         disconnected_cb_ = cb; }
     void SetRecvCallback(RecvCallback cb) { recv_cb_ = cb; }
+    void SetRecvBufferCallback(RecvBufferCallback cb) {
+        recv_buffer_cb_ = cb; }
     void SetWriteCompCallback(WriteCompCallback cb) {
         write_comp_cb_ = cb; }
+    void SetHighWaterMarkCallback(HighWaterMarkCallback cb, std::size_t mark) {
+        high_mark_cb_ = cb; high_mark_ = mark; }
+    void SetLowWaterMarkCallback(LowWaterMarkCallback cb, std::size_t mark) {
+        low_mark_cb_ = cb; low_mark_ = mark; }
 
     // Others.
     void EnableRetry() { retry_ = true; }
     void DisableRetry() { retry_ = false; }
+    void SetEdgeTriggered(bool on) { edge_triggered_ = on; }
+    void SetAutoCork(bool on) { auto_cork_ = on; }
+    void SetSendBufferLimit(std::size_t limit, OverflowPolicy policy) {
+        send_limit_ = limit; overflow_policy_ = policy; }
 
 private:
     enum class ClientState {
@@ -62,6 +75,15 @@ private:
     std::atomic_bool connect_{false};
     // TODO: Retrying times.
     std::atomic_bool retry_{true};
+    std::atomic_bool edge_triggered_{false};
+    std::atomic_bool auto_cork_{false};
+    std::atomic<std::size_t> send_limit_{0};
+    std::atomic<OverflowPolicy> overflow_policy_{OverflowPolicy::kClose};
+    // Exponential backoff of retrying. Only accessed in loop thread.
+    static constexpr EventLoop::Clock::duration kInitRetryDelay = 500ms;
+    static constexpr EventLoop::Clock::duration kMaxRetryDelay = 30s;
+    EventLoop::Clock::duration retry_delay_{kInitRetryDelay};
+    TimerId retry_timer_{};
     // No need to use the atomic version because all related reads and writes
     // are done in loop thread.
     ClientState state_{ClientState::kDisconnected};
@@ -69,9 +91,17 @@ private:
     ConnectedCallback connnected_cb_{};
     DisconnectedCallback disconnected_cb_{};
     RecvCallback recv_cb_{DefaultRecvCallback};
+    RecvBufferCallback recv_buffer_cb_{};
     WriteCompCallback write_comp_cb_{};
+    HighWaterMarkCallback high_mark_cb_{};
+    std::size_t high_mark_{0};
+    LowWaterMarkCallback low_mark_cb_{};
+    std::size_t low_mark_{0};
 };
 
+constexpr EventLoop::Clock::duration TcpClientImpl::kInitRetryDelay;
+constexpr EventLoop::Clock::duration TcpClientImpl::kMaxRetryDelay;
+
 TcpClientImpl::TcpClientImpl(EventLoop& loop, const InetAddr& dst_addr)
     : loop_{loop}, dst_addr_{dst_addr} {
     LOG_INFO << "TcpClient(" << this << ") created";
@@ -79,11 +109,12 @@ TcpClientImpl::TcpClientImpl(EventLoop& loop, const InetAddr& dst_addr)
 
 TcpClientImpl::~TcpClientImpl() {
     LOG_INFO << "TcpClient(" << this << ") destructs";
+    // The retrying task only holds a weak_ptr so it may still be pending.
+    loop_.CancelTimer(retry_timer_);
     if (conn_fdp_) {
-        // stl does not permit constructing std::function from a move-only type
-        // so we use std::shared_ptr instead.
-        std::shared_ptr<PollFd> conn_fdp{conn_fdp_.release()};
-        loop_.RunInLoop([=]() { conn_fdp->RemoveFromLoop(); });
+        // Tasks are move-only so the unique_ptr can be moved into it.
+        loop_.RunInLoop([conn_fdp = std::move(conn_fdp_)]() {
+                            conn_fdp->RemoveFromLoop(); });
     }
     // Due to what we have done in ConnEstablished(), connp_ must be empty here.
     assert(!connp_);
@@ -125,6 +156,9 @@ void TcpClientImpl::ConnectInLoop() {
     // This connection may have been cancelled or repeated.
     if (!connect_ || state_ != ClientState::kDisconnected)
         return;
+    // Connect() may be called while a retrying is pending.
+    loop_.CancelTimer(retry_timer_);
+    retry_timer_ = TimerId{};
     LOG_INFO << "TcpClinet(" << this << ") starts to connect to "
              << dst_addr_.Ip() << ":" << dst_addr_.Port();
     state_ = ClientState::kConnecting;
@@ -159,6 +193,8 @@ void TcpClientImpl::StopInLoop() {
         state_ = ClientState::kDisconnected;
         ClearConnFd(false);
     }
+    loop_.CancelTimer(retry_timer_);
+    retry_timer_ = TimerId{};
 }
 
 void TcpClientImpl::PrepareConnComp() {
@@ -176,13 +212,18 @@ void TcpClientImpl::Retry() {
     ClearConnFd();
     // It may have been cancelled.
     if (retry_ && connect_) {
-        LOG_INFO << "TcpClient(" << this << ") retries connecting";
-        // TODO: Implement retrying with timer and it need to be implemented to
-        // be cancelable. Note the order of the queued retrying task and clearing
-        // fd task.
-        // For now, it has to be implemented by shared_from_this().
-        loop_.QueueInLoop(
-                  std::bind(&TcpClientImpl::ConnectInLoop, shared_from_this()));
+        LOG_INFO << "TcpClient(" << this << ") retries connecting in "
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(
+                        retry_delay_).count() << " ms";
+        // The timer fires in a later loop iteration, so the queued clearing
+        // fd task always runs first. Use weak_ptr so that a pending retrying
+        // does not keep this object alive.
+        std::weak_ptr<TcpClientImpl> weak_this{shared_from_this()};
+        retry_timer_ = loop_.RunAfter(retry_delay_, [weak_this]() {
+            if (auto this_ptr = weak_this.lock())
+                this_ptr->ConnectInLoop();
+        });
+        retry_delay_ = std::min(retry_delay_ * 2, kMaxRetryDelay);
     }
 }
 
@@ -245,14 +286,22 @@ void TcpClientImpl::ClearConnFd(bool putoff_reset) {
 void TcpClientImpl::ConnEstablished(int conn_sk) {
     loop_.AssertInLoopThread();
     state_ = ClientState::kConnected;
-    TcpConnPtr connp = std::make_shared<TcpConn>(loop_, conn_sk);
+    retry_delay_ = kInitRetryDelay;
+    TcpConnPtr connp{new TcpConn{loop_, conn_sk}, TcpConn::Destroy,
+                     SlabPoolAllocator<TcpConn>{}};
     LOG_INFO << "TcpClient(" << this << ") establishes the connection and "
              << "creates TcpConn(" << connp.get() << ")";
     // Set callbacks.
     connp->SetConnectedCallback(connnected_cb_);
     connp->SetDisconnectedCallback(disconnected_cb_);
     connp->SetRecvCallback(recv_cb_);
+    connp->SetRecvBufferCallback(recv_buffer_cb_);
     connp->SetWriteCompCallback(write_comp_cb_);
+    connp->SetHighWaterMarkCallback(high_mark_cb_, high_mark_);
+    connp->SetLowWaterMarkCallback(low_mark_cb_, low_mark_);
+    connp->SetEdgeTriggered(edge_triggered_);
+    connp->SetAutoCork(auto_cork_);
+    connp->SetSendBufferLimit(send_limit_, overflow_policy_);
     // TODO: Using shared_from_this() here will cause a problem, this TcpClient
     // object will not destructs until the connection is closed, which may
     // require calling ForceClose() manually.
@@ -314,10 +363,24 @@ void TcpClient::SetRecvCallback(RecvCallback cb) {
     pimpl_->SetRecvCallback(std::move(cb));
 }
 
+void TcpClient::SetRecvBufferCallback(RecvBufferCallback cb) {
+    pimpl_->SetRecvBufferCallback(std::move(cb));
+}
+
 void TcpClient::SetWriteCompCallback(WriteCompCallback cb) {
     pimpl_->SetWriteCompCallback(std::move(cb));
 }
 
+void TcpClient::SetHighWaterMarkCallback(HighWaterMarkCallback cb,
+                                         std::size_t mark) {
+    pimpl_->SetHighWaterMarkCallback(std::move(cb), mark);
+}
+
+void TcpClient::SetLowWaterMarkCallback(LowWaterMarkCallback cb,
+                                        std::size_t mark) {
+    pimpl_->SetLowWaterMarkCallback(std::move(cb), mark);
+}
+
 void TcpClient::EnableRetry() {
     pimpl_->EnableRetry();
 }
@@ -326,4 +389,16 @@ void TcpClient::DisableRetry() {
     pimpl_->DisableRetry();
 }
 
+void TcpClient::SetEdgeTriggered(bool on) {
+    pimpl_->SetEdgeTriggered(on);
+}
+
+void TcpClient::SetAutoCork(bool on) {
+    pimpl_->SetAutoCork(on);
+}
+
+void TcpClient::SetSendBufferLimit(std::size_t limit, OverflowPolicy policy) {
+    pimpl_->SetSendBufferLimit(limit, policy);
+}
+
 }
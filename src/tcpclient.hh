@@ -31,11 +31,23 @@ public:
     void SetConnectedCallback(ConnectedCallback cb);
     void SetDisconnectedCallback(DisconnectedCallback cb);
     void SetRecvCallback(RecvCallback cb);
+    // See RecvBufferCallback. It takes the place of RecvCallback if set.
+    void SetRecvBufferCallback(RecvBufferCallback cb);
     void SetWriteCompCallback(WriteCompCallback cb);
+    // See TcpConn::SetHighWaterMarkCallback().
+    void SetHighWaterMarkCallback(HighWaterMarkCallback cb, std::size_t mark);
+    void SetLowWaterMarkCallback(LowWaterMarkCallback cb, std::size_t mark);
 
     // Others.
     void EnableRetry();
     void DisableRetry();
+    // See TcpConn::SetEdgeTriggered(). Take effect from the next connection.
+    void SetEdgeTriggered(bool on);
+    // See TcpConn::SetAutoCork(). Take effect from the next connection.
+    void SetAutoCork(bool on);
+    // See TcpConn::SetSendBufferLimit(). Take effect from the next
+    // connection.
+    void SetSendBufferLimit(std::size_t limit, OverflowPolicy policy);
 
 private:
     std::shared_ptr<TcpClientImpl> pimpl_;
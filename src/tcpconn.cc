@@ -1,5 +1,7 @@
 #include <functional>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 
 #include "tcpconn.hh"
 #include "eventloop.hh"
@@ -9,17 +11,41 @@
 
 namespace axn {
 
+namespace {
+
+// Maximum number of recv() calls per reading event in edge-triggered mode,
+// so that one busy connection can not starve the others in the same loop.
+constexpr int kMaxRecvOnce = 16;
+// Maximum number of slabs per readv() or writev() call.
+constexpr int kMaxIov = 64;
+// Space reserved in the receiving buffer before reading for
+// RecvBufferCallback, so that the bytes need no copy out of the scratch space
+// of the loop.
+constexpr std::size_t kRecvReserve = 65536;
+// Space read into ahead by the loop with batched I/O, i.e., a slab. The
+// scratch space of the loop can not be shared by the batch.
+constexpr std::size_t kReadAheadSize = 16384;
+// Unsent bytes of a moved or shared message are kept by reference if not
+// fewer than this, or copied into the sending buffer.
+constexpr std::size_t kMinSharedSize = 4096;
+
+} // unnamed namespace
+
 TcpConn::TcpConn(EventLoop& loop, int sk, const InetAddr& peer_addr)
-    : loop_{loop},
-      fdp_{std::make_unique<PollFd>(loop_, sk)},
+    : loopp_{&loop},
+      fdp_{std::make_unique<PollFd>(loop, sk)},
       sk_opp_{std::make_unique<SocketOp>(sk)},
       local_addr_{sk_opp_->GetLocalAddr()},
       peer_addr_{peer_addr} {
     LOG_DEBUG << "TcpConn(" << this << ") created";
+    // Counted on creation rather than in OnConnected() so that the loop
+    // selection sees the connections assigned but not yet connected.
+    loop.AddConnNum(1);
     sk_opp_->SetKeepAlive(true);
     fdp_->SetReadCallback([&]() { HandleRecv(); });
     fdp_->SetWriteCallback([&]() { HandleSend(); });
     fdp_->SetErrorCallback([&]() { HandleError(); });
+    fdp_->SetIoBufSource(this);
 }
 
 TcpConn::TcpConn(EventLoop& loop, int sk)
@@ -27,25 +53,98 @@ TcpConn::TcpConn(EventLoop& loop, int sk)
 
 TcpConn::~TcpConn() {
     LOG_DEBUG << "TcpConn(" << this << ") destructs";
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     assert(state_ == ConnState::kDisconnected);
+    UncountConn();
     fdp_->RemoveFromLoop();
 }
 
+void TcpConn::Destroy(TcpConn* connp) {
+    EventLoop& loop = connp->OwnerLoop();
+    if (loop.IsInLoopThread())
+        delete connp;
+    else
+        loop.QueueInLoop([connp]() { delete connp; });
+}
+
 int TcpConn::SocketFd() const {
     return fdp_->Fd();
 }
 
+std::size_t TcpConn::SendBacklog() const {
+    OwnerLoop().AssertInLoopThread();
+    return send_buf_.ReadableSize();
+}
+
 void TcpConn::Send(const std::string& msg) {
     if (state_ != ConnState::kConnected) {
         LOG_WARN << "TcpConn(" << this << ") " << StateToStr()
                  << " , messages can not be sent";
+    } else if (CanRunOpNow()) {
+        SendInLoop(msg);
+    } else {
+        // The task of the operation fits in the inline buffer of Task so no
+        // allocation happens here except for the copy of msg, which
+        // Send(std::string&&) saves.
+        QueueOp(Op{OpType::kSend, msg, nullptr});
+    }
+}
+
+void TcpConn::Send(std::string&& msg) {
+    if (state_ != ConnState::kConnected) {
+        LOG_WARN << "TcpConn(" << this << ") " << StateToStr()
+                 << " , messages can not be sent";
+    } else if (CanRunOpNow()) {
+        SendInLoop(std::move(msg));
+    } else {
+        QueueOp(Op{OpType::kSend, std::move(msg), nullptr});
+    }
+}
+
+void TcpConn::Send(SharedBuffer bufp) {
+    SendV(std::vector<SharedBuffer>{std::move(bufp)});
+}
+
+void TcpConn::SendV(std::vector<SharedBuffer> bufs) {
+    if (state_ != ConnState::kConnected) {
+        LOG_WARN << "TcpConn(" << this << ") " << StateToStr()
+                 << " , messages can not be sent";
+    } else if (CanRunOpNow()) {
+        SendInLoop(bufs);
+    } else {
+        QueueOp(Op{OpType::kSend, {}, nullptr, 0, nullptr,
+                   std::make_unique<std::vector<SharedBuffer>>(
+                       std::move(bufs))});
+    }
+}
+
+void TcpConn::Send(ChainBuffer& buf) {
+    if (state_ != ConnState::kConnected) {
+        LOG_WARN << "TcpConn(" << this << ") " << StateToStr()
+                 << " , messages can not be sent";
+    } else if (CanRunOpNow()) {
+        SendInLoop(buf);
+    } else {
+        QueueOp(Op{OpType::kSend, buf.RetrieveAll(), nullptr});
+    }
+}
+
+void TcpConn::SendFile(int fd, off_t offset, std::size_t length,
+                       SendFileCallback cb) {
+    if (state_ != ConnState::kConnected) {
+        LOG_WARN << "TcpConn(" << this << ") " << StateToStr()
+                 << " , files can not be sent";
+        if (cb)
+            cb(shared_from_this(), false);
+    } else if (CanRunOpNow()) {
+        SendFileInLoop(fd, offset, length, std::move(cb));
     } else {
-        // We have to store a shared_ptr to this connection object in this task
-        // in case it destructs before the execution of this task.
-        // TODO: Optimize string copy
-        loop_.RunInLoop(
-                  std::bind(&TcpConn::SendInLoop, shared_from_this(), msg));
+        QueueOp(Op{OpType::kSendFile, {}, nullptr, 0,
+                   std::make_unique<Task>(
+                       [this, fd, offset, length, cb = std::move(cb)]()
+                       mutable {
+                           SendFileInLoop(fd, offset, length, std::move(cb));
+                       })});
     }
 }
 
@@ -53,9 +152,10 @@ void TcpConn::ForceClose() {
     // TcpConn objects with the state of kConnecting is not exposed to the user.
     assert(state_ != ConnState::kConnecting);
     if (state_ != ConnState::kDisconnected) {
-        // Same as what we do in Send(), store a shared_ptr to this.
-        loop_.RunInLoop(
-                  std::bind(&TcpConn::ForceCloseInLoop, shared_from_this()));
+        if (CanRunOpNow())
+            ForceCloseInLoop();
+        else
+            QueueOp(Op{OpType::kForceClose, {}, nullptr});
     }
     state_ = ConnState::kDisconnected;
 }
@@ -67,69 +167,527 @@ void TcpConn::Shutdown() {
     ConnState connected_state{ConnState::kConnected};
     if (state_.compare_exchange_strong(connected_state,
                                        ConnState::kDisconnecting)) {
-        // Same as what we do in Send(), store a shared_ptr to this.
-        loop_.RunInLoop(std::bind(&TcpConn::ShutdownInLoop, shared_from_this()));
+        if (CanRunOpNow())
+            ShutdownInLoop();
+        else
+            QueueOp(Op{OpType::kShutdown, {}, nullptr});
+    }
+}
+
+void TcpConn::Cork() {
+    if (CanRunOpNow())
+        corked_ = true;
+    else
+        QueueOp(Op{OpType::kCork, {}, nullptr});
+}
+
+void TcpConn::Uncork() {
+    if (CanRunOpNow()) {
+        corked_ = false;
+        FlushHeld();
+    } else {
+        QueueOp(Op{OpType::kUncork, {}, nullptr});
     }
 }
 
+void TcpConn::StopReading() {
+    if (CanRunOpNow())
+        StopReadingInLoop();
+    else
+        QueueOp(Op{OpType::kStopReading, {}, nullptr});
+}
+
+void TcpConn::StartReading() {
+    if (CanRunOpNow())
+        StartReadingInLoop();
+    else
+        QueueOp(Op{OpType::kStartReading, {}, nullptr});
+}
+
+void TcpConn::MigrateTo(EventLoop& target) {
+    // Always queued since the PollFd can not move while handling its events,
+    // which is the case if it is called in a callback of this connection.
+    QueueOp(Op{OpType::kMigrate, {}, &target});
+}
+
 void TcpConn::OnConnected() {
     LOG_INFO << "TcpConn(" << this << ") connected - Local address: "
              << local_addr_.Ip() << ":" << local_addr_.Port()
              << " Peer address: " << peer_addr_.Ip() << ":"
              << peer_addr_.Port();
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     state_ = ConnState::kConnected;
-    fdp_->EnableReading();
+    if (edge_triggered_ && !OwnerLoop().SupportsEdgeTriggered()) {
+        LOG_WARN << "TcpConn(" << this << ") falls back to level-triggered "
+                 << "mode";
+        edge_triggered_ = false;
+    }
+    if (edge_triggered_) {
+        fdp_->EnableEdgeTriggered();
+    } else {
+        fdp_->EnableReading();
+    }
     if (connnected_cb_)
         connnected_cb_(shared_from_this());
 }
 
 void TcpConn::OnDisconnected() {
     LOG_INFO << "TcpConn(" << this << ") disconnected";
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
+    UncountConn();
     // It may be called from the destructor of TcpServer.
     if (state_ != ConnState::kDisconnected) {
         state_ = ConnState::kDisconnected;
         fdp_->DisableRw();
     }
+    AbortFiles();
     if (disconnected_cb_)
         disconnected_cb_(shared_from_this());
 }
 
+bool TcpConn::CanRunOpNow() const {
+    // No operation queued before may be overtaken.
+    return OwnerLoop().IsInLoopThread() && !migrating_ &&
+           expected_op_seq_ == next_op_seq_.load(std::memory_order_acquire);
+}
+
+void TcpConn::QueueOp(Op op) {
+    PostOp(next_op_seq_.fetch_add(1, std::memory_order_acq_rel),
+           std::move(op));
+}
+
+void TcpConn::PostOp(std::uint64_t seq, Op op) {
+    // We have to store a shared_ptr to this connection object in this task
+    // in case it destructs before the execution of this task.
+    OwnerLoop().QueueInLoop([this_ptr = shared_from_this(), seq,
+                             op = std::move(op)]() mutable {
+                                this_ptr->HandleOp(seq, std::move(op)); });
+}
+
+void TcpConn::HandleOp(std::uint64_t seq, Op op) {
+    // Queued to the old loop right before migrating.
+    if (!OwnerLoop().IsInLoopThread()) {
+        PostOp(seq, std::move(op));
+        return;
+    }
+    if (migrating_ || seq != expected_op_seq_) {
+        parked_ops_.emplace(seq, std::move(op));
+        return;
+    }
+    ++expected_op_seq_;
+    RunOp(op);
+    RunParkedOps();
+}
+
+void TcpConn::RunOp(Op& op) {
+    switch (op.type) {
+        case OpType::kSend:
+            if (op.bufsp)
+                SendInLoop(*op.bufsp);
+            else
+                SendInLoop(std::move(op.msg));
+            break;
+        case OpType::kShutdown: ShutdownInLoop(); break;
+        case OpType::kForceClose: ForceCloseInLoop(); break;
+        case OpType::kMigrate: MigrateInLoop(*op.targetp); break;
+        case OpType::kOffloadDone:
+            RunOffloadDone(op.offload_seq, std::move(*op.contp));
+            break;
+        case OpType::kCork: corked_ = true; break;
+        case OpType::kUncork: corked_ = false; FlushHeld(); break;
+        case OpType::kStopReading: StopReadingInLoop(); break;
+        case OpType::kStartReading: StartReadingInLoop(); break;
+        case OpType::kSendFile: (*op.contp)(); break;
+    }
+}
+
+void TcpConn::FinishOffload(std::uint64_t seq, Task cont) {
+    Op op{OpType::kOffloadDone, {}, nullptr, seq,
+          std::make_unique<Task>(std::move(cont))};
+    if (CanRunOpNow())
+        RunOp(op);
+    else
+        QueueOp(std::move(op));
+}
+
+void TcpConn::RunOffloadDone(std::uint64_t seq, Task cont) {
+    done_offloads_.emplace(seq, std::move(cont));
+    while (!done_offloads_.empty() &&
+           done_offloads_.begin()->first == expected_offload_seq_) {
+        Task f = std::move(done_offloads_.begin()->second);
+        done_offloads_.erase(done_offloads_.begin());
+        ++expected_offload_seq_;
+        // Empty for the rejected works.
+        if (f)
+            f();
+    }
+}
+
+void TcpConn::RunParkedOps() {
+    while (!migrating_ && !parked_ops_.empty() &&
+           parked_ops_.begin()->first == expected_op_seq_) {
+        Op op = std::move(parked_ops_.begin()->second);
+        parked_ops_.erase(parked_ops_.begin());
+        ++expected_op_seq_;
+        RunOp(op);
+    }
+}
+
 void TcpConn::SendInLoop(const std::string& msg) {
+    struct iovec iov{const_cast<char*>(msg.data()), msg.size()};
+    SendInLoop(&iov, 1);
+}
+
+void TcpConn::SendInLoop(std::string&& msg) {
+    struct iovec iov{&msg[0], msg.size()};
+    std::size_t sent = WriteDirect(&iov, 1, msg.size());
+    if (sent == msg.size())
+        return;
+    std::size_t left = msg.size() - sent;
+    if (!AdmitBacklog(sent, left))
+        return;
+    if (left < kMinSharedSize) {
+        send_buf_.Append(msg.data() + sent, left);
+    } else {
+        // Moving the string keeps its bytes where they are.
+        auto bufp = std::make_shared<const std::string>(std::move(msg));
+        send_buf_.AppendShared(bufp->data() + sent, left, bufp);
+    }
+    WatchWriting();
+    CheckHighMark();
+}
+
+void TcpConn::SendInLoop(const std::vector<SharedBuffer>& bufs) {
+    // Write kMaxIov buffers at a time until the socket is full.
+    struct iovec iov[kMaxIov];
+    std::size_t first = 0;
+    // Of the whole message, and of the buffers from first.
+    std::size_t msg_sent = 0;
+    std::size_t sent = 0;
+    for (; first < bufs.size(); first += kMaxIov) {
+        int iov_num = static_cast<int>(std::min<std::size_t>(
+                          kMaxIov, bufs.size() - first));
+        std::size_t total = 0;
+        for (int i = 0; i < iov_num; ++i) {
+            const SharedBuffer& bufp = bufs[first + i];
+            iov[i].iov_base = const_cast<char*>(bufp->data());
+            iov[i].iov_len = bufp->size();
+            total += bufp->size();
+        }
+        sent = WriteDirect(iov, iov_num, total,
+                           first + iov_num >= bufs.size());
+        msg_sent += sent;
+        if (sent < total)
+            break;
+    }
+    if (first >= bufs.size())
+        return;
+    std::size_t left = 0;
+    for (std::size_t i = first; i < bufs.size(); ++i)
+        left += bufs[i]->size();
+    // Admitted once for the rest of the message so that it is never cut.
+    if (!AdmitBacklog(msg_sent, left - sent))
+        return;
+    for (std::size_t i = first; i < bufs.size(); ++i) {
+        const SharedBuffer& bufp = bufs[i];
+        if (sent >= bufp->size()) {
+            sent -= bufp->size();
+            continue;
+        }
+        std::size_t n = bufp->size() - sent;
+        if (n < kMinSharedSize)
+            send_buf_.Append(bufp->data() + sent, n);
+        else
+            send_buf_.AppendShared(bufp->data() + sent, n, bufp);
+        sent = 0;
+    }
+    WatchWriting();
+    CheckHighMark();
+}
+
+void TcpConn::SendInLoop(ChainBuffer& buf) {
+    // Write from buf until the socket is full.
+    struct iovec iov[kMaxIov];
+    std::size_t msg_sent = 0;
+    while (buf.ReadableSize() > 0) {
+        int iov_num = buf.ReadableIov(iov, kMaxIov);
+        std::size_t total = 0;
+        for (int i = 0; i < iov_num; ++i)
+            total += iov[i].iov_len;
+        std::size_t sent = WriteDirect(iov, iov_num, total,
+                                       total == buf.ReadableSize());
+        buf.Read(sent);
+        msg_sent += sent;
+        if (sent < total)
+            break;
+    }
+    if (buf.ReadableSize() == 0)
+        return;
+    // Admitted once for the rest of the message so that it is never cut.
+    if (AdmitBacklog(msg_sent, buf.ReadableSize())) {
+        while (buf.ReadableSize() > 0) {
+            int iov_num = buf.ReadableIov(iov, kMaxIov);
+            std::size_t total = 0;
+            for (int i = 0; i < iov_num; ++i) {
+                send_buf_.Append(static_cast<const char*>(iov[i].iov_base),
+                                 iov[i].iov_len);
+                total += iov[i].iov_len;
+            }
+            buf.Read(total);
+        }
+        WatchWriting();
+        CheckHighMark();
+    }
+    // Consumed even if dropped.
+    buf.Read(buf.ReadableSize());
+}
+
+void TcpConn::SendInLoop(const struct iovec* iov, int iov_num) {
+    std::size_t total = 0;
+    for (int i = 0; i < iov_num; ++i)
+        total += iov[i].iov_len;
+    std::size_t sent = WriteDirect(iov, iov_num, total);
+    if (sent == total)
+        return;
+    if (!AdmitBacklog(sent, total - sent))
+        return;
+    // Buffer the unsent bytes.
+    for (int i = 0; i < iov_num; ++i) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        send_buf_.Append(static_cast<const char*>(iov[i].iov_base) + sent,
+                         iov[i].iov_len - sent);
+        sent = 0;
+    }
+    WatchWriting();
+    CheckHighMark();
+}
+
+void TcpConn::SendFileInLoop(int fd, off_t offset, std::size_t length,
+                             SendFileCallback cb) {
+    OwnerLoop().AssertInLoopThread();
+    if (state_ == ConnState::kDisconnected) {
+        LOG_WARN << "TcpConn(" << this << ") disconnected, "
+                 << "discard the file";
+        if (cb)
+            cb(shared_from_this(), false);
+        return;
+    }
+    std::size_t preceding = send_buf_.ReadableSize();
+    for (const FileSend& file : files_)
+        preceding -= file.preceding;
+    files_.push_back(FileSend{fd, offset, length, std::move(cb), preceding});
+    // Written right away like a message if nothing is buffered.
+    if (send_buf_.ReadableSize() == 0 && files_.size() == 1 && !HoldWrite())
+        HandleSend();
+    if (!files_.empty())
+        WatchWriting();
+}
+
+std::size_t TcpConn::WriteDirect(const struct iovec* iov, int iov_num,
+                                 std::size_t total, bool msg_end) {
     LOG_DEBUG << "TcpConn(" << this << ") sends messages - backlog: "
               << send_buf_.ReadableSize() << " bytes";
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     // Due to the Gatekeeper Send(), if the state is kDisconnecting, this
     // message must come before Shutdown().
     if (state_ == ConnState::kDisconnected) {
         LOG_WARN << "TcpConn(" << this << ") disconnected, "
                  << "discard unsent buffer";
+        return total;
+    }
+    // Only if nothing is buffered, or the order would be broken.
+    if (send_buf_.ReadableSize() > 0 || !files_.empty() || HoldWrite())
+        return 0;
+    assert(edge_triggered_ || !fdp_->IsWriting());
+    ssize_t n = iov_num == 1 ? sk_opp_->Send(iov[0].iov_base, iov[0].iov_len)
+                             : sk_opp_->Writev(iov, iov_num);
+    if (n >= 0 && static_cast<std::size_t>(n) == total) {
+        if (!msg_end)
+            return total;
+        if (state_ == ConnState::kDisconnecting)
+            ShutdownInLoop();
+        if (write_comp_cb_)
+            write_comp_cb_(shared_from_this());
+        return total;
+    }
+    return n > 0 ? n : 0;
+}
+
+bool TcpConn::HoldWrite() {
+    if (!corked_ && !auto_cork_)
+        return false;
+    write_held_ = true;
+    if (!corked_ && !flush_queued_) {
+        flush_queued_ = true;
+        OwnerLoop().RunAfterEvents([this_ptr = shared_from_this()]() {
+            // Left to the new loop if it has migrated.
+            if (!this_ptr->OwnerLoop().IsInLoopThread())
+                return;
+            this_ptr->flush_queued_ = false;
+            if (this_ptr->corked_)
+                return;
+            EventLoop& loop = this_ptr->OwnerLoop();
+            if (loop.SupportsBatchedIo() && this_ptr->write_held_) {
+                // Written with the others flushed in this round.
+                loop.QueueBatchedWrite(this_ptr->fdp_.get(), [this_ptr]() {
+                    this_ptr->FlushWrittenAhead(); });
+            } else {
+                this_ptr->FlushHeld();
+            }
+        });
+    }
+    return true;
+}
+
+void TcpConn::WatchWriting() {
+    if (write_held_)
         return;
+    // Writing is always watched in edge-triggered mode.
+    if (!edge_triggered_ && !fdp_->IsWriting())
+        fdp_->EnableWriting();
+}
+
+bool TcpConn::AdmitBacklog(std::size_t sent, std::size_t left) {
+    if (send_limit_ == 0 || send_buf_.ReadableSize() + left <= send_limit_)
+        return true;
+    if (overflow_policy_ == OverflowPolicy::kDrop) {
+        if (sent > 0)
+            return true;
+        LOG_WARN << "TcpConn(" << this << ") drops a message of " << left
+                 << " bytes over the limit of the sending buffer";
+        return false;
     }
-    // If the sending buffer is empty, try to send directly.
-    if (send_buf_.ReadableSize() == 0) {
-        assert(!fdp_->IsWriting());
-        int n = sk_opp_->Send(msg.c_str(), msg.size());
-        if (n == msg.size()) {
-            if (state_ == ConnState::kDisconnecting)
-                ShutdownInLoop();
-            if (write_comp_cb_)
-                write_comp_cb_(shared_from_this());
-            return;
+    LOG_WARN << "TcpConn(" << this << ") is closed with "
+             << send_buf_.ReadableSize() << " bytes unsent over the limit "
+             << "of the sending buffer";
+    ForceCloseInLoop();
+    return false;
+}
+
+void TcpConn::CheckHighMark() {
+    if (high_mark_ == 0 || above_high_mark_ ||
+        send_buf_.ReadableSize() < high_mark_)
+        return;
+    above_high_mark_ = true;
+    if (high_mark_cb_)
+        high_mark_cb_(shared_from_this(), send_buf_.ReadableSize());
+}
+
+void TcpConn::CheckLowMark() {
+    if (!above_high_mark_ || send_buf_.ReadableSize() > low_mark_)
+        return;
+    above_high_mark_ = false;
+    if (low_mark_cb_)
+        low_mark_cb_(shared_from_this());
+}
+
+void TcpConn::FlushHeld() {
+    if (!write_held_)
+        return;
+    write_held_ = false;
+    HandleSend();
+    if (send_buf_.ReadableSize() > 0 || !files_.empty())
+        WatchWriting();
+}
+
+void TcpConn::FlushWrittenAhead() {
+    // Nothing is written ahead if corked again. Otherwise the result has to
+    // be taken even if flushed meanwhile, e.g., by Shutdown().
+    if (corked_)
+        return;
+    write_held_ = false;
+    HandleSend();
+    if (send_buf_.ReadableSize() > 0 || !files_.empty())
+        WatchWriting();
+}
+
+void TcpConn::WriteBacklog() {
+    struct iovec iov[kMaxIov];
+    // Bytes written ahead by the loop from the head of the buffer.
+    ssize_t ahead = 0;
+    bool written_ahead = fdp_->TakeWriteResult(&ahead);
+    while (state_ != ConnState::kDisconnected) {
+        std::size_t size = 0;
+        ssize_t n = 0;
+        if (written_ahead) {
+            written_ahead = false;
+            size = write_ahead_size_;
+            n = ahead;
         } else {
-            n = n > 0 ? n : 0;
-            send_buf_.Append(msg.c_str() + n, msg.size() - n);
+            int iov_num = BacklogIov(iov, kMaxIov, &size);
+            if (iov_num == 0) {
+                if (files_.empty() || !WriteFile())
+                    break;
+                continue;
+            }
+            n = sk_opp_->Writev(iov, iov_num);
         }
-    } else {
-        send_buf_.Append(msg);
+        n = n > 0 ? n : 0;
+        send_buf_.Read(n);
+        if (!files_.empty())
+            files_.front().preceding -= n;
+        // A short write means the socket buffer is full.
+        if (static_cast<std::size_t>(n) < size)
+            break;
+    }
+}
+
+int TcpConn::BacklogIov(struct iovec* iov, int max_iov,
+                        std::size_t* sizep) const {
+    // Bytes of the buffer up to the next file.
+    std::size_t limit = files_.empty() ? send_buf_.ReadableSize()
+                                       : files_.front().preceding;
+    *sizep = 0;
+    if (limit == 0)
+        return 0;
+    int iov_num = send_buf_.ReadableIov(iov, max_iov);
+    int i = 0;
+    for (; i < iov_num && *sizep < limit; ++i) {
+        iov[i].iov_len = std::min(iov[i].iov_len, limit - *sizep);
+        *sizep += iov[i].iov_len;
+    }
+    return i;
+}
+
+bool TcpConn::WriteFile() {
+    FileSend& file = files_.front();
+    // Up to EAGAIN, since a short count may also mean the end of the file.
+    while (file.left > 0) {
+        ssize_t n = sk_opp_->SendFile(file.fd, &file.offset, file.left);
+        if (n > 0) {
+            file.left -= n;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        } else {
+            // The stream can not go on without the missing bytes.
+            LOG_ERROR << "TcpConn(" << this << ") failed to send file "
+                      << file.fd << " with " << file.left
+                      << " bytes unsent";
+            ForceCloseInLoop();
+            return false;
+        }
+    }
+    SendFileCallback cb = std::move(file.cb);
+    files_.pop_front();
+    if (cb)
+        cb(shared_from_this(), true);
+    return true;
+}
+
+void TcpConn::AbortFiles() {
+    while (!files_.empty()) {
+        SendFileCallback cb = std::move(files_.front().cb);
+        files_.pop_front();
+        if (cb)
+            cb(shared_from_this(), false);
     }
-    if (!fdp_->IsWriting())
-        fdp_->EnableWriting();
 }
 
 void TcpConn::ForceCloseInLoop() {
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     assert(state_ != ConnState::kConnecting);
     // Check again because HandleClose() may have been triggered in the event
     // handling stage of the loop.
@@ -138,71 +696,300 @@ void TcpConn::ForceCloseInLoop() {
 }
 
 void TcpConn::ShutdownInLoop() {
-    loop_.AssertInLoopThread();
-    if (!fdp_->IsWriting()) {
+    OwnerLoop().AssertInLoopThread();
+    if (write_held_) {
+        // Shut down once the held data are written.
+        corked_ = false;
+        FlushHeld();
+        return;
+    }
+    if (send_buf_.ReadableSize() == 0 && files_.empty()) {
         LOG_INFO << "TcpConn(" << this << ") is shut down for writing";
         sk_opp_->ShutdownWrite();
     }
 }
 
+void TcpConn::StopReadingInLoop() {
+    OwnerLoop().AssertInLoopThread();
+    if (reading_stopped_ || state_ == ConnState::kDisconnected)
+        return;
+    reading_stopped_ = true;
+    // The edge-triggered events of new data are ignored by HandleRecv()
+    // instead, which costs no epoll_ctl(). The fd stays registered so that
+    // a reset of the peer is still found out.
+    if (!edge_triggered_ && fdp_->IsReading())
+        fdp_->PauseReading();
+}
+
+void TcpConn::StartReadingInLoop() {
+    OwnerLoop().AssertInLoopThread();
+    if (!reading_stopped_)
+        return;
+    reading_stopped_ = false;
+    if (state_ == ConnState::kDisconnected)
+        return;
+    if (!edge_triggered_)
+        fdp_->EnableReading();
+    // Data left in the socket raise no more edges, and no event comes for
+    // the bytes held. Not read right away since it may be called by a
+    // receiving callback of this connection.
+    if (edge_triggered_ || recv_held_)
+        QueueRecv();
+}
+
+void TcpConn::QueueRecv() {
+    // It is dropped if the connection has migrated, since the new loop
+    // reports the pending data once the socket is watched there.
+    OwnerLoop().QueueInLoop([this_ptr = shared_from_this()]() {
+                                if (!this_ptr->IsDisconnected() &&
+                                    this_ptr->OwnerLoop().IsInLoopThread())
+                                    this_ptr->HandleRecv(); });
+}
+
+void TcpConn::MigrateInLoop(EventLoop& target) {
+    EventLoop& from = OwnerLoop();
+    from.AssertInLoopThread();
+    if (&target == &from || migrating_ || state_ == ConnState::kDisconnected)
+        return;
+    LOG_DEBUG << "TcpConn(" << this << ") migrates from EventLoop(" << &from
+              << ") to EventLoop(" << &target << ")";
+    // The queued flush is dropped after migrating.
+    if (flush_queued_) {
+        flush_queued_ = false;
+        if (!corked_)
+            FlushHeld();
+    }
+    // Data arriving meanwhile stays in the socket and the operations
+    // requested meanwhile are parked until AttachInLoop().
+    migrating_ = true;
+    fdp_->MoveToLoop(target);
+    if (counted_) {
+        from.AddConnNum(-1);
+        target.AddConnNum(1);
+    }
+    // Publish all the changes above to the target loop.
+    loopp_.store(&target, std::memory_order_release);
+    target.QueueInLoop([this_ptr = shared_from_this(), &from]() {
+                           this_ptr->AttachInLoop(from); });
+}
+
+void TcpConn::AttachInLoop(EventLoop& from) {
+    OwnerLoop().AssertInLoopThread();
+    migrating_ = false;
+    // The same events as before, including the pending writing.
+    fdp_->AttachToLoop();
+    if (migrate_cb_)
+        migrate_cb_(shared_from_this(), from);
+    RunParkedOps();
+}
+
 void TcpConn::HandleRecv() {
-    loop_.AssertInLoopThread();
-    recv_buf_.ReserveWritable(65536);
-    int n = sk_opp_->Recv(recv_buf_.WritableBegin(), recv_buf_.WritableSize());
-    if (n > 0) {
+    OwnerLoop().AssertInLoopThread();
+    // Bytes read ahead by the loop into the receiving buffer.
+    ssize_t ahead = 0;
+    bool read_ahead = fdp_->TakeReadResult(&ahead);
+    // Only the hang-up and error events, which are still watched, are
+    // handled while stopped, to find out the close. The events of new data
+    // may still come in the same loop iteration as stopping, or anytime in
+    // edge-triggered mode.
+    if (reading_stopped_ && !(fdp_->Revents() & (EPOLLHUP | EPOLLERR))) {
+        // Stopped by the callbacks of the other connections after reading
+        // ahead.
+        if (read_ahead && ahead > 0) {
+            recv_buf_.Written(ahead);
+            recv_bytes_ += ahead;
+            recv_held_ = true;
+        } else if (read_ahead) {
+            recv_buf_.Shrink();
+        }
+        return;
+    }
+    // Reported with the bytes received now.
+    bool held = recv_held_;
+    recv_held_ = false;
+    // In edge-triggered mode the socket has to be drained, or no more reading
+    // event will come. A full reading ahead is followed by a normal one.
+    int max_recv = edge_triggered_ ? kMaxRecvOnce : (read_ahead ? 2 : 1);
+    bool drained = !edge_triggered_;
+    // The end of the stream is only found by reading past the data, and no
+    // more edge comes for it.
+    bool hung_up = fdp_->Revents() & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+    bool peer_closed = false;
+    // Read into the space left in the slabs of this connection first, then
+    // into the scratch space of the loop, so that no receiving buffer has to
+    // be allocated ahead.
+    char* scratchp = OwnerLoop().ReadScratch();
+    // Bytes left in the scratch space by the last reading.
+    std::size_t scratch_bytes = 0;
+    std::size_t received = 0;
+    struct iovec iov[kMaxIov + 1];
+    for (int i = 0; i < max_recv; ++i) {
+        std::size_t own = 0;
+        std::size_t writable = 0;
+        ssize_t n = 0;
+        if (i == 0 && read_ahead) {
+            own = writable = read_ahead_size_;
+            n = ahead;
+        } else {
+            if (recv_buffer_cb_)
+                recv_buf_.ReserveWritable(kRecvReserve);
+            int iov_num = recv_buf_.WritableIov(iov, kMaxIov,
+                                                recv_buf_.WritableSize());
+            for (int j = 0; j < iov_num; ++j)
+                own += iov[j].iov_len;
+            iov[iov_num].iov_base = scratchp;
+            iov[iov_num].iov_len = EventLoop::kReadScratchSize;
+            writable = own + EventLoop::kReadScratchSize;
+            n = sk_opp_->Readv(iov, iov_num + 1);
+        }
+        if (n > 0) {
+            std::size_t to_own = std::min(static_cast<std::size_t>(n), own);
+            recv_buf_.Written(to_own);
+            scratch_bytes = n - to_own;
+            received += n;
+            recv_bytes_ += n;
+            // A short read means the socket has been drained.
+            if (static_cast<std::size_t>(n) < writable && !hung_up) {
+                drained = true;
+                break;
+            }
+            // The scratch space is reused by the next reading.
+            if (i + 1 < max_recv) {
+                recv_buf_.Append(scratchp, scratch_bytes);
+                scratch_bytes = 0;
+            }
+        } else if (n == 0) {
+            peer_closed = true;
+            break;
+        } else {
+            drained = true;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                HandleError();
+                peer_closed = true;
+            }
+            break;
+        }
+    }
+    // Bytes left by RecvBufferCallback are not reported again until more
+    // come.
+    if (received > 0 || held) {
         LOG_DEBUG << "TcpConn(" << this << ") received messages";
-        assert(recv_cb_);
-        recv_buf_.Written(n);
-        recv_cb_(shared_from_this(), recv_buf_.RetrieveAll());
-    } else if (n == 0) {
+        if (recv_buffer_cb_) {
+            recv_buf_.Append(scratchp, scratch_bytes);
+            recv_buffer_cb_(shared_from_this(), recv_buf_);
+            // Keep only the slabs of the bytes left by the callback.
+            recv_buf_.Shrink();
+        } else {
+            assert(recv_cb_);
+            std::string msg{};
+            if (recv_buf_.ReadableSize() == 0) {
+                // All in the scratch space, as usual for small messages.
+                msg.assign(scratchp, scratch_bytes);
+            } else {
+                recv_buf_.Append(scratchp, scratch_bytes);
+                msg = recv_buf_.RetrieveAll();
+            }
+            // Release the slabs so that idle connections hold no buffer.
+            recv_buf_.Shrink();
+            recv_cb_(shared_from_this(), std::move(msg));
+        }
+    } else if (read_ahead) {
+        // Release the space reserved for reading ahead.
+        recv_buf_.Shrink();
+    }
+    // The receiving callback may have closed the connection.
+    if (state_ == ConnState::kDisconnected)
+        return;
+    if (peer_closed) {
         HandleClose();
-    } else {
-        // This should never be reached?
-        assert(false);
-        HandleError();
+    } else if (!drained) {
+        // Out of budget. Continue in the next loop iteration.
+        QueueRecv();
     }
 }
 
 void TcpConn::HandleSend() {
     LOG_DEBUG << "TcpConn(" << this << ") sends messages - backlog: "
               << send_buf_.ReadableSize() << " bytes";
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     // Same as what we do in SendInLoop() and the writing event will be disabled
     // in HandleClose().
     if (state_ == ConnState::kDisconnected) {
         LOG_WARN << "TcpConn(" << this << ") disconnected, "
                  << "discard unsent buffer";
+        AbortFiles();
         return;
     }
-    int n = sk_opp_->Send(send_buf_.ReadableBegin(), send_buf_.ReadableSize());
-    n = n > 0 ? n : 0;
-    if (n == send_buf_.ReadableSize()) {
-        fdp_->DisableWriting();
+    // Edge-triggered writing events come whether there is a backlog or not.
+    if (send_buf_.ReadableSize() == 0 && files_.empty())
+        return;
+    // Write out until the socket buffer is full, so the socket is drained in
+    // both modes.
+    WriteBacklog();
+    // Closed for a file failing.
+    if (state_ == ConnState::kDisconnected)
+        return;
+    if (send_buf_.ReadableSize() == 0 && files_.empty()) {
+        // Release the slabs of the backlog.
+        send_buf_.Shrink();
+        // Not watched if written by FlushHeld().
+        if (!edge_triggered_ && fdp_->IsWriting())
+            fdp_->DisableWriting();
         if (state_ == ConnState::kDisconnecting)
             ShutdownInLoop();
         if (write_comp_cb_)
             write_comp_cb_(shared_from_this());
     }
-    send_buf_.Read(n);
+    // The callbacks above may have closed the connection.
+    if (state_ != ConnState::kDisconnected)
+        CheckLowMark();
 }
 
 void TcpConn::HandleClose() {
     LOG_INFO << "TcpConn(" << this << ") is closed";
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     state_ = ConnState::kDisconnected;
     fdp_->DisableRw();
+    UncountConn();
+    AbortFiles();
     assert(close_cb_);
     close_cb_(shared_from_this());
 }
 
 void TcpConn::HandleError() {
-    loop_.AssertInLoopThread();
+    OwnerLoop().AssertInLoopThread();
     int sock_errno = sk_opp_->GetError();
     if (sock_errno != 0)
         LOG_ERROR << "TcpConn(" << this << ") error occurred with errno "
                   << sock_errno << " : " << StrError(sock_errno);
 }
 
+void TcpConn::UncountConn() {
+    if (counted_) {
+        counted_ = false;
+        OwnerLoop().AddConnNum(-1);
+    }
+}
+
+int TcpConn::ReadAheadIov(struct iovec* iov, int max_iov) {
+    if (reading_stopped_ || state_ == ConnState::kDisconnected)
+        return 0;
+    recv_buf_.ReserveWritable(kReadAheadSize);
+    int iov_num = recv_buf_.WritableIov(iov, max_iov,
+                                        recv_buf_.WritableSize());
+    read_ahead_size_ = 0;
+    for (int i = 0; i < iov_num; ++i)
+        read_ahead_size_ += iov[i].iov_len;
+    return iov_num;
+}
+
+int TcpConn::WriteAheadIov(struct iovec* iov, int max_iov) {
+    // Corked data are written by HandleSend() as usual.
+    if (state_ == ConnState::kDisconnected || corked_)
+        return 0;
+    return BacklogIov(iov, max_iov, &write_ahead_size_);
+}
+
 std::string TcpConn::StateToStr() const {
     switch (state_) {
         case ConnState::kConnecting: return "connecting";
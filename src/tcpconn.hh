@@ -4,32 +4,54 @@
 #include <memory>
 #include <string>
 #include <atomic>
+#include <map>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include <sys/types.h>
 #include <boost/core/noncopyable.hpp>
 
 #include "callbacks.hh"
 #include "inetaddr.hh"
-#include "util/buffer.hh"
+#include "pollfd.hh"
+#include "util/chainbuffer.hh"
+#include "util/slabpool.hh"
+#include "util/task.hh"
+#include "util/threadpool.hh"
 
 namespace axn {
 
 // Forward declaration
 class EventLoop;
-class PollFd;
 class SocketOp;
 class TcpConn;
 using TcpConnPtr = std::shared_ptr<TcpConn>;
 
-class TcpConn : public std::enable_shared_from_this<TcpConn>,
-                private boost::noncopyable {
+// Final, as it is deleted by Destroy() and its base of batched I/O has
+// virtual functions but no public destructor.
+class TcpConn final : public std::enable_shared_from_this<TcpConn>,
+                      public SlabPoolAllocated, private PollFd::IoBufSource,
+                      private boost::noncopyable {
 public:
     using CloseCallback = std::function<void(TcpConnPtr)>;
+    // Called in the new owner loop after migrating from the loop from.
+    using MigrateCallback = std::function<void(TcpConnPtr, EventLoop& from)>;
 
     TcpConn(EventLoop& loop, int sk, const InetAddr& peer_addr);
     TcpConn(EventLoop& loop, int sk);
     ~TcpConn();
 
+    // Deleter of TcpConnPtr. Other threads, e.g. workers sending replies, may
+    // drop the last reference, so the destruction is queued into the owner
+    // loop then. The control block is allocated with SlabPoolAllocator like
+    // the TcpConn object.
+    static void Destroy(TcpConn* connp);
+
     // Trivial getters.
-    EventLoop& OwnerLoop() const { return loop_; }
+    // It changes when the connection migrates.
+    EventLoop& OwnerLoop() const {
+        return *loopp_.load(std::memory_order_acquire); }
     int SocketFd() const;
     InetAddr LocalAddr() const { return local_addr_; }
     InetAddr PeerAddr() const { return peer_addr_; }
@@ -42,16 +64,93 @@ public:
     void SetDisconnectedCallback(DisconnectedCallback cb) {
         disconnected_cb_ = cb; }
     void SetRecvCallback(RecvCallback cb) { recv_cb_ = cb; }
+    // Take the place of RecvCallback if set.
+    void SetRecvBufferCallback(RecvBufferCallback cb) {
+        recv_buffer_cb_ = cb; }
     void SetWriteCompCallback(WriteCompCallback cb) {
         write_comp_cb_ = cb; }
+    // The low mark callback only follows a high mark one, and the low mark
+    // has to be below the high mark. A high mark of 0 disables both, and a
+    // low mark of 0 means the backlog is fully drained.
+    void SetHighWaterMarkCallback(HighWaterMarkCallback cb, std::size_t mark) {
+        high_mark_cb_ = cb; high_mark_ = mark; }
+    void SetLowWaterMarkCallback(LowWaterMarkCallback cb, std::size_t mark) {
+        low_mark_cb_ = cb; low_mark_ = mark; }
     void SetCloseCallback(CloseCallback cb) { close_cb_ = cb; }
+    void SetMigrateCallback(MigrateCallback cb) { migrate_cb_ = cb; }
+
+    // Use edge-triggered notification. It must be set before OnConnected()
+    // and takes no effect if the poller of the owner loop does not support
+    // it.
+    void SetEdgeTriggered(bool on) { edge_triggered_ = on; }
+    // Hold the data sent while handling the events of a loop iteration and
+    // write them together at its end, instead of one write per Send(). On a
+    // loop with batched I/O, e.g., io_uring, the connections are flushed
+    // with one system call. It must be set before OnConnected().
+    void SetAutoCork(bool on) { auto_cork_ = on; }
+    // Hard cap of the unsent bytes buffered, applied with the policy to the
+    // messages that can not be written at once. 0 means no limit.
+    void SetSendBufferLimit(std::size_t limit, OverflowPolicy policy) {
+        send_limit_ = limit; overflow_policy_ = policy; }
 
     // Thread safe.
     void Send(const std::string& msg);
+    // Large messages are moved in and kept until sent instead of copied.
+    void Send(std::string&& msg);
+    void Send(SharedBuffer bufp);
+    // Send the fragments, e.g., a header and a body, with a single writev().
+    // Those not sent at once are kept by reference.
+    void SendV(std::vector<SharedBuffer> bufs);
+    // Send all the readable bytes of buf and consume them. Those the socket
+    // takes at once are written from buf without copying, e.g., to echo the
+    // buffer of RecvBufferCallback.
+    void Send(ChainBuffer& buf);
+    // Write length bytes of the file from offset with sendfile(), so they
+    // are neither copied into the process nor held in memory, in order with
+    // the messages sent before and after. The file has to stay open until cb
+    // is called, right away if the connection is not connected.
+    void SendFile(int fd, off_t offset, std::size_t length,
+                  SendFileCallback cb = {});
     // It has the same semantics as the close() system call. Use "Force" to
     // make it clearer.
     void ForceClose();
     void Shutdown();
+    // Thread safe. Hold the data sent from now on until Uncork(), which
+    // writes them with as few calls as possible. Shutdown() uncorks as well.
+    void Cork();
+    void Uncork();
+    // Thread safe. Stop reading the socket, so that no receiving callback
+    // comes and the peer is pushed back by the TCP window once the socket
+    // buffer fills, e.g., while the connection the data are forwarded to is
+    // above its high water mark. The poller is only updated when the state
+    // changes, and not at all in edge-triggered mode.
+    void StopReading();
+    void StartReading();
+    // Thread safe. Move the connection to the target loop without losing or
+    // reordering any byte: reading is paused while moving, and the
+    // operations requested meanwhile, like Send(), are carried out in order
+    // once it arrives. It does nothing if the connection is moving or not
+    // connected. Connections of TcpClient must not migrate.
+    void MigrateTo(EventLoop& target);
+
+    // Thread safe. Run work() in the pool, then cont(connp, result) in the
+    // owner loop, or cont(connp) if work() returns void. Continuations of
+    // this connection run in the order of the Offload() calls even if the
+    // works finish out of order, and in order with the operations requested
+    // meanwhile by the works, like Send(). It never waits for the room of a
+    // bounded pool, so as not to block a loop: the full queue rejects the
+    // work with kBlock or kReject, and runs it in the caller with
+    // kRunInCaller. Return false if rejected, in which case the work is
+    // dropped with its continuation.
+    template <typename Work, typename Cont>
+    bool Offload(ThreadPool& pool, Work work, Cont cont,
+                 TaskPriority prio = TaskPriority::kNormal);
+
+    // Unsent bytes in the sending buffer. Called in the owner loop.
+    std::size_t SendBacklog() const;
+    // Bytes received since the last call. Called in the owner loop.
+    std::size_t TakeRecvBytes() {
+        std::size_t n = recv_bytes_; recv_bytes_ = 0; return n; }
 
     // For internal using. Called only once when connection
     // established/destroyed.
@@ -62,22 +161,159 @@ private:
     enum class ConnState {
         kConnecting, kConnected, kDisconnecting, kDisconnected
     };
+    enum class OpType {
+        kSend, kShutdown, kForceClose, kMigrate, kOffloadDone, kCork,
+        kUncork, kStopReading, kStartReading, kSendFile
+    };
+    // Operation requested outside of the owner loop, or while migrating.
+    struct Op {
+        OpType type;
+        std::string msg;
+        EventLoop* targetp;
+        // For kOffloadDone, and kSendFile to run the bound call. A pointer
+        // keeps the task of Op inline.
+        std::uint64_t offload_seq{0};
+        std::unique_ptr<Task> contp{};
+        // For kSend of shared buffers instead of msg.
+        std::unique_ptr<std::vector<SharedBuffer>> bufsp{};
+    };
+    // A file range to be written after the given number of bytes at the
+    // head of the sending buffer, or of the bytes after the previous file.
+    struct FileSend {
+        int fd;
+        off_t offset;
+        std::size_t left;
+        SendFileCallback cb;
+        std::size_t preceding;
+    };
+
+    // Bind the result of the work, run in the pool, to the continuation.
+    template <typename Work, typename Cont>
+    static Task MakeContinuation(const TcpConnPtr& connp, Work& work,
+                                 Cont& cont, std::false_type /* void */) {
+        return [connp, cont = std::move(cont), result = work()]() mutable {
+                   cont(connp, std::move(result)); };
+    }
+    template <typename Work, typename Cont>
+    static Task MakeContinuation(const TcpConnPtr& connp, Work& work,
+                                 Cont& cont, std::true_type /* void */) {
+        work();
+        return [connp, cont = std::move(cont)]() mutable { cont(connp); };
+    }
+    // Called when the work of seq has finished, in any thread.
+    void FinishOffload(std::uint64_t seq, Task cont);
+    // Run the continuations in the order of their Offload() calls.
+    void RunOffloadDone(std::uint64_t seq, Task cont);
 
+    // Whether an operation can be run right away in the current thread.
+    bool CanRunOpNow() const;
+    // Hand the operation to the owner loop with the next sequence number.
+    void QueueOp(Op op);
+    void PostOp(std::uint64_t seq, Op op);
+    // Run the operation in sequence order, or park it until its turn.
+    void HandleOp(std::uint64_t seq, Op op);
+    void RunOp(Op& op);
+    void RunParkedOps();
     void SendInLoop(const std::string& msg);
+    void SendInLoop(std::string&& msg);
+    void SendInLoop(const std::vector<SharedBuffer>& bufs);
+    void SendInLoop(ChainBuffer& buf);
+    void SendInLoop(const struct iovec* iov, int iov_num);
+    void SendFileInLoop(int fd, off_t offset, std::size_t length,
+                        SendFileCallback cb);
+    // Write directly if nothing is buffered. Return the number of bytes
+    // written, all of them if the connection is disconnected and they are
+    // discarded. The completion of the writing is only handled at the end
+    // of a message written in several parts.
+    std::size_t WriteDirect(const struct iovec* iov, int iov_num,
+                            std::size_t total, bool msg_end = true);
+    // Hold the writing if corked, and queue the flush for auto corking.
+    bool HoldWrite();
+    void WatchWriting();
+    // Whether the left bytes of a message partly sent may be buffered.
+    // Otherwise the connection is closed or the message dropped, according
+    // to the overflow policy.
+    bool AdmitBacklog(std::size_t sent, std::size_t left);
+    // Run the watermark callbacks when the backlog crosses the marks.
+    void CheckHighMark();
+    void CheckLowMark();
+    // Write the data held by corking.
+    void FlushHeld();
+    // Take the result of the batched flush queued by the automatic corking.
+    void FlushWrittenAhead();
+    // Write the sending buffer, and the files in between, until the socket
+    // is full.
+    void WriteBacklog();
+    // Fill iov with the buffered bytes up to the next file. Return the
+    // number of buffers and set *sizep to their total size.
+    int BacklogIov(struct iovec* iov, int max_iov, std::size_t* sizep) const;
+    // Write the first file. Return false if the socket is full or it fails.
+    bool WriteFile();
+    // Drop the files not yet written.
+    void AbortFiles();
     void ForceCloseInLoop();
     void ShutdownInLoop();
+    void StopReadingInLoop();
+    void StartReadingInLoop();
+    // Continue reading in the next loop iteration.
+    void QueueRecv();
+    void MigrateInLoop(EventLoop& target);
+    void AttachInLoop(EventLoop& from);
     // PollFd event handlers.
     void HandleRecv();
     void HandleSend();
     void HandleClose();
     void HandleError();
+    // Remove this connection from the statistics of the owner loop.
+    void UncountConn();
+    // Buffers of batched I/O, see PollFd::SetIoBufSource().
+    int ReadAheadIov(struct iovec* iov, int max_iov) override;
+    int WriteAheadIov(struct iovec* iov, int max_iov) override;
     // For logging.
     std::string StateToStr() const;
 
-    EventLoop& loop_;
+    std::atomic<EventLoop*> loopp_;
     std::unique_ptr<PollFd> fdp_;
     std::unique_ptr<SocketOp> sk_opp_;
     std::atomic<ConnState> state_{ConnState::kConnecting};
+    bool edge_triggered_{false};
+    // Whether it is counted in EventLoop::ConnNum(). Unlike state_, which
+    // may be changed by ForceClose(), it is only changed in the owner loop
+    // after construction.
+    bool counted_{true};
+    // The members below are only accessed in the owner loop and move with
+    // the connection.
+    bool migrating_{false};
+    std::size_t recv_bytes_{0};
+    bool auto_cork_{false};
+    bool corked_{false};
+    // The sending buffer is held by corking, rather than waiting for the
+    // socket to be writable.
+    bool write_held_{false};
+    // FlushHeld() is queued to the end of the loop iteration.
+    bool flush_queued_{false};
+    bool reading_stopped_{false};
+    // Bytes read ahead by the loop before reading was stopped are held in
+    // the receiving buffer until it restarts.
+    bool recv_held_{false};
+    // Backpressure on the sending buffer. 0 means no mark or no limit.
+    std::size_t high_mark_{0};
+    std::size_t low_mark_{0};
+    std::size_t send_limit_{0};
+    OverflowPolicy overflow_policy_{OverflowPolicy::kClose};
+    // The backlog has reached the high mark and not yet fallen to the low
+    // mark.
+    bool above_high_mark_{false};
+    // Operations are numbered when queued and run in that order, so that the
+    // ones queued to the old loop during migrating can not be overtaken.
+    std::atomic<std::uint64_t> next_op_seq_{0};
+    std::uint64_t expected_op_seq_{0};
+    std::map<std::uint64_t, Op> parked_ops_{};
+    // Offloaded works are numbered the same way, and their continuations
+    // wait here for the earlier ones.
+    std::atomic<std::uint64_t> next_offload_seq_{0};
+    std::uint64_t expected_offload_seq_{0};
+    std::map<std::uint64_t, Task> done_offloads_{};
     // Addresses.
     InetAddr local_addr_;
     InetAddr peer_addr_;
@@ -85,14 +321,44 @@ private:
     ConnectedCallback connnected_cb_{};
     DisconnectedCallback disconnected_cb_{};
     RecvCallback recv_cb_{};
+    RecvBufferCallback recv_buffer_cb_{};
     WriteCompCallback write_comp_cb_{};
+    HighWaterMarkCallback high_mark_cb_{};
+    LowWaterMarkCallback low_mark_cb_{};
     CloseCallback close_cb_{};
+    MigrateCallback migrate_cb_{};
     // Buffers.
-    Buffer recv_buf_{65536};
-    Buffer send_buf_{};
+    // Allocated only when a reading does not fit in the scratch space of the
+    // loop, and released once the bytes are taken.
+    ChainBuffer recv_buf_{};
+    ChainBuffer send_buf_{};
+    std::deque<FileSend> files_{};
+    // Sizes of the buffers given for batched I/O.
+    std::size_t read_ahead_size_{0};
+    std::size_t write_ahead_size_{0};
 };
 
 void DefaultRecvCallback(TcpConnPtr connp, std::string msg);
 
+template <typename Work, typename Cont>
+bool TcpConn::Offload(ThreadPool& pool, Work work, Cont cont,
+                      TaskPriority prio) {
+    std::uint64_t seq = next_offload_seq_.fetch_add(1,
+                                                    std::memory_order_relaxed);
+    TcpConnPtr connp = shared_from_this();
+    using IsVoid = std::is_void<std::result_of_t<Work&()>>;
+    bool added = pool.TryAddTask(
+                     [connp, seq, work = std::move(work),
+                      cont = std::move(cont)]() mutable {
+                         connp->FinishOffload(
+                             seq, MakeContinuation(connp, work, cont,
+                                                   IsVoid{}));
+                     }, prio);
+    // Do not hold up the later continuations.
+    if (!added)
+        FinishOffload(seq, Task{});
+    return added;
+}
+
 }
 #endif
@@ -1,12 +1,15 @@
 #include <functional>
+#include <algorithm>
+#include <future>
 #include <cassert>
+#include <unistd.h>
 
 #include "tcpserver.hh"
 #include "tcpconn.hh"
-#include "acceptor.hh"
 #include "eventloop.hh"
 #include "eventloop_pool.hh"
 #include "inetaddr.hh"
+#include "socketop.hh"
 #include "util/log.hh"
 
 namespace axn {
@@ -14,20 +17,75 @@ namespace axn {
 using std::placeholders::_1;
 using std::placeholders::_2;
 
+namespace {
+
+// Rebalance only if the busy ratios of the busiest and the least busy loops
+// differ more than this.
+constexpr double kRebalanceThreshold = 0.2;
+
+} // unnamed namespace
+
 TcpServer::TcpServer(EventLoop& loop, const InetAddr& addr)
     : loop_{loop},
       loop_poolp_{std::make_unique<EventLoopPool>(loop_)},
-      acceptorp_{std::make_unique<Acceptor>(loop, addr)} {
+      listen_addr_{addr} {
     LOG_INFO << "TcpServer(" << this << ") created";
-    acceptorp_->SetNewConnCallback(
-                    std::bind(&TcpServer::HandleNewConn, this, _1, _2));
 }
 
 TcpServer::~TcpServer() {
     LOG_INFO << "TcpServer(" << this << ") destructs";
-    for (auto& item : conns_) {
-        TcpConnPtr connp = item.second;
-        connp->OwnerLoop().RunInLoop([=]() { connp->OnDisconnected(); });
+    stopping_ = true;
+    // The rebalancing timer fires in loop_, which may run in another thread.
+    // Wait for the cancelling there so that no Rebalance() comes after this.
+    if (rebalance_timer_.IsValid()) {
+        std::promise<void> cancelled{};
+        loop_.RunInLoop([&]() {
+                            loop_.CancelTimer(rebalance_timer_);
+                            cancelled.set_value(); });
+        cancelled.get_future().wait();
+    }
+    // Acceptors have to destruct in their owner loops. Wait for it so that no
+    // new connection callback comes after this.
+    for (auto& acceptorp : loop_acceptors_) {
+        std::promise<void> destructed{};
+        acceptorp->OwnerLoop().RunInLoop([&]() {
+                                             acceptorp.reset();
+                                             destructed.set_value(); });
+        destructed.get_future().wait();
+    }
+    // A migration in flight runs MigrateInLoop() in the old loop, then
+    // AttachInLoop() in the new one, which may come first in conn_shards_.
+    // Two round trips through every loop let both steps finish, as well as
+    // the new connections handed over by the acceptors, so that nothing is
+    // added to a shard once drained and no task holding this is left.
+    for (int round = 0; round < 2; ++round) {
+        for (auto& item : conn_shards_) {
+            std::promise<void> passed{};
+            item.first->RunInLoop([&]() { passed.set_value(); });
+            passed.get_future().wait();
+        }
+    }
+    // Every shard is drained in its owner loop, where the connections must
+    // destruct as well.
+    for (auto& item : conn_shards_) {
+        std::promise<void> drained{};
+        ConnShard& shard = *item.second;
+        item.first->RunInLoop([&]() {
+                                  for (auto& conn_item : shard) {
+                                      TcpConnPtr& connp = conn_item.second;
+                                      EventLoop& conn_loop = connp->OwnerLoop();
+                                      if (&conn_loop == item.first) {
+                                          connp->OnDisconnected();
+                                      } else {
+                                          // It has migrated out. Release
+                                          // it in its owner loop.
+                                          conn_loop.QueueInLoop(
+                                              [connp = std::move(connp)]() {});
+                                      }
+                                  }
+                                  shard.clear();
+                                  drained.set_value(); });
+        drained.get_future().wait();
     }
 }
 
@@ -35,50 +93,277 @@ void TcpServer::SetThreadNum(int n) {
     loop_poolp_->SetThreadNum(n);
 }
 
+void TcpServer::SetCpuList(std::vector<int> cpus) {
+    loop_poolp_->SetCpuList(std::move(cpus));
+}
+
+void TcpServer::SetThreadInitCallback(EventLoopPool::ThreadInitCallback cb) {
+    loop_poolp_->SetThreadInitCallback(std::move(cb));
+}
+
+void TcpServer::SetLoopSelectPolicy(LoopSelectPolicy policy) {
+    select_policy_ = policy;
+    loop_poolp_->SetSelectPolicy(policy);
+}
+
 void TcpServer::Start() {
     LOG_INFO << "TcpServer(" << this << ") starts";
     loop_poolp_->Start();
+    std::vector<EventLoop*> loops = loop_poolp_->GetAllLoop();
+    if (loops.empty())
+        conn_shards_[&loop_] = std::make_shared<ConnShard>();
+    for (EventLoop* loopp : loops)
+        conn_shards_[loopp] = std::make_shared<ConnShard>();
+    if (rebalance_interval_.count() > 0 && loops.size() > 1) {
+        rebalance_loops_ = loops;
+        for (EventLoop* loopp : loops)
+            last_busy_times_.push_back(loopp->BusyTime());
+        rebalance_timer_ = loop_.RunEvery(rebalance_interval_,
+                                          [this]() { Rebalance(); });
+    }
+    if (per_loop_acceptor_ && !loops.empty()) {
+        for (EventLoop* loopp : loops) {
+            auto acceptorp = std::make_unique<Acceptor>(*loopp, listen_addr_);
+            acceptorp->SetAcceptBatch(accept_batch_);
+            // Let the kernel pick the listening socket of the loop on the
+            // cpu processing the packets of the new connection.
+            if (select_policy_ == LoopSelectPolicy::kIncomingCpu &&
+                loopp->PinnedCpu() >= 0)
+                acceptorp->SetIncomingCpu(loopp->PinnedCpu());
+            acceptorp->SetNewConnCallback(
+                [this, loopp](const Acceptor::NewConns& new_conns) {
+                    HandleNewConnsInLoop(*loopp, new_conns); });
+            Acceptor* rawp = acceptorp.get();
+            loop_acceptors_.push_back(std::move(acceptorp));
+            loopp->RunInLoop([rawp]() { rawp->Listen(); });
+        }
+        LOG_INFO << "TcpServer(" << this << ") listens in " << loops.size()
+                 << " loops";
+        return;
+    }
+    acceptorp_ = std::make_unique<Acceptor>(loop_, listen_addr_);
+    acceptorp_->SetNewConnCallback(
+                    std::bind(&TcpServer::HandleNewConns, this, _1));
+    acceptorp_->SetAcceptBatch(accept_batch_);
     // TODO: If the server destructs before the execution of this task,
     // acceptorp_ will be invalid.
     loop_.RunInLoop([&]() { acceptorp_->Listen(); });
 }
 
-void TcpServer::HandleNewConn(int sk, const InetAddr& peer_addr) {
-    LOG_DEBUG << "TcpServer(" << this << ") handle new connection comes from "
-              << peer_addr.Ip() << ":" << peer_addr.Port();
+void TcpServer::HandleNewConns(const Acceptor::NewConns& new_conns) {
     loop_.AssertInLoopThread();
-    EventLoop& conn_loop = loop_poolp_->GetNextLoop();
-    TcpConnPtr connp = std::make_shared<TcpConn>(conn_loop, sk, peer_addr);
+    // Group the new connections by loop so that every loop is only handed
+    // one task.
+    std::vector<std::pair<EventLoop*, Acceptor::NewConns>> groups{};
+    for (const auto& conn_pair : new_conns) {
+        int sk = conn_pair.first;
+        const InetAddr& peer_addr = conn_pair.second;
+        LOG_DEBUG << "TcpServer(" << this << ") handle new connection comes "
+                  << "from " << peer_addr.Ip() << ":" << peer_addr.Port();
+        if (!CheckConnLimit(sk, peer_addr))
+            continue;
+        std::size_t key = 0;
+        if (select_policy_ == LoopSelectPolicy::kHashKey)
+            key = select_key_func_ ? select_key_func_(peer_addr) :
+                                     std::hash<std::uint32_t>{}(
+                                         peer_addr.RawIp());
+        else if (select_policy_ == LoopSelectPolicy::kIncomingCpu)
+            key = static_cast<std::size_t>(SocketOp{sk}.GetIncomingCpu());
+        EventLoop& conn_loop = loop_poolp_->GetNextLoop(key);
+        // Count it now so that the selection of the rest of the batch sees
+        // it. The TcpConn object takes it over later.
+        conn_loop.AddConnNum(1);
+        auto iter = std::find_if(groups.begin(), groups.end(),
+                                 [&](const auto& group) {
+                                     return group.first == &conn_loop; });
+        if (iter == groups.end()) {
+            groups.emplace_back(&conn_loop, Acceptor::NewConns{});
+            iter = groups.end() - 1;
+        }
+        iter->second.push_back(conn_pair);
+    }
+    // The TcpConn objects are created in their owner loops, so that their
+    // memory is allocated by the thread using it.
+    for (auto& group : groups) {
+        EventLoop* loopp = group.first;
+        loopp->RunInLoop([this, loopp,
+                          new_conns = std::move(group.second)]() {
+                             ConnShard& shard = *conn_shards_.at(loopp);
+                             loopp->AddConnNum(
+                                 -static_cast<int>(new_conns.size()));
+                             for (const auto& conn_pair : new_conns) {
+                                 TcpConnPtr connp = NewConn(
+                                     *loopp, conn_pair.first,
+                                     conn_pair.second);
+                                 shard.emplace(conn_pair.first, connp);
+                                 connp->OnConnected();
+                             } });
+    }
+}
+
+void TcpServer::HandleNewConnsInLoop(EventLoop& conn_loop,
+                                     const Acceptor::NewConns& new_conns) {
+    conn_loop.AssertInLoopThread();
+    ConnShard& shard = *conn_shards_.at(&conn_loop);
+    for (const auto& conn_pair : new_conns) {
+        int sk = conn_pair.first;
+        const InetAddr& peer_addr = conn_pair.second;
+        LOG_DEBUG << "TcpServer(" << this << ") handle new connection comes "
+                  << "from " << peer_addr.Ip() << ":" << peer_addr.Port()
+                  << " in EventLoop(" << &conn_loop << ")";
+        if (!CheckConnLimit(sk, peer_addr))
+            continue;
+        TcpConnPtr connp = NewConn(conn_loop, sk, peer_addr);
+        shard.emplace(sk, connp);
+        connp->OnConnected();
+    }
+}
+
+bool TcpServer::CheckConnLimit(int sk, const InetAddr& peer_addr) {
+    // Reserve the slot first, since the loops accepting with their own
+    // acceptors check it concurrently.
+    int prev = conn_num_.fetch_add(1);
+    if (max_conns_ > 0 && prev >= max_conns_) {
+        conn_num_.fetch_sub(1);
+        LOG_WARN << "TcpServer(" << this << ") reaches the connection limit "
+                 << max_conns_ << ", close the new connection from "
+                 << peer_addr.Ip() << ":" << peer_addr.Port();
+        ::close(sk);
+        return false;
+    }
+    return true;
+}
+
+TcpConnPtr TcpServer::NewConn(EventLoop& conn_loop, int sk,
+                              const InetAddr& peer_addr) {
+    if (incoming_cpu_stats_)
+        conn_loop.CountIncomingCpu(SocketOp{sk}.GetIncomingCpu());
+    TcpConnPtr connp{new TcpConn{conn_loop, sk, peer_addr}, TcpConn::Destroy,
+                     SlabPoolAllocator<TcpConn>{}};
     connp->SetConnectedCallback(connnected_cb_);
     connp->SetDisconnectedCallback(disconnected_cb_);
     connp->SetRecvCallback(recv_cb_);
+    connp->SetRecvBufferCallback(recv_buffer_cb_);
     connp->SetWriteCompCallback(write_comp_cb_);
+    connp->SetHighWaterMarkCallback(high_mark_cb_, high_mark_);
+    connp->SetLowWaterMarkCallback(low_mark_cb_, low_mark_);
+    connp->SetEdgeTriggered(edge_triggered_);
+    connp->SetAutoCork(auto_cork_);
+    connp->SetSendBufferLimit(send_limit_, overflow_policy_);
     connp->SetCloseCallback(std::bind(&TcpServer::HandleConnClose, this, _1));
-    conns_.emplace(sk, connp);
-    conn_loop.RunInLoop([=]() { connp->OnConnected(); });
+    connp->SetMigrateCallback(
+               std::bind(&TcpServer::HandleConnMigrate, this, _1, _2));
+    return connp;
 }
 
 void TcpServer::HandleConnClose(TcpConnPtr connp) {
-    // It has to be captured by value.
-    loop_.RunInLoop([=](){ HandleConnCloseInLoop(connp); });
-}
-
-void TcpServer::HandleConnCloseInLoop(TcpConnPtr connp) {
     LOG_DEBUG << "TcpServer(" << this << ") handle TcpConn(" << connp.get()
               << ") closing";
-    loop_.AssertInLoopThread();
-    std::size_t erased = conns_.erase(connp->SocketFd());
+    // Called in the owner loop of the connection, which is also the only
+    // loop accessing its shard.
+    EventLoop& conn_loop = connp->OwnerLoop();
+    conn_loop.AssertInLoopThread();
+    std::size_t erased = conn_shards_.at(&conn_loop)->erase(
+                             connp->SocketFd());
     assert(erased == 1);
+    --conn_num_;
     // Note that if the user does not owe a copy of this TcpConnPtr now, this
     // will be the last shared_ptr to this TcpConn object, which means this
     // TcpConn object will destructs in the end of the current function while
     // we are still inside the member function of its member object PollFd.
     // So we have to extend its life by storing a copy of its pointer into the
     // task queue of its owner loop. And note that it has to be QueueInLoop()
-    // because RunInLoop() here may be equivalent to an immediate call.
+    // because RunInLoop() here is equivalent to an immediate call.
+    conn_loop.QueueInLoop([connp = std::move(connp)]() {
+                              connp->OnDisconnected(); });
+}
+
+void TcpServer::HandleConnMigrate(TcpConnPtr connp, EventLoop& from) {
     EventLoop& conn_loop = connp->OwnerLoop();
-    // It has to be captured by value.
-    conn_loop.QueueInLoop([=]() { connp->OnDisconnected(); });
+    conn_loop.AssertInLoopThread();
+    if (stopping_) {
+        // The shards are being drained. The old entry is released by the
+        // draining of its loop.
+        connp->OnDisconnected();
+        return;
+    }
+    int sk = connp->SocketFd();
+    TcpConn* rawp = connp.get();
+    conn_shards_.at(&conn_loop)->emplace(sk, std::move(connp));
+    // The old entry can only be erased in its own loop. The socket may have
+    // been closed and reused by then, so check the object as well. The shard
+    // is held weakly as the server may have been destroyed meanwhile.
+    std::weak_ptr<ConnShard> weak_shard{conn_shards_.at(&from)};
+    from.RunInLoop([weak_shard, sk, rawp]() {
+                       std::shared_ptr<ConnShard> shardp = weak_shard.lock();
+                       if (!shardp)
+                           return;
+                       ConnShard& shard = *shardp;
+                       auto iter = shard.find(sk);
+                       if (iter == shard.end() || iter->second.get() != rawp)
+                           return;
+                       // It may be the last reference, which must be
+                       // released in the owner loop.
+                       TcpConnPtr connp = std::move(iter->second);
+                       shard.erase(iter);
+                       EventLoop& conn_loop = connp->OwnerLoop();
+                       conn_loop.QueueInLoop([connp = std::move(connp)]() {});
+                   });
+}
+
+void TcpServer::Rebalance() {
+    loop_.AssertInLoopThread();
+    auto period = std::chrono::duration_cast<EventLoop::Clock::duration>(
+                      rebalance_interval_);
+    std::size_t busiest = 0;
+    std::size_t idlest = 0;
+    std::vector<double> ratios(rebalance_loops_.size());
+    for (std::size_t i = 0; i < rebalance_loops_.size(); ++i) {
+        auto busy_time = rebalance_loops_[i]->BusyTime();
+        ratios[i] = static_cast<double>(
+                        (busy_time - last_busy_times_[i]).count()) /
+                    period.count();
+        last_busy_times_[i] = busy_time;
+        if (ratios[i] > ratios[busiest])
+            busiest = i;
+        if (ratios[i] < ratios[idlest])
+            idlest = i;
+    }
+    if (ratios[busiest] - ratios[idlest] < kRebalanceThreshold)
+        return;
+    EventLoop* fromp = rebalance_loops_[busiest];
+    EventLoop* top = rebalance_loops_[idlest];
+    fromp->RunInLoop(
+               [this, fromp, top]() { MigrateHottestConn(*fromp, *top); });
+}
+
+void TcpServer::MigrateHottestConn(EventLoop& from, EventLoop& to) {
+    from.AssertInLoopThread();
+    if (stopping_)
+        return;
+    ConnShard& shard = *conn_shards_.at(&from);
+    // Moving the only connection just moves the hot spot.
+    if (shard.size() < 2)
+        return;
+    TcpConn* hottestp = nullptr;
+    std::size_t max_bytes = 0;
+    for (auto& item : shard) {
+        // Connections which have migrated out are left in the shard for a
+        // while.
+        if (&item.second->OwnerLoop() != &from)
+            continue;
+        std::size_t bytes = item.second->TakeRecvBytes();
+        if (bytes > max_bytes) {
+            max_bytes = bytes;
+            hottestp = item.second.get();
+        }
+    }
+    if (hottestp != nullptr) {
+        LOG_INFO << "TcpServer(" << this << ") moves TcpConn(" << hottestp
+                 << ") from EventLoop(" << &from << ") to EventLoop(" << &to
+                 << ")";
+        hottestp->MigrateTo(to);
+    }
 }
 
 }
@@ -1,23 +1,31 @@
 #ifndef _AXN_TCPSERVER_HH_
 #define _AXN_TCPSERVER_HH_
 
-#include <map>
+#include <unordered_map>
 #include <memory>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <chrono>
 #include <boost/core/noncopyable.hpp>
 
 #include "callbacks.hh"
+#include "eventloop.hh"
 #include "tcpconn.hh"
+#include "acceptor.hh"
+#include "eventloop_pool.hh"
+#include "timerid.hh"
 
 namespace axn {
 
 // Forward declaration.
-class EventLoop;
-class EventLoopPool;
-class Acceptor;
 class InetAddr;
 
 class TcpServer : private boost::noncopyable {
 public:
+    // Key of a new connection for LoopSelectPolicy::kHashKey.
+    using SelectKeyFunc = std::function<std::size_t(const InetAddr&)>;
+
     TcpServer(EventLoop& loop, const InetAddr& addr);
     ~TcpServer();
 
@@ -25,6 +33,42 @@ public:
     // n means that all new connections will be assigned to the loop pool of
     // size n in a round-robin way.
     void SetThreadNum(int n);
+    // See EventLoopPool::SetCpuList(). Must be called before Start().
+    void SetCpuList(std::vector<int> cpus);
+    void SetThreadInitCallback(EventLoopPool::ThreadInitCallback cb);
+    // How new connections are assigned to the loop pool. It does not apply
+    // to per-loop acceptors, where the kernel picks the loop.
+    void SetLoopSelectPolicy(LoopSelectPolicy policy);
+    // The peer IP address is the key by default, so connections from the
+    // same host share a loop.
+    void SetSelectKeyFunc(SelectKeyFunc f) { select_key_func_ = f; }
+    // Collect EventLoop::IncomingCpuHits()/IncomingCpuMisses(), at the cost
+    // of one more getsockopt() per connection.
+    void SetIncomingCpuStats(bool on) { incoming_cpu_stats_ = on; }
+    // Check the busy ratio of the loops every interval, and move the
+    // connection receiving the most bytes from the busiest loop to the least
+    // busy one if they differ too much. 0 means no rebalancing. Must be
+    // called before Start().
+    void SetRebalanceInterval(std::chrono::milliseconds interval) {
+        rebalance_interval_ = interval; }
+    // Let every loop of the pool own a SO_REUSEPORT listening socket and
+    // accept its own connections, instead of accepting all connections in
+    // the provided loop. Must be called before Start().
+    void SetPerLoopAcceptor(bool on) { per_loop_acceptor_ = on; }
+    // Maximum number of connections accepted in one reading event of each
+    // acceptor. Must be called before Start().
+    void SetAcceptBatch(int n) { accept_batch_ = n; }
+    // Soft limit of concurrent connections. New connections beyond it are
+    // closed right after being accepted. 0 means no limit.
+    void SetMaxConnections(int n) { max_conns_ = n; }
+    int ConnNum() const { return conn_num_; }
+    // Make all connections edge-triggered. See TcpConn::SetEdgeTriggered().
+    void SetEdgeTriggered(bool on) { edge_triggered_ = on; }
+    // See TcpConn::SetAutoCork().
+    void SetAutoCork(bool on) { auto_cork_ = on; }
+    // See TcpConn::SetSendBufferLimit().
+    void SetSendBufferLimit(std::size_t limit, OverflowPolicy policy) {
+        send_limit_ = limit; overflow_policy_ = policy; }
     void Start();
 
     // Callback setters.
@@ -33,24 +77,75 @@ public:
     void SetDisconnectedCallback(DisconnectedCallback cb) {
         disconnected_cb_ = cb; }
     void SetRecvCallback(RecvCallback cb) { recv_cb_ = cb; }
+    void SetRecvBufferCallback(RecvBufferCallback cb) {
+        recv_buffer_cb_ = cb; }
     void SetWriteCompCallback(WriteCompCallback cb) {
         write_comp_cb_ = cb; }
+    // See TcpConn::SetHighWaterMarkCallback().
+    void SetHighWaterMarkCallback(HighWaterMarkCallback cb, std::size_t mark) {
+        high_mark_cb_ = cb; high_mark_ = mark; }
+    void SetLowWaterMarkCallback(LowWaterMarkCallback cb, std::size_t mark) {
+        low_mark_cb_ = cb; low_mark_ = mark; }
 
 private:
-    void HandleNewConn(int sk, const InetAddr& peer_addr);
+    void HandleNewConns(const Acceptor::NewConns& new_conns);
+    // New connections accepted by the acceptor of conn_loop.
+    void HandleNewConnsInLoop(EventLoop& conn_loop,
+                              const Acceptor::NewConns& new_conns);
+    // Return false and close the socket if there are too many connections.
+    bool CheckConnLimit(int sk, const InetAddr& peer_addr);
+    TcpConnPtr NewConn(EventLoop& conn_loop, int sk,
+                       const InetAddr& peer_addr);
     void HandleConnClose(TcpConnPtr connp);
-    void HandleConnCloseInLoop(TcpConnPtr connp);
+    void HandleConnMigrate(TcpConnPtr connp, EventLoop& from);
+    // Called in the provided loop.
+    void Rebalance();
+    // Called in the busiest loop.
+    void MigrateHottestConn(EventLoop& from, EventLoop& to);
 
     EventLoop& loop_;
     std::unique_ptr<EventLoopPool> loop_poolp_;
-    std::unique_ptr<Acceptor> acceptorp_;
-    // Socket - TcpConnPtr map.
-    std::map<int, TcpConnPtr> conns_;
+    // Created by Start() only without per-loop acceptors, as its socket
+    // would otherwise be bound but never listened on.
+    std::unique_ptr<Acceptor> acceptorp_{};
+    InetAddr listen_addr_;
+    bool per_loop_acceptor_{false};
+    // Acceptors owned by the loops of the pool.
+    std::vector<std::unique_ptr<Acceptor>> loop_acceptors_{};
+    // Socket - TcpConnPtr map of the connections owned by one loop. It is
+    // only accessed in that loop.
+    using ConnShard = std::unordered_map<int, TcpConnPtr>;
+    // One shard per I/O loop, filled in Start() and never resized after, so
+    // that the loops can look up their own shards concurrently. Shared with
+    // the tasks erasing the old entries of the migrated connections.
+    std::unordered_map<EventLoop*, std::shared_ptr<ConnShard>> conn_shards_{};
+    // Set by the destructor. No migration is started or tracked after it.
+    std::atomic<bool> stopping_{false};
+    bool edge_triggered_{false};
+    bool auto_cork_{false};
+    std::size_t send_limit_{0};
+    OverflowPolicy overflow_policy_{OverflowPolicy::kClose};
+    LoopSelectPolicy select_policy_{LoopSelectPolicy::kRoundRobin};
+    SelectKeyFunc select_key_func_{};
+    bool incoming_cpu_stats_{false};
+    std::chrono::milliseconds rebalance_interval_{0};
+    TimerId rebalance_timer_{};
+    std::vector<EventLoop*> rebalance_loops_{};
+    std::vector<EventLoop::Clock::duration> last_busy_times_{};
+    int accept_batch_{16};
+    int max_conns_{0};
+    // Updated by all the accepting loops.
+    std::atomic<int> conn_num_{0};
     // Callbacks.
     ConnectedCallback connnected_cb_{};
     DisconnectedCallback disconnected_cb_{};
     RecvCallback recv_cb_{DefaultRecvCallback};
+    RecvBufferCallback recv_buffer_cb_{};
     WriteCompCallback write_comp_cb_{};
+    HighWaterMarkCallback high_mark_cb_{};
+    std::size_t high_mark_{0};
+    LowWaterMarkCallback low_mark_cb_{};
+    std::size_t low_mark_{0};
 };
 
 }
@@ -0,0 +1,23 @@
+#ifndef _AXN_TIMERID_HH_
+#define _AXN_TIMERID_HH_
+
+#include <cstdint>
+
+namespace axn {
+
+// Handle returned by EventLoop::RunAt() and its friends, used to cancel the
+// timer. A default constructed TimerId refers to no timer.
+class TimerId {
+public:
+    TimerId() = default;
+    explicit TimerId(std::uint64_t seq) : seq_{seq} {}
+
+    std::uint64_t Seq() const { return seq_; }
+    bool IsValid() const { return seq_ != 0; }
+
+private:
+    std::uint64_t seq_{0};
+};
+
+}
+#endif
@@ -0,0 +1,135 @@
+#include <vector>
+#include <cassert>
+#include <cerrno>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "timerqueue.hh"
+#include "eventloop.hh"
+#include "util/log.hh"
+
+namespace axn {
+
+namespace {
+
+// Create a timer fd.
+int TimerFd() {
+    int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        LOG_FATAL << "Creating timer fd failed with errno " << errno
+                  << " : " << StrError(errno);
+    return fd;
+}
+
+} // unnamed namespace
+
+TimerQueue::TimerQueue(EventLoop& loop)
+    : loop_{loop},
+      timer_fd_{loop_, TimerFd()} {
+    timer_fd_.SetReadCallback([&]() { HandleExpiration(); });
+    timer_fd_.EnableReading();
+}
+
+TimerQueue::~TimerQueue() {
+    timer_fd_.RemoveFromLoop();
+}
+
+TimerId TimerQueue::AddTimer(Clock::time_point when, Clock::duration interval,
+                             Functor f) {
+    std::uint64_t seq = next_seq_++;
+    Timer timer{std::move(f), when, interval};
+    if (loop_.IsInLoopThread()) {
+        AddTimerInLoop(seq, std::move(timer));
+    } else {
+        loop_.QueueInLoop([this, seq, timer = std::move(timer)]() mutable {
+                              AddTimerInLoop(seq, std::move(timer)); });
+    }
+    return TimerId{seq};
+}
+
+void TimerQueue::Cancel(TimerId id) {
+    if (!id.IsValid())
+        return;
+    std::uint64_t seq = id.Seq();
+    loop_.RunInLoop([this, seq]() { CancelInLoop(seq); });
+}
+
+void TimerQueue::AddTimerInLoop(std::uint64_t seq, Timer timer) {
+    loop_.AssertInLoopThread();
+    bool earliest = timeline_.empty() || timer.when < timeline_.begin()->first;
+    timeline_.emplace(timer.when, seq);
+    timers_.emplace(seq, std::move(timer));
+    // The timer fd will be reset after handling expiration anyway.
+    if (earliest && !handling_expiration_)
+        ResetTimerFd();
+}
+
+void TimerQueue::CancelInLoop(std::uint64_t seq) {
+    loop_.AssertInLoopThread();
+    auto iter = timers_.find(seq);
+    if (iter != timers_.end()) {
+        bool earliest = timeline_.begin()->second == seq;
+        timeline_.erase({iter->second.when, seq});
+        timers_.erase(iter);
+        if (earliest && !handling_expiration_)
+            ResetTimerFd();
+    } else if (handling_expiration_) {
+        // It may be one of the expired timers whose callback is running now.
+        cancelled_in_handling_.insert(seq);
+    }
+}
+
+void TimerQueue::HandleExpiration() {
+    loop_.AssertInLoopThread();
+    std::uint64_t expirations = 0;
+    ::read(timer_fd_.Fd(), &expirations, sizeof(expirations));
+    Clock::time_point now = Clock::now();
+    // Move the expired timers out first so that their callbacks are free to
+    // add or cancel timers.
+    std::vector<std::pair<std::uint64_t, Timer>> expired{};
+    while (!timeline_.empty() && timeline_.begin()->first <= now) {
+        std::uint64_t seq = timeline_.begin()->second;
+        timeline_.erase(timeline_.begin());
+        auto iter = timers_.find(seq);
+        assert(iter != timers_.end());
+        expired.emplace_back(seq, std::move(iter->second));
+        timers_.erase(iter);
+    }
+    handling_expiration_ = true;
+    // An earlier callback may have cancelled a later one of the batch.
+    for (auto& item : expired) {
+        if (cancelled_in_handling_.count(item.first) == 0)
+            item.second.cb();
+    }
+    handling_expiration_ = false;
+    // Restart the repeating timers.
+    for (auto& item : expired) {
+        Timer& timer = item.second;
+        if (timer.interval > Clock::duration::zero() &&
+            cancelled_in_handling_.count(item.first) == 0) {
+            timer.when = now + timer.interval;
+            timeline_.emplace(timer.when, item.first);
+            timers_.emplace(item.first, std::move(timer));
+        }
+    }
+    cancelled_in_handling_.clear();
+    ResetTimerFd();
+}
+
+void TimerQueue::ResetTimerFd() {
+    struct itimerspec new_value{};
+    if (!timeline_.empty()) {
+        // A zero it_value disarms the timer, so fire at least 1us later.
+        auto delay = std::chrono::duration_cast<std::chrono::microseconds>(
+                         timeline_.begin()->first - Clock::now());
+        if (delay < std::chrono::microseconds{1})
+            delay = std::chrono::microseconds{1};
+        new_value.it_value.tv_sec = delay.count() / 1000000;
+        new_value.it_value.tv_nsec = (delay.count() % 1000000) * 1000;
+    }
+    if (::timerfd_settime(timer_fd_.Fd(), 0, &new_value, nullptr) < 0)
+        LOG_ERROR << "timerfd_settime() failed with errno " << errno
+                  << " : " << StrError(errno);
+}
+
+}
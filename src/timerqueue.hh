@@ -0,0 +1,66 @@
+#ifndef _AXN_TIMERQUEUE_HH_
+#define _AXN_TIMERQUEUE_HH_
+
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <boost/core/noncopyable.hpp>
+
+#include "pollfd.hh"
+#include "timerid.hh"
+#include "util/task.hh"
+
+namespace axn {
+
+// Forward declaration.
+class EventLoop;
+
+// Timers of one EventLoop, backed by a single timerfd which is always armed
+// with the nearest deadline. Insertion and cancellation are O(log n).
+class TimerQueue : private boost::noncopyable {
+public:
+    using Functor = Task;
+    using Clock = std::chrono::steady_clock;
+
+    TimerQueue(EventLoop& loop);
+    ~TimerQueue();
+
+    // Thread safe. An interval of zero means a one-shot timer.
+    TimerId AddTimer(Clock::time_point when, Clock::duration interval,
+                     Functor f);
+    // Thread safe. Cancelling an expired or invalid timer does nothing.
+    void Cancel(TimerId id);
+
+private:
+    struct Timer {
+        Functor cb;
+        Clock::time_point when;
+        Clock::duration interval;
+    };
+    using TimerEntry = std::pair<Clock::time_point, std::uint64_t>;
+
+    void AddTimerInLoop(std::uint64_t seq, Timer timer);
+    void CancelInLoop(std::uint64_t seq);
+    void HandleExpiration();
+    // Arm the timerfd with the nearest deadline, or disarm it if there is
+    // no timer left.
+    void ResetTimerFd();
+
+    EventLoop& loop_;
+    PollFd timer_fd_;
+    std::atomic<std::uint64_t> next_seq_{1};
+    // Ordered by deadline. The sequence number breaks ties.
+    std::set<TimerEntry> timeline_{};
+    std::unordered_map<std::uint64_t, Timer> timers_{};
+    // Timers cancelled by the callbacks of the expired timers, which must
+    // neither run later in the batch nor be restarted.
+    bool handling_expiration_{false};
+    std::unordered_set<std::uint64_t> cancelled_in_handling_{};
+};
+
+}
+#endif
@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring_poller.hh"
+#include "pollfd.hh"
+#include "eventloop.hh"
+#include "util/log.hh"
+
+namespace axn {
+
+namespace {
+
+// user_data of the requests whose completions are ignored.
+constexpr std::uint64_t kIgnoredUserData = 0;
+// Flag of the user_data of batched I/O requests, whose low bits are the
+// index of the request. Poll requests never have it as fds are not negative.
+constexpr std::uint64_t kIoUserDataFlag = 1ULL << 63;
+
+int IoUringSetup(unsigned entries, io_uring_params* paramsp) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, paramsp));
+}
+
+int IoUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                 unsigned flags, const void* argp, std::size_t arg_size) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                      min_complete, flags, argp, arg_size));
+}
+
+std::uint64_t PollUserData(int fd, std::uint32_t gen) {
+    return (static_cast<std::uint64_t>(fd) << 32) | gen;
+}
+
+template <typename T>
+T* RingPtr(void* ring, std::uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+} // unnamed namespace
+
+std::unique_ptr<UringPoller> UringPoller::New(EventLoop& loop,
+                                              unsigned entries) {
+    io_uring_params params{};
+    // One poll request per fd may complete in a single iteration so make the
+    // completion queue larger. Overflowed completions are kept by the kernel
+    // with IORING_FEAT_NODROP and flushed by the next io_uring_enter().
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 16;
+    int ring_fd = IoUringSetup(entries, &params);
+    if (ring_fd < 0) {
+        LOG_WARN << "io_uring_setup() failed with errno " << errno
+                 << " : " << StrError(errno);
+        return nullptr;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        LOG_WARN << "io_uring lacks IORING_FEAT_NODROP";
+        ::close(ring_fd);
+        return nullptr;
+    }
+    std::unique_ptr<UringPoller> pollerp{
+        new UringPoller{loop, ring_fd}};
+    if (!pollerp->MapRings(params))
+        return nullptr;
+    pollerp->ext_arg_ = params.features & IORING_FEAT_EXT_ARG;
+    // There is no feature flag for multishot poll, which came in 5.13 along
+    // with IORING_FEAT_RSRC_TAGS.
+    pollerp->multishot_ = params.features & IORING_FEAT_RSRC_TAGS;
+    return pollerp;
+}
+
+UringPoller::UringPoller(EventLoop& loop, int ring_fd)
+    : loop_{loop}, ring_fd_{ring_fd} {}
+
+UringPoller::~UringPoller() {
+    if (sqes_ != nullptr)
+        ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_)
+        ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != nullptr)
+        ::munmap(sq_ring_, sq_ring_size_);
+    ::close(ring_fd_);
+}
+
+bool UringPoller::MapRings(const io_uring_params& params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    void* sq_ring = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring_fd_,
+                           IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        LOG_WARN << "Mapping io_uring SQ ring failed with errno " << errno
+                 << " : " << StrError(errno);
+        return false;
+    }
+    sq_ring_ = sq_ring;
+    if (single_mmap) {
+        cq_ring_ = sq_ring_;
+    } else {
+        void* cq_ring = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring_fd_,
+                               IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            LOG_WARN << "Mapping io_uring CQ ring failed with errno " << errno
+                     << " : " << StrError(errno);
+            return false;
+        }
+        cq_ring_ = cq_ring;
+    }
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        LOG_WARN << "Mapping io_uring SQEs failed with errno " << errno
+                 << " : " << StrError(errno);
+        return false;
+    }
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+    sq_head_ = RingPtr<unsigned>(sq_ring_, params.sq_off.head);
+    sq_tail_ = RingPtr<unsigned>(sq_ring_, params.sq_off.tail);
+    sq_mask_ = *RingPtr<unsigned>(sq_ring_, params.sq_off.ring_mask);
+    sq_array_ = RingPtr<unsigned>(sq_ring_, params.sq_off.array);
+    cq_head_ = RingPtr<unsigned>(cq_ring_, params.cq_off.head);
+    cq_tail_ = RingPtr<unsigned>(cq_ring_, params.cq_off.tail);
+    cq_mask_ = *RingPtr<unsigned>(cq_ring_, params.cq_off.ring_mask);
+    cqes_ = RingPtr<struct io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+    return true;
+}
+
+void UringPoller::Poll(int timeout, std::vector<PollFd*>& ready_fds) {
+    // Arm the fds registered or reported since the last polling.
+    for (int fd : pending_arm_fds_) {
+        FdEntry& entry = entries_[fd];
+        if (!entry.pending_arm)
+            continue;
+        entry.pending_arm = false;
+        if (entry.fdp != nullptr && !entry.fdp->CareNoEvent() &&
+            entry.armed_gen == 0)
+            Arm(fd, entry);
+    }
+    pending_arm_fds_.clear();
+    // The fds reaped while doing batched I/O are reported without waiting.
+    if (!ready_.empty())
+        timeout = 0;
+    const struct __kernel_timespec* tsp = nullptr;
+    if (timeout >= 0) {
+        timeout_ts_.tv_sec = timeout / 1000;
+        timeout_ts_.tv_nsec = (timeout % 1000) * 1000000LL;
+        tsp = &timeout_ts_;
+    }
+    if (tsp != nullptr && !ext_arg_) {
+        // Complete after the timeout or one other completion.
+        tsp = nullptr;
+        struct io_uring_sqe* sqep = GetSqe();
+        sqep->opcode = IORING_OP_TIMEOUT;
+        sqep->fd = -1;
+        sqep->addr = reinterpret_cast<std::uint64_t>(&timeout_ts_);
+        sqep->len = 1;
+        sqep->off = 1;
+        sqep->user_data = kIgnoredUserData;
+    }
+    Enter(1, tsp);
+    Reap();
+    ready_fds.clear();
+    ready_fds.swap(ready_);
+    for (PollFd* fdp : ready_fds) {
+        FdEntry& entry = entries_[fdp->Fd()];
+        entry.ready = false;
+        fdp->SetRevents(entry.revents);
+    }
+    LOG_DEBUG << "Poll: " << ready_fds.size() << " events ready";
+}
+
+void UringPoller::SubmitIo(std::vector<IoRequest>& reqs) {
+    loop_.AssertInLoopThread();
+    // Kept until completed, so it must not grow meanwhile.
+    io_msgs_.resize(reqs.size());
+    for (std::size_t i = 0; i < reqs.size(); ++i) {
+        IoRequest& req = reqs[i];
+        struct msghdr& msg = io_msgs_[i];
+        msg = {};
+        msg.msg_iov = const_cast<struct iovec*>(req.iov);
+        msg.msg_iovlen = req.iov_num;
+        req.res = 0;
+        struct io_uring_sqe* sqep = GetSqe();
+        sqep->opcode = req.write ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+        sqep->fd = req.fd;
+        sqep->addr = reinterpret_cast<std::uint64_t>(&msg);
+        sqep->len = 1;
+        // Complete with EAGAIN instead of waiting for readiness.
+        sqep->msg_flags = MSG_DONTWAIT;
+        sqep->user_data = kIoUserDataFlag | i;
+    }
+    io_reqsp_ = &reqs;
+    io_pending_ = reqs.size();
+    while (io_pending_ > 0) {
+        Enter(static_cast<unsigned>(io_pending_));
+        Reap();
+    }
+    io_reqsp_ = nullptr;
+}
+
+void UringPoller::Reap() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        if (cqe.user_data == kIgnoredUserData)
+            continue;
+        if (cqe.user_data & kIoUserDataFlag) {
+            std::size_t index = static_cast<std::size_t>(
+                                    cqe.user_data & ~kIoUserDataFlag);
+            assert(io_reqsp_ != nullptr && index < io_reqsp_->size());
+            (*io_reqsp_)[index].res = cqe.res;
+            --io_pending_;
+            continue;
+        }
+        int fd = static_cast<int>(cqe.user_data >> 32);
+        std::uint32_t gen = static_cast<std::uint32_t>(cqe.user_data);
+        if (fd >= static_cast<int>(entries_.size()))
+            continue;
+        FdEntry& entry = entries_[fd];
+        // Stale completion of a disarmed request.
+        if (entry.armed_gen != gen || entry.fdp == nullptr)
+            continue;
+        // Otherwise a multishot request is still armed.
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            entry.armed_gen = 0;
+            if (!entry.pending_arm) {
+                entry.pending_arm = true;
+                pending_arm_fds_.push_back(fd);
+            }
+        }
+        if (cqe.res < 0) {
+            LOG_ERROR << "io_uring poll on fd " << fd << " failed with errno "
+                      << -cqe.res << " : " << StrError(-cqe.res);
+            continue;
+        }
+        // The poll mask bits are the same as the epoll ones. A fd may complete
+        // again before being reported, by a multishot request or after being
+        // reaped while doing batched I/O.
+        if (entry.ready) {
+            entry.revents |= cqe.res;
+            continue;
+        }
+        entry.ready = true;
+        entry.revents = cqe.res;
+        ready_.push_back(entry.fdp);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+void UringPoller::UpdateFd(PollFd* fdp) {
+    loop_.AssertInLoopThread();
+    int fd = fdp->Fd();
+    FdEntry& entry = Entry(fd);
+    entry.fdp = fdp;
+    // The interested events may have changed, so drop the in-flight request,
+    // and the events not yet reported which are no longer watched.
+    Disarm(fd, entry);
+    if (entry.ready) {
+        entry.revents = fdp->CareNoEvent() ? 0 : entry.revents &
+                            (fdp->Events() | EPOLLHUP | EPOLLERR);
+        if (entry.revents == 0) {
+            entry.ready = false;
+            ready_.erase(std::find(ready_.begin(), ready_.end(), fdp));
+        }
+    }
+    if (!fdp->CareNoEvent() && !entry.pending_arm) {
+        entry.pending_arm = true;
+        pending_arm_fds_.push_back(fd);
+    }
+}
+
+void UringPoller::RemoveFd(PollFd* fdp) {
+    loop_.AssertInLoopThread();
+    int fd = fdp->Fd();
+    if (fd >= static_cast<int>(entries_.size()) || entries_[fd].fdp != fdp)
+        return;
+    FdEntry& entry = entries_[fd];
+    entry.fdp = nullptr;
+    entry.pending_arm = false;
+    if (entry.ready) {
+        entry.ready = false;
+        ready_.erase(std::find(ready_.begin(), ready_.end(), fdp));
+    }
+    Disarm(fd, entry);
+    // An in-flight poll request holds a reference to the file, so submit the
+    // removal now before the fd is closed.
+    if (to_submit_ > 0)
+        Enter(0);
+}
+
+UringPoller::FdEntry& UringPoller::Entry(int fd) {
+    assert(fd >= 0);
+    if (fd >= static_cast<int>(entries_.size()))
+        entries_.resize(fd + 1);
+    return entries_[fd];
+}
+
+void UringPoller::Arm(int fd, FdEntry& entry) {
+    if (++next_gen_ == 0)
+        next_gen_ = 1;
+    entry.armed_gen = next_gen_;
+    CountCtl();
+    struct io_uring_sqe* sqep = GetSqe();
+    sqep->opcode = IORING_OP_POLL_ADD;
+    sqep->fd = fd;
+    sqep->poll32_events = static_cast<std::uint32_t>(entry.fdp->Events());
+    if (multishot_ && entry.fdp->IsEdgeTriggered())
+        sqep->len = IORING_POLL_ADD_MULTI;
+    sqep->user_data = PollUserData(fd, entry.armed_gen);
+}
+
+void UringPoller::Disarm(int fd, FdEntry& entry) {
+    if (entry.armed_gen == 0)
+        return;
+    CountCtl();
+    struct io_uring_sqe* sqep = GetSqe();
+    sqep->opcode = IORING_OP_POLL_REMOVE;
+    sqep->fd = -1;
+    sqep->addr = PollUserData(fd, entry.armed_gen);
+    sqep->user_data = kIgnoredUserData;
+    entry.armed_gen = 0;
+}
+
+struct io_uring_sqe* UringPoller::GetSqe() {
+    unsigned tail = *sq_tail_;
+    // Flush the submission queue if it is full.
+    while (tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) > sq_mask_)
+        Enter(0);
+    unsigned index = tail & sq_mask_;
+    struct io_uring_sqe* sqep = &sqes_[index];
+    std::memset(sqep, 0, sizeof(*sqep));
+    sq_array_[index] = index;
+    // The kernel only reads the queue in io_uring_enter().
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit_;
+    return sqep;
+}
+
+int UringPoller::Enter(unsigned min_complete,
+                       const struct __kernel_timespec* tsp) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg{};
+    const void* argp = nullptr;
+    std::size_t arg_size = 0;
+    if (tsp != nullptr) {
+        flags |= IORING_ENTER_EXT_ARG;
+        arg.ts = reinterpret_cast<std::uint64_t>(tsp);
+        argp = &arg;
+        arg_size = sizeof(arg);
+    }
+    int ret = IoUringEnter(ring_fd_, to_submit_, min_complete, flags, argp,
+                           arg_size);
+    if (ret < 0) {
+        // EBUSY means the completion queue overflowed and it will be drained
+        // by the caller. ETIME means the timeout expired.
+        if (errno != EINTR && errno != EBUSY && errno != EAGAIN &&
+            errno != ETIME)
+            LOG_FATAL << "io_uring_enter() failed with errno " << errno
+                      << " : " << StrError(errno);
+        return 0;
+    }
+    to_submit_ -= ret;
+    return ret;
+}
+
+}
@@ -0,0 +1,101 @@
+#ifndef _AXN_URING_POLLER_HH_
+#define _AXN_URING_POLLER_HH_
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "poller.hh"
+
+namespace axn {
+
+// Poller backed by io_uring. Readiness is watched by one-shot IORING_OP_POLL_ADD
+// requests which are re-armed after being reported, so the semantics are the
+// same as level-triggered epoll. Edge-triggered fds are watched by multishot
+// requests instead, which stay armed and cost nothing per event. All arming
+// and disarming requests issued during one loop iteration are submitted
+// together with the wait in a single io_uring_enter(). Batched socket I/O is
+// done by IORING_OP_RECVMSG and IORING_OP_SENDMSG requests submitted at once.
+class UringPoller : public Poller {
+public:
+    // Return nullptr if io_uring is not available.
+    static std::unique_ptr<UringPoller> New(EventLoop& loop,
+                                            unsigned entries = 1024);
+    ~UringPoller() override;
+    void Poll(int timeout, std::vector<PollFd*>& ready_fds) override;
+    void UpdateFd(PollFd* fdp) override;
+    void RemoveFd(PollFd* fdp) override;
+    bool SupportsEdgeTriggered() const override { return multishot_; }
+    bool SupportsBatchedIo() const override { return true; }
+    void SubmitIo(std::vector<IoRequest>& reqs) override;
+
+private:
+    // Registration state of a fd, indexed by fd.
+    struct FdEntry {
+        PollFd* fdp{nullptr};
+        // Generation of the in-flight poll request, 0 if none.
+        std::uint32_t armed_gen{0};
+        bool pending_arm{false};
+        // Whether it is in ready_, with the events to report. They are set to
+        // the PollFd only when reported, since it may still be handling the
+        // events of the last report.
+        bool ready{false};
+        int revents{0};
+    };
+
+    UringPoller(EventLoop& loop, int ring_fd);
+    bool MapRings(const io_uring_params& params);
+    FdEntry& Entry(int fd);
+    void Arm(int fd, FdEntry& entry);
+    void Disarm(int fd, FdEntry& entry);
+    struct io_uring_sqe* GetSqe();
+    // Handle the completions so far. Those of the poll requests are kept in
+    // ready_ until reported by Poll().
+    void Reap();
+    // Submit the queued requests and wait for at least min_complete
+    // completions, or until the timeout if tsp is not null, which requires
+    // ext_arg_.
+    int Enter(unsigned min_complete,
+              const struct __kernel_timespec* tsp = nullptr);
+
+    EventLoop& loop_;
+    int ring_fd_;
+    // The timeout of the waiting is passed to io_uring_enter() instead of
+    // being a request of its own, which costs a completion per iteration.
+    bool ext_arg_{false};
+    // Multishot poll requests are supported.
+    bool multishot_{false};
+    // Submission queue.
+    void* sq_ring_{nullptr};
+    std::size_t sq_ring_size_{0};
+    unsigned* sq_head_{nullptr};
+    unsigned* sq_tail_{nullptr};
+    unsigned sq_mask_{0};
+    unsigned* sq_array_{nullptr};
+    struct io_uring_sqe* sqes_{nullptr};
+    std::size_t sqes_size_{0};
+    unsigned to_submit_{0};
+    // Completion queue.
+    void* cq_ring_{nullptr};
+    std::size_t cq_ring_size_{0};
+    unsigned* cq_head_{nullptr};
+    unsigned* cq_tail_{nullptr};
+    unsigned cq_mask_{0};
+    struct io_uring_cqe* cqes_{nullptr};
+    // Registration.
+    std::vector<FdEntry> entries_{};
+    std::vector<int> pending_arm_fds_{};
+    std::uint32_t next_gen_{1};
+    struct __kernel_timespec timeout_ts_{};
+    // Fds reaped but not yet reported, e.g., while doing batched I/O.
+    std::vector<PollFd*> ready_{};
+    // Batched I/O in flight.
+    std::vector<IoRequest>* io_reqsp_{nullptr};
+    std::vector<struct msghdr> io_msgs_{};
+    std::size_t io_pending_{0};
+};
+
+}
+#endif
@@ -0,0 +1,65 @@
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cerrno>
+#include <cstdlib>
+#include <pthread.h>
+#include <sched.h>
+
+#include "affinity.hh"
+#include "log.hh"
+
+namespace axn {
+
+bool PinThisThread(int cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int err = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpu_set),
+                                       &cpu_set);
+    if (err != 0) {
+        LOG_ERROR << "Failed to pin the thread to cpu " << cpu
+                  << " with errno " << err << " : " << StrError(err);
+        return false;
+    }
+    return true;
+}
+
+int CpuNode(int cpu) {
+    // Look the cpu up in the cpu list of every node.
+    for (int node = 0; node < 1024; ++node) {
+        std::ifstream ifs{"/sys/devices/system/node/node" +
+                          std::to_string(node) + "/cpulist"};
+        if (!ifs.is_open())
+            return -1;
+        std::string cpu_list{};
+        std::getline(ifs, cpu_list);
+        for (int node_cpu : ParseCpuList(cpu_list.c_str())) {
+            if (node_cpu == cpu)
+                return node;
+        }
+    }
+    return -1;
+}
+
+std::vector<int> ParseCpuList(const char* str) {
+    std::vector<int> cpus{};
+    std::stringstream ss{str};
+    std::string range{};
+    while (std::getline(ss, range, ',')) {
+        if (range.empty())
+            continue;
+        char* endp = nullptr;
+        long first = std::strtol(range.c_str(), &endp, 10);
+        long last = first;
+        if (*endp == '-')
+            last = std::strtol(endp + 1, &endp, 10);
+        if (*endp != '\0' || first < 0 || last < first)
+            return {};
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+    }
+    return cpus;
+}
+
+}
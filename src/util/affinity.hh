@@ -0,0 +1,16 @@
+#ifndef _AXN_AFFINITY_HH_
+#define _AXN_AFFINITY_HH_
+
+#include <vector>
+
+namespace axn {
+
+// Pin the calling thread to the cpu. Return false on failure.
+bool PinThisThread(int cpu);
+// The NUMA node of the cpu, or -1 if unknown.
+int CpuNode(int cpu);
+// Parse a cpu list like "0-3,8,10-11". Return an empty list on failure.
+std::vector<int> ParseCpuList(const char* str);
+
+}
+#endif
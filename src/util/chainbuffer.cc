@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "chainbuffer.hh"
+
+namespace axn {
+
+constexpr std::size_t ChainBuffer::kDefaultSlabSize;
+
+std::string ChainBuffer::Retrieve(std::size_t n) {
+    n = std::min(n, readable_size_);
+    std::string str{};
+    str.reserve(n);
+    std::size_t left = n;
+    for (std::size_t i = 0; left > 0; ++i) {
+        const Slab& slab = slabs_[i];
+        std::size_t m = std::min(left, slab.write - slab.read);
+        str.append(slab.base + slab.read, m);
+        left -= m;
+    }
+    Read(n);
+    return str;
+}
+
+void ChainBuffer::Append(const char* p, std::size_t n) {
+    // Fast path for small messages fitting in the write slab.
+    if (!slabs_.empty() &&
+        slabs_[write_slab_].cap - slabs_[write_slab_].write > n) {
+        Slab& slab = slabs_[write_slab_];
+        std::memcpy(slab.base + slab.write, p, n);
+        slab.write += n;
+        readable_size_ += n;
+        writable_size_ -= n;
+        return;
+    }
+    ReserveWritable(n);
+    while (n > 0) {
+        Slab& slab = slabs_[write_slab_];
+        std::size_t m = std::min(n, slab.cap - slab.write);
+        std::memcpy(slab.base + slab.write, p, m);
+        p += m;
+        n -= m;
+        Written(m);
+    }
+}
+
+void ChainBuffer::AppendShared(const char* p, std::size_t n,
+                               std::shared_ptr<const void> ownerp) {
+    if (n == 0)
+        return;
+    // Never written since it is full.
+    Slab shared{SlabData{nullptr, SlabFree{0}}, std::move(ownerp),
+                const_cast<char*>(p), n, 0, n};
+    readable_size_ += n;
+    if (slabs_.empty()) {
+        slabs_.push_back(std::move(shared));
+        return;
+    }
+    Slab& slab = slabs_[write_slab_];
+    if (slab.write == 0) {
+        // Keep the empty write slab behind.
+        slabs_.insert(slabs_.begin() + write_slab_, std::move(shared));
+        ++write_slab_;
+        return;
+    }
+    // Close the write slab, losing the space left in it.
+    writable_size_ -= slab.cap - slab.write;
+    ++write_slab_;
+    slabs_.insert(slabs_.begin() + write_slab_, std::move(shared));
+    if (write_slab_ + 1 < slabs_.size())
+        ++write_slab_;
+}
+
+int ChainBuffer::ReadableIov(struct iovec* iov, int max_iov) const {
+    int num = 0;
+    for (std::size_t i = 0; i < slabs_.size() && i <= write_slab_ &&
+                            num < max_iov; ++i) {
+        const Slab& slab = slabs_[i];
+        if (slab.write == slab.read)
+            continue;
+        iov[num].iov_base = slab.base + slab.read;
+        iov[num].iov_len = slab.write - slab.read;
+        ++num;
+    }
+    return num;
+}
+
+std::size_t ChainBuffer::Peek(char* p, std::size_t n) const {
+    n = std::min(n, readable_size_);
+    std::size_t left = n;
+    for (std::size_t i = 0; left > 0; ++i) {
+        const Slab& slab = slabs_[i];
+        std::size_t m = std::min(left, slab.write - slab.read);
+        std::memcpy(p, slab.base + slab.read, m);
+        p += m;
+        left -= m;
+    }
+    return n;
+}
+
+void ChainBuffer::Read(std::size_t n) {
+    assert(n <= readable_size_);
+    readable_size_ -= n;
+    while (n > 0) {
+        Slab& slab = slabs_.front();
+        std::size_t m = std::min(n, slab.write - slab.read);
+        slab.read += m;
+        n -= m;
+        if (slab.read < slab.write)
+            break;
+        if (write_slab_ == 0 && slab.data) {
+            // The write slab itself has been drained, reuse it from the start.
+            writable_size_ += slab.write;
+            slab.read = slab.write = 0;
+        } else {
+            if (slab.data && !spare_)
+                spare_ = std::move(slab.data);
+            slabs_.pop_front();
+            // A drained shared write slab leaves the next one, if any, as the
+            // write slab.
+            if (write_slab_ > 0)
+                --write_slab_;
+        }
+    }
+}
+
+void ChainBuffer::ReserveWritable(std::size_t n) {
+    while (writable_size_ < n)
+        AddSlab();
+}
+
+int ChainBuffer::WritableIov(struct iovec* iov, int max_iov, std::size_t n) {
+    ReserveWritable(n);
+    int num = 0;
+    for (std::size_t i = write_slab_; i < slabs_.size() && num < max_iov &&
+                                      n > 0; ++i) {
+        Slab& slab = slabs_[i];
+        std::size_t m = std::min(n, slab.cap - slab.write);
+        iov[num].iov_base = slab.base + slab.write;
+        iov[num].iov_len = m;
+        n -= m;
+        ++num;
+    }
+    return num;
+}
+
+void ChainBuffer::Written(std::size_t n) {
+    assert(n <= writable_size_);
+    readable_size_ += n;
+    writable_size_ -= n;
+    while (n > 0) {
+        Slab& slab = slabs_[write_slab_];
+        std::size_t m = std::min(n, slab.cap - slab.write);
+        slab.write += m;
+        n -= m;
+        if (slab.write == slab.cap && write_slab_ + 1 < slabs_.size())
+            ++write_slab_;
+    }
+}
+
+void ChainBuffer::Shrink() {
+    spare_.reset();
+    while (slabs_.size() > write_slab_ + 1) {
+        writable_size_ -= slab_size_;
+        slabs_.pop_back();
+    }
+    if (readable_size_ == 0 && !slabs_.empty()) {
+        slabs_.clear();
+        write_slab_ = 0;
+        writable_size_ = 0;
+    }
+}
+
+void ChainBuffer::AddSlab() {
+    if (!slabs_.empty() &&
+        slabs_[write_slab_].write == slabs_[write_slab_].cap)
+        ++write_slab_;
+    SlabData data = spare_ ? std::move(spare_)
+                           : SlabData{static_cast<char*>(
+                                          SlabPool::Allocate(slab_size_)),
+                                      SlabFree{slab_size_}};
+    char* base = data.get();
+    slabs_.push_back(Slab{std::move(data), nullptr, base, slab_size_, 0, 0});
+    writable_size_ += slab_size_;
+}
+
+}
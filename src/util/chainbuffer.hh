@@ -0,0 +1,97 @@
+#ifndef _AXN_CHAINBUFFER_HH_
+#define _AXN_CHAINBUFFER_HH_
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <cstdlib>
+#include <sys/uio.h>
+#include <boost/core/noncopyable.hpp>
+
+#include "slabpool.hh"
+
+namespace axn {
+
+// Buffer made of a chain of fixed-size slabs. Appending fills the last slab
+// and chains new ones, consuming releases the slabs at the front, so neither
+// moves the buffered bytes, however large the backlog is. The readable and
+// writable regions are exposed as iovec arrays for readv() and writev().
+// Bytes owned by someone else can be chained by reference as well.
+class ChainBuffer : private boost::noncopyable {
+public:
+    static constexpr std::size_t kDefaultSlabSize = 16384;
+
+    explicit ChainBuffer(std::size_t slab_size = kDefaultSlabSize)
+        : slab_size_{slab_size} {}
+
+    // High-level reading interface.
+    std::string Retrieve(std::size_t n);
+    std::string RetrieveAll() { return Retrieve(ReadableSize()); }
+
+    // High-level writing interface.
+    void Append(const char* p, std::size_t n);
+    void Append(const std::string& str) { Append(str.data(), str.size()); }
+    // Chain n bytes at p without copying them. ownerp keeps them alive and
+    // unchanged until they are consumed.
+    void AppendShared(const char* p, std::size_t n,
+                      std::shared_ptr<const void> ownerp);
+
+    // Low-level reading interface.
+    std::size_t ReadableSize() const { return readable_size_; }
+    // Fill at most max_iov iovecs with the readable bytes from the front.
+    // Return the number filled.
+    int ReadableIov(struct iovec* iov, int max_iov) const;
+    // Consume n readable bytes.
+    void Read(std::size_t n);
+    // Copy at most n readable bytes from the front to p without consuming
+    // them, e.g., a header crossing slabs. Return the number copied.
+    std::size_t Peek(char* p, std::size_t n) const;
+
+    // Low-level writing interface.
+    // Make sure at least n bytes can be written without allocating.
+    void ReserveWritable(std::size_t n);
+    std::size_t WritableSize() const { return writable_size_; }
+    // Fill at most max_iov iovecs with the writable space, up to n bytes.
+    // Return the number filled.
+    int WritableIov(struct iovec* iov, int max_iov, std::size_t n);
+    // Commit n bytes written into the writable space.
+    void Written(std::size_t n);
+
+    // Free the slabs not holding readable bytes.
+    void Shrink();
+    std::size_t SlabNum() const { return slabs_.size() + (spare_ ? 1 : 0); }
+
+private:
+    // Slab storage comes from the slab pool of the thread.
+    struct SlabFree {
+        void operator()(char* p) const { SlabPool::Deallocate(p, size); }
+        std::size_t size;
+    };
+    using SlabData = std::unique_ptr<char[], SlabFree>;
+
+    struct Slab {
+        // Null for the bytes chained by AppendShared().
+        SlabData data;
+        std::shared_ptr<const void> ownerp;
+        char* base;
+        std::size_t cap;
+        std::size_t read;
+        std::size_t write;
+    };
+
+    void AddSlab();
+
+    std::size_t slab_size_;
+    // Slabs before write_slab_ take no more bytes, and those after it are
+    // empty ones of our own.
+    std::deque<Slab, SlabPoolAllocator<Slab>> slabs_{};
+    std::size_t write_slab_{0};
+    std::size_t readable_size_{0};
+    std::size_t writable_size_{0};
+    // A drained slab is kept for the next one, avoiding the allocation in a
+    // steady stream.
+    SlabData spare_{nullptr, SlabFree{0}};
+};
+
+}
+#endif
@@ -0,0 +1,81 @@
+#ifndef _AXN_MPSCQUEUE_HH_
+#define _AXN_MPSCQUEUE_HH_
+
+#include <atomic>
+#include <utility>
+#include <boost/core/noncopyable.hpp>
+
+#include "slabpool.hh"
+
+namespace axn {
+
+// Unbounded lock-free multi-producer single-consumer queue (Dmitry Vyukov's
+// intrusive node-based algorithm). Push() and PushBatch() can be called from
+// any thread while Pop() must only be called from one consumer thread.
+// T has to be default constructible because the node in front of the queue
+// is kept as a stub.
+template <typename T>
+class MpscQueue : private boost::noncopyable {
+public:
+    MpscQueue() : head_{new Node{}}, tail_{head_.load()} {}
+    ~MpscQueue() {
+        T value{};
+        while (Pop(value)) {}
+        delete tail_;
+    }
+
+    void Push(T value) {
+        Node* nodep = new Node{};
+        nodep->value = std::move(value);
+        Link(nodep, nodep);
+    }
+
+    // Enqueue [first, last) with a single atomic exchange on the head.
+    template <typename Iter>
+    void PushBatch(Iter first, Iter last) {
+        if (first == last)
+            return;
+        Node* chain_first = new Node{};
+        chain_first->value = std::move(*first);
+        Node* chain_last = chain_first;
+        for (++first; first != last; ++first) {
+            Node* nodep = new Node{};
+            nodep->value = std::move(*first);
+            chain_last->next.store(nodep, std::memory_order_relaxed);
+            chain_last = nodep;
+        }
+        Link(chain_first, chain_last);
+    }
+
+    // Return false if the queue is empty, or a producer is in the middle of
+    // pushing the next element, in which case it will be visible soon.
+    bool Pop(T& value) {
+        Node* tailp = tail_;
+        Node* nextp = tailp->next.load(std::memory_order_acquire);
+        if (nextp == nullptr)
+            return false;
+        // nextp becomes the new stub.
+        value = std::move(nextp->value);
+        tail_ = nextp;
+        delete tailp;
+        return true;
+    }
+
+private:
+    struct Node : SlabPoolAllocated {
+        std::atomic<Node*> next{nullptr};
+        T value{};
+    };
+
+    void Link(Node* first, Node* last) {
+        Node* prevp = head_.exchange(last, std::memory_order_acq_rel);
+        prevp->next.store(first, std::memory_order_release);
+    }
+
+    // Producers push on the head and the consumer pops from the tail.
+    std::atomic<Node*> head_;
+    Node* tail_;
+};
+
+}
+#endif
@@ -0,0 +1,213 @@
+#include <new>
+#include <mutex>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <sys/mman.h>
+
+#include "slabpool.hh"
+
+namespace axn {
+
+constexpr std::size_t SlabPool::kMaxSize;
+constexpr std::size_t SlabPool::kChunkSize;
+
+// At the beginning of every chunk, which serves a single size class.
+struct SlabPool::ChunkHeader {
+    SlabPool* ownerp;
+    int cls;
+};
+
+namespace {
+
+constexpr std::size_t kHeaderSize = 64;
+std::atomic<bool> enabled{true};
+std::atomic<bool> huge_pages{false};
+std::atomic<std::size_t> chunk_num{0};
+
+// Set once the thread local pool is gone with its thread.
+thread_local bool tlocal_exited = false;
+
+// Leaked on purpose, as blocks may be freed during the static destruction.
+std::mutex& OrphansMutex() {
+    static std::mutex* mutexp = new std::mutex{};
+    return *mutexp;
+}
+
+std::vector<SlabPool*>& Orphans() {
+    static std::vector<SlabPool*>* orphansp = new std::vector<SlabPool*>{};
+    return *orphansp;
+}
+
+}
+
+// Hand the pool over when the thread exits.
+struct LocalPool {
+    ~LocalPool() {
+        tlocal_exited = true;
+        if (poolp != nullptr)
+            SlabPool::Orphan(poolp);
+    }
+
+    SlabPool* poolp{nullptr};
+};
+
+namespace {
+
+thread_local LocalPool tlocal_pool{};
+
+}
+
+void* SlabPool::Allocate(std::size_t size) {
+    if (size > kMaxSize || !enabled.load(std::memory_order_relaxed))
+        return ::operator new(size);
+    int cls = ClassOf(size);
+    if (!tlocal_exited) {
+        LocalPool& local = tlocal_pool;
+        if (local.poolp == nullptr)
+            local.poolp = Adopt();
+        return local.poolp->AllocateLocal(cls);
+    }
+    // Rare allocations of an exiting thread borrow an orphaned pool.
+    std::lock_guard<std::mutex> lock{OrphansMutex()};
+    std::vector<SlabPool*>& orphans = Orphans();
+    if (orphans.empty())
+        orphans.push_back(new SlabPool{});
+    return orphans.back()->AllocateLocal(cls);
+}
+
+void SlabPool::Deallocate(void* p, std::size_t size) {
+    if (size > kMaxSize || !enabled.load(std::memory_order_relaxed)) {
+        ::operator delete(p);
+        return;
+    }
+    ChunkHeader* headerp = ChunkOf(p);
+    if (!tlocal_exited && headerp->ownerp == tlocal_pool.poolp)
+        headerp->ownerp->FreeLocal(p, headerp->cls);
+    else
+        headerp->ownerp->FreeRemote(p);
+}
+
+void SlabPool::SetEnabled(bool on) {
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+bool SlabPool::Enabled() {
+    return enabled.load(std::memory_order_relaxed);
+}
+
+void SlabPool::SetHugePages(bool on) {
+    huge_pages.store(on, std::memory_order_relaxed);
+}
+
+std::size_t SlabPool::ChunkNum() {
+    return chunk_num.load(std::memory_order_relaxed);
+}
+
+int SlabPool::ClassOf(std::size_t size) {
+    if (size <= 128)
+        return size == 0 ? 0 : static_cast<int>((size - 1) / 16);
+    std::size_t s = size - 1;
+    int high_bit = 63 - __builtin_clzl(s);
+    int step = static_cast<int>((s >> (high_bit - 2)) & 3);
+    return 8 + (high_bit - 7) * 4 + step;
+}
+
+std::size_t SlabPool::ClassSize(int cls) {
+    if (cls < 8)
+        return 16 * static_cast<std::size_t>(cls + 1);
+    std::size_t base = std::size_t{128} << ((cls - 8) / 4);
+    return base + base / 4 * ((cls - 8) % 4 + 1);
+}
+
+SlabPool::ChunkHeader* SlabPool::ChunkOf(void* p) {
+    return reinterpret_cast<ChunkHeader*>(
+               reinterpret_cast<std::uintptr_t>(p) & ~(kChunkSize - 1));
+}
+
+SlabPool* SlabPool::Adopt() {
+    std::lock_guard<std::mutex> lock{OrphansMutex()};
+    std::vector<SlabPool*>& orphans = Orphans();
+    if (orphans.empty())
+        return new SlabPool{};
+    SlabPool* poolp = orphans.back();
+    orphans.pop_back();
+    return poolp;
+}
+
+void SlabPool::Orphan(SlabPool* poolp) {
+    std::lock_guard<std::mutex> lock{OrphansMutex()};
+    Orphans().push_back(poolp);
+}
+
+void* SlabPool::AllocateLocal(int cls) {
+    SizeClass& sc = classes_[cls];
+    if (sc.freep == nullptr &&
+        remote_frees_.load(std::memory_order_relaxed) != nullptr)
+        DrainRemote();
+    if (sc.freep != nullptr) {
+        FreeBlock* blockp = sc.freep;
+        sc.freep = blockp->next;
+        return blockp;
+    }
+    std::size_t size = ClassSize(cls);
+    if (sc.bumpp == nullptr ||
+        static_cast<std::size_t>(sc.endp - sc.bumpp) < size)
+        NewChunk(cls);
+    void* p = sc.bumpp;
+    sc.bumpp += size;
+    return p;
+}
+
+void SlabPool::FreeLocal(void* p, int cls) {
+    FreeBlock* blockp = static_cast<FreeBlock*>(p);
+    blockp->next = classes_[cls].freep;
+    classes_[cls].freep = blockp;
+}
+
+void SlabPool::FreeRemote(void* p) {
+    FreeBlock* blockp = static_cast<FreeBlock*>(p);
+    FreeBlock* headp = remote_frees_.load(std::memory_order_relaxed);
+    do {
+        blockp->next = headp;
+    } while (!remote_frees_.compare_exchange_weak(headp, blockp,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+}
+
+void SlabPool::DrainRemote() {
+    FreeBlock* blockp = remote_frees_.exchange(nullptr,
+                                               std::memory_order_acquire);
+    while (blockp != nullptr) {
+        FreeBlock* nextp = blockp->next;
+        FreeLocal(blockp, ChunkOf(blockp)->cls);
+        blockp = nextp;
+    }
+}
+
+void SlabPool::NewChunk(int cls) {
+    // Map twice the size to cut an aligned chunk out of it.
+    void* p = ::mmap(nullptr, 2 * kChunkSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc{};
+    char* beginp = static_cast<char*>(p);
+    char* chunkp = reinterpret_cast<char*>(
+                       (reinterpret_cast<std::uintptr_t>(p) + kChunkSize - 1) &
+                       ~(kChunkSize - 1));
+    if (chunkp > beginp)
+        ::munmap(beginp, chunkp - beginp);
+    if (chunkp + kChunkSize < beginp + 2 * kChunkSize)
+        ::munmap(chunkp + kChunkSize, beginp + kChunkSize - chunkp);
+    if (huge_pages.load(std::memory_order_relaxed))
+        ::madvise(chunkp, kChunkSize, MADV_HUGEPAGE);
+    ChunkHeader* headerp = reinterpret_cast<ChunkHeader*>(chunkp);
+    headerp->ownerp = this;
+    headerp->cls = cls;
+    // The tail of the previous chunk is left unused.
+    classes_[cls].bumpp = chunkp + kHeaderSize;
+    classes_[cls].endp = chunkp + kChunkSize;
+    chunk_num.fetch_add(1, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,113 @@
+#ifndef _AXN_SLABPOOL_HH_
+#define _AXN_SLABPOOL_HH_
+
+#include <atomic>
+#include <cstdlib>
+#include <boost/core/noncopyable.hpp>
+
+namespace axn {
+
+// Allocator of small blocks in size classes. Every thread takes a pool of its
+// own at its first allocation, so an event loop allocates and frees its
+// connections, buffers and pending tasks on plain free lists. A block freed
+// by another thread goes back to its pool through a lock-free list, which
+// the owner drains when a free list runs out. Blocks are carved from chunks
+// aligned to kChunkSize, which are never returned to the system, and the
+// pool of an exited thread is adopted by the next new one.
+class SlabPool : private boost::noncopyable {
+public:
+    static constexpr std::size_t kMaxSize = 16384;
+    static constexpr std::size_t kChunkSize = 2 << 20;
+
+    // Blocks larger than kMaxSize, and all blocks with the pool disabled,
+    // come from operator new.
+    static void* Allocate(std::size_t size);
+    // The size has to be the one passed to Allocate().
+    static void Deallocate(void* p, std::size_t size);
+
+    // Both have to be set before anything is allocated, e.g., at the very
+    // beginning of main(). The pool is enabled by default.
+    static void SetEnabled(bool enabled);
+    static bool Enabled();
+    // Advise transparent huge pages for the chunks, at the cost of making
+    // every chunk fully resident.
+    static void SetHugePages(bool on);
+    // Number of chunks mapped by the pools of all threads.
+    static std::size_t ChunkNum();
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    struct SizeClass {
+        FreeBlock* freep{nullptr};
+        // Never used part of the current chunk.
+        char* bumpp{nullptr};
+        char* endp{nullptr};
+    };
+    struct ChunkHeader;
+
+    // Classes of 16 bytes steps up to 128 bytes, then 4 steps per power of
+    // two, wasting at most 20% of a block.
+    static constexpr int kClassNum = 36;
+    static int ClassOf(std::size_t size);
+    static std::size_t ClassSize(int cls);
+    static ChunkHeader* ChunkOf(void* p);
+    // Take an orphaned pool or create one.
+    static SlabPool* Adopt();
+    static void Orphan(SlabPool* poolp);
+    friend struct LocalPool;
+
+    SlabPool() = default;
+
+    void* AllocateLocal(int cls);
+    void FreeLocal(void* p, int cls);
+    void FreeRemote(void* p);
+    void DrainRemote();
+    void NewChunk(int cls);
+
+    SizeClass classes_[kClassNum];
+    std::atomic<FreeBlock*> remote_frees_{nullptr};
+};
+
+// Inherit it to allocate the objects of a class from the slab pool.
+struct SlabPoolAllocated {
+    static void* operator new(std::size_t size) {
+        return SlabPool::Allocate(size);
+    }
+    static void operator delete(void* p, std::size_t size) {
+        SlabPool::Deallocate(p, size);
+    }
+};
+
+// Standard allocator on the slab pool, e.g., for the control block of a
+// shared_ptr.
+template <typename T>
+class SlabPoolAllocator {
+public:
+    using value_type = T;
+
+    SlabPoolAllocator() = default;
+    template <typename U>
+    SlabPoolAllocator(const SlabPoolAllocator<U>&) {}
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(SlabPool::Allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, std::size_t n) {
+        SlabPool::Deallocate(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const SlabPoolAllocator<T>&, const SlabPoolAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SlabPoolAllocator<T>&, const SlabPoolAllocator<U>&) {
+    return false;
+}
+
+}
+#endif
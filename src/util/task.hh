@@ -0,0 +1,126 @@
+#ifndef _AXN_TASK_HH_
+#define _AXN_TASK_HH_
+
+#include <new>
+#include <utility>
+#include <cstddef>
+#include <functional>
+#include <type_traits>
+
+namespace axn {
+
+// Move-only replacement of std::function<void()>. Callables no larger than
+// kInlineSize bytes, e.g., a lambda capturing a shared_ptr and a std::string,
+// are stored inline so constructing and moving a Task does not allocate.
+// Larger ones, and those not nothrow move constructible (note that copy
+// capturing a const reference makes a const member), fall back to the heap.
+class Task {
+public:
+    static constexpr std::size_t kInlineSize = 96;
+
+    Task() noexcept = default;
+    Task(std::nullptr_t) noexcept {}
+    template <typename F,
+              typename = std::enable_if_t<
+                  !std::is_same<std::decay_t<F>, Task>::value>>
+    Task(F&& f) { Init<std::decay_t<F>>(std::forward<F>(f)); }
+    Task(Task&& other) noexcept { MoveFrom(other); }
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+    Task& operator=(std::nullptr_t) noexcept { Reset(); return *this; }
+    ~Task() { Reset(); }
+
+    explicit operator bool() const noexcept { return opsp_ != nullptr; }
+    void operator()() { opsp_->invoke(&storage_); }
+
+private:
+    struct Ops {
+        void (*invoke)(void*);
+        // Move-construct into dst and destroy src.
+        void (*relocate)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    template <typename F>
+    struct InlineOps {
+        static void Invoke(void* p) { (*static_cast<F*>(p))(); }
+        static void Relocate(void* dst, void* src) {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+            static_cast<F*>(src)->~F();
+        }
+        static void Destroy(void* p) { static_cast<F*>(p)->~F(); }
+        static constexpr Ops ops{Invoke, Relocate, Destroy};
+    };
+
+    template <typename F>
+    struct HeapOps {
+        static void Invoke(void* p) { (**static_cast<F**>(p))(); }
+        static void Relocate(void* dst, void* src) {
+            *static_cast<F**>(dst) = *static_cast<F**>(src);
+        }
+        static void Destroy(void* p) { delete *static_cast<F**>(p); }
+        static constexpr Ops ops{Invoke, Relocate, Destroy};
+    };
+
+    template <typename F>
+    static constexpr bool kFitsInline =
+        sizeof(F) <= kInlineSize &&
+        alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<F>::value;
+
+    // Keep empty std::function objects and null function pointers empty.
+    template <typename F>
+    static bool IsNull(const F&) { return false; }
+    template <typename R, typename... Args>
+    static bool IsNull(const std::function<R(Args...)>& f) { return !f; }
+    template <typename R, typename... Args>
+    static bool IsNull(R (*f)(Args...)) { return f == nullptr; }
+
+    template <typename F, typename Arg>
+    std::enable_if_t<kFitsInline<F>> Init(Arg&& f) {
+        if (IsNull(f))
+            return;
+        ::new (&storage_) F(std::forward<Arg>(f));
+        opsp_ = &InlineOps<F>::ops;
+    }
+
+    template <typename F, typename Arg>
+    std::enable_if_t<!kFitsInline<F>> Init(Arg&& f) {
+        if (IsNull(f))
+            return;
+        *reinterpret_cast<F**>(&storage_) = new F(std::forward<Arg>(f));
+        opsp_ = &HeapOps<F>::ops;
+    }
+
+    void MoveFrom(Task& other) noexcept {
+        if (other.opsp_) {
+            other.opsp_->relocate(&storage_, &other.storage_);
+            opsp_ = other.opsp_;
+            other.opsp_ = nullptr;
+        }
+    }
+
+    void Reset() noexcept {
+        if (opsp_) {
+            opsp_->destroy(&storage_);
+            opsp_ = nullptr;
+        }
+    }
+
+    const Ops* opsp_{nullptr};
+    std::aligned_storage_t<kInlineSize, alignof(std::max_align_t)> storage_;
+};
+
+template <typename F>
+constexpr Task::Ops Task::InlineOps<F>::ops;
+
+template <typename F>
+constexpr Task::Ops Task::HeapOps<F>::ops;
+
+}
+#endif
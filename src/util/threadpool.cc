@@ -1,52 +1,454 @@
+#include <cassert>
+#include <algorithm>
+
 #include "threadpool.hh"
+#include "affinity.hh"
+#include "slabpool.hh"
 
 namespace axn {
 
+struct ThreadPool::TaskNode : SlabPoolAllocated {
+    TaskNode(Functor f, int p, std::int64_t t)
+        : task{std::move(f)}, prio{p}, enqueue_ns{t} {}
+
+    std::atomic<TaskNode*> next{nullptr};
+    Functor task;
+    int prio;
+    // For the waiting time.
+    std::int64_t enqueue_ns;
+};
+
+// Dmitry Vyukov's algorithm like MpscQueue, but linking the TaskNode objects
+// directly so that a task costs a single allocation from AddTask() to the
+// deque.
+class ThreadPool::Inbox : private boost::noncopyable {
+public:
+    Inbox() : head_{&stub_}, tail_{&stub_} {}
+
+    void Push(TaskNode* nodep) {
+        nodep->next.store(nullptr, std::memory_order_relaxed);
+        TaskNode* prevp = head_.exchange(nodep, std::memory_order_acq_rel);
+        prevp->next.store(nodep, std::memory_order_release);
+    }
+
+    // Return nullptr if empty, or if a producer is in the middle of pushing.
+    TaskNode* Pop() {
+        TaskNode* tailp = tail_;
+        TaskNode* nextp = tailp->next.load(std::memory_order_acquire);
+        if (tailp == &stub_) {
+            if (nextp == nullptr)
+                return nullptr;
+            tail_ = nextp;
+            tailp = nextp;
+            nextp = nextp->next.load(std::memory_order_acquire);
+        }
+        if (nextp != nullptr) {
+            tail_ = nextp;
+            return tailp;
+        }
+        if (tailp != head_.load(std::memory_order_acquire))
+            return nullptr;
+        // tailp is the last one. Put the stub behind it so it can be taken.
+        Push(&stub_);
+        nextp = tailp->next.load(std::memory_order_acquire);
+        if (nextp != nullptr) {
+            tail_ = nextp;
+            return tailp;
+        }
+        return nullptr;
+    }
+
+    // A hint only, safe to call in any thread. The last node is only taken
+    // after the stub is put behind it, so the stub is at the head when the
+    // inbox is empty.
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire) == &stub_;
+    }
+
+private:
+    std::atomic<TaskNode*> head_;
+    TaskNode* tail_;
+    TaskNode stub_{Functor{}, 0, 0};
+};
+
+struct alignas(64) ThreadPool::Worker {
+    struct Lane {
+        WsDeque<TaskNode> deque{};
+        Inbox inbox{};
+        // Held by the worker draining the inbox, which has a single
+        // consumer.
+        std::atomic_bool draining{false};
+    };
+
+    // One per priority.
+    std::array<Lane, kTaskPriorityNum> lanes{};
+    // State of the random victim selection.
+    unsigned rand_state{0};
+    std::mutex park_mutex{};
+    std::condition_variable park_cv{};
+    std::atomic_bool parked{false};
+    // Only written by the worker itself.
+    std::atomic<std::uint64_t> executed{0};
+    std::atomic<std::int64_t> wait_ns{0};
+    std::atomic<std::int64_t> max_wait_ns{0};
+};
+
+namespace {
+
+// Rounds of looking for tasks before sleeping.
+constexpr int kSpinRounds = 64;
+// Rounds before starting to yield the cpu while spinning.
+constexpr int kBusySpinRounds = 16;
+
+thread_local ThreadPool* tlocal_pool = nullptr;
+thread_local void* tlocal_worker = nullptr;
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+inline std::int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // unnamed namespace
+
+ThreadPool::ThreadPool() {
+    SetThreadNum(thread_num_);
+}
+
 ThreadPool::~ThreadPool() {
     if (running_)
         Stop();
+    for (auto& workerp : workers_) {
+        for (auto& lane : workerp->lanes) {
+            while (TaskNode* nodep = lane.deque.Pop())
+                delete nodep;
+            while (TaskNode* nodep = lane.inbox.Pop())
+                delete nodep;
+        }
+    }
+}
+
+void ThreadPool::SetThreadNum(int n) {
+    assert(!running_ && n > 0);
+    thread_num_ = n;
+    workers_.clear();
+    for (int i = 0; i < n; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+        workers_.back()->rand_state =
+            static_cast<unsigned>(i) * 2654435761u + 1;
+    }
 }
 
 void ThreadPool::Start() {
     running_ = true;
     pool_.reserve(thread_num_);
     for (int i = 0; i < thread_num_; ++i) {
-        pool_.emplace_back([&]() { ThreadFunc(); });
+        pool_.emplace_back([this, i]() { ThreadFunc(i); });
     }
 }
 
 void ThreadPool::Stop() {
     running_ = false;
-    not_empty_.notify_all();
+    for (auto& workerp : workers_) {
+        std::lock_guard<std::mutex> lock{workerp->park_mutex};
+        workerp->park_cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock{room_mutex_};
+        room_cv_.notify_all();
+    }
     for (auto& t : pool_)
         t.join();
     pool_.clear();
 }
 
-void ThreadPool::AddTask(Functor f) {
-    std::lock_guard<std::mutex> lock{tasks_mutex_};
-    tasks_.push_back(std::move(f));
-    not_empty_.notify_one();
+bool ThreadPool::AddTask(Functor f, TaskPriority prio) {
+    if (Reserve(1) == 1) {
+        Enqueue(&f, 1, prio);
+        return true;
+    }
+    return HandleFull(&f, 1, prio) == 1;
+}
+
+bool ThreadPool::TryAddTask(Functor f, TaskPriority prio) {
+    if (Reserve(1) == 1) {
+        Enqueue(&f, 1, prio);
+        return true;
+    }
+    if (full_policy_ == QueueFullPolicy::kBlock) {
+        rejected_num_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    return HandleFull(&f, 1, prio) == 1;
+}
+
+std::size_t ThreadPool::AddTasks(std::vector<Functor> fs, TaskPriority prio) {
+    std::size_t n = Reserve(fs.size());
+    Enqueue(fs.data(), n, prio);
+    if (n == fs.size())
+        return n;
+    return n + HandleFull(fs.data() + n, fs.size() - n, prio);
 }
 
-ThreadPool::Functor ThreadPool::GetTask() {
-    std::unique_lock<std::mutex> lock{tasks_mutex_};
-    while (tasks_.empty() && running_)
-        not_empty_.wait(lock);
-    if (!running_)
-        return {};
-    Functor f = tasks_.front();
-    tasks_.pop_front();
-    return f;
+ThreadPoolStats ThreadPool::GetStats() const {
+    ThreadPoolStats stats{};
+    stats.queue_depth = queued_num_.load(std::memory_order_relaxed);
+    stats.max_queue_depth = max_queued_num_.load(std::memory_order_relaxed);
+    stats.rejected = rejected_num_.load(std::memory_order_relaxed);
+    stats.run_in_caller = run_in_caller_num_.load(std::memory_order_relaxed);
+    std::int64_t wait_ns = 0;
+    std::int64_t max_wait_ns = 0;
+    for (auto& workerp : workers_) {
+        stats.executed += workerp->executed.load(std::memory_order_relaxed);
+        wait_ns += workerp->wait_ns.load(std::memory_order_relaxed);
+        max_wait_ns = std::max(
+            max_wait_ns, workerp->max_wait_ns.load(std::memory_order_relaxed));
+    }
+    if (stats.executed > 0)
+        stats.avg_wait = std::chrono::nanoseconds{
+            wait_ns / static_cast<std::int64_t>(stats.executed)};
+    stats.max_wait = std::chrono::nanoseconds{max_wait_ns};
+    return stats;
+}
+
+std::size_t ThreadPool::Reserve(std::size_t n) {
+    std::size_t prev = queued_num_.load();
+    std::size_t m = n;
+    if (max_queue_size_ == 0) {
+        prev = queued_num_.fetch_add(n);
+    } else {
+        do {
+            if (prev >= max_queue_size_)
+                return 0;
+            m = std::min(n, max_queue_size_ - prev);
+        } while (!queued_num_.compare_exchange_weak(prev, prev + m));
+    }
+    std::size_t depth = prev + m;
+    std::size_t max_depth = max_queued_num_.load(std::memory_order_relaxed);
+    while (depth > max_depth &&
+           !max_queued_num_.compare_exchange_weak(max_depth, depth,
+                                                  std::memory_order_relaxed))
+        ;
+    return m;
+}
+
+std::size_t ThreadPool::WaitForRoom(std::size_t n) {
+    std::unique_lock<std::mutex> lock{room_mutex_};
+    // Pairs with OnTaken(): either it sees this producer blocked, or the
+    // room it makes is seen below.
+    blocked_num_.fetch_add(1);
+    std::size_t m = 0;
+    while ((m = Reserve(n)) == 0 && running_)
+        room_cv_.wait(lock);
+    blocked_num_.fetch_sub(1);
+    return m;
+}
+
+std::size_t ThreadPool::HandleFull(Functor* fs, std::size_t n,
+                                   TaskPriority prio) {
+    if (full_policy_ == QueueFullPolicy::kReject) {
+        rejected_num_.fetch_add(n, std::memory_order_relaxed);
+        return 0;
+    }
+    std::size_t done = 0;
+    if (full_policy_ == QueueFullPolicy::kBlock && running_ &&
+        !IsWorkerThread()) {
+        while (done < n) {
+            std::size_t m = WaitForRoom(n - done);
+            if (m == 0)
+                break;
+            Enqueue(fs + done, m, prio);
+            done += m;
+        }
+    }
+    // Run the rest in the caller.
+    run_in_caller_num_.fetch_add(n - done, std::memory_order_relaxed);
+    for (; done < n; ++done)
+        fs[done]();
+    return n;
+}
+
+void ThreadPool::Enqueue(Functor* fs, std::size_t n, TaskPriority prio) {
+    if (n == 0)
+        return;
+    int p = static_cast<int>(prio);
+    prio_queued_num_[p].fetch_add(n, std::memory_order_relaxed);
+    std::int64_t now = NowNs();
+    if (IsWorkerThread()) {
+        // Added by a worker, which will run them soon unless others steal
+        // them.
+        Worker& self = *static_cast<Worker*>(tlocal_worker);
+        for (std::size_t i = 0; i < n; ++i)
+            self.lanes[p].deque.Push(new TaskNode{std::move(fs[i]), p, now});
+        WakeOneSleeper();
+        return;
+    }
+    unsigned id = next_worker_.fetch_add(static_cast<unsigned>(n),
+                                         std::memory_order_relaxed);
+    for (std::size_t i = 0; i < n; ++i) {
+        Worker& worker = *workers_[(id + i) % workers_.size()];
+        worker.lanes[p].inbox.Push(new TaskNode{std::move(fs[i]), p, now});
+        // The worker may be busy with a long task, so let a sleeping one
+        // take the inbox over.
+        if (!Wake(worker))
+            WakeOneSleeper();
+    }
 }
 
-void ThreadPool::ThreadFunc() {
+bool ThreadPool::IsWorkerThread() const {
+    return tlocal_pool == this;
+}
+
+void ThreadPool::ThreadFunc(int id) {
+    if (!cpus_.empty())
+        PinThisThread(cpus_[id % cpus_.size()]);
+    Worker& self = *workers_[id];
+    tlocal_pool = this;
+    tlocal_worker = &self;
     if (thread_init_cb_)
         thread_init_cb_();
+    int idle_rounds = 0;
     while (running_) {
-        Functor task = GetTask();
-        if (task)
-            task();
+        TaskNode* nodep = FindTask(self);
+        if (nodep != nullptr) {
+            idle_rounds = 0;
+            OnTaken(self, *nodep);
+            nodep->task();
+            delete nodep;
+            self.executed.store(
+                self.executed.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+        } else if (++idle_rounds < kBusySpinRounds) {
+            CpuRelax();
+        } else if (idle_rounds < kSpinRounds) {
+            std::this_thread::yield();
+        } else {
+            Park(self);
+            idle_rounds = 0;
+        }
+    }
+    tlocal_pool = nullptr;
+    tlocal_worker = nullptr;
+}
+
+ThreadPool::TaskNode* ThreadPool::FindTask(Worker& self) {
+    for (int p = 0; p < kTaskPriorityNum; ++p) {
+        // Skip the priorities without any task cheaply.
+        if (prio_queued_num_[p].load(std::memory_order_relaxed) == 0)
+            continue;
+        auto& lane = self.lanes[p];
+        if (TaskNode* nodep = lane.deque.Pop())
+            return nodep;
+        // Other workers may help with the rest of a batch.
+        if (DrainInbox(self, self, p) > 1)
+            WakeOneSleeper();
+        if (TaskNode* nodep = lane.deque.Pop())
+            return nodep;
+        if (TaskNode* nodep = Steal(self, p))
+            return nodep;
+    }
+    return nullptr;
+}
+
+ThreadPool::TaskNode* ThreadPool::Steal(Worker& self, int prio) {
+    std::size_t n = workers_.size();
+    if (n < 2)
+        return nullptr;
+    // xorshift.
+    self.rand_state ^= self.rand_state << 13;
+    self.rand_state ^= self.rand_state >> 17;
+    self.rand_state ^= self.rand_state << 5;
+    std::size_t start = self.rand_state % n;
+    for (std::size_t i = 0; i < n; ++i) {
+        Worker& victim = *workers_[(start + i) % n];
+        if (&victim == &self)
+            continue;
+        if (TaskNode* nodep = victim.lanes[prio].deque.Steal())
+            return nodep;
+        // The victim is busy with a task and has not drained its inbox.
+        if (victim.lanes[prio].inbox.Empty())
+            continue;
+        int n = DrainInbox(self, victim, prio);
+        if (n > 1)
+            WakeOneSleeper();
+        if (n > 0) {
+            if (TaskNode* nodep = self.lanes[prio].deque.Pop())
+                return nodep;
+        }
+    }
+    return nullptr;
+}
+
+int ThreadPool::DrainInbox(Worker& self, Worker& owner, int prio) {
+    auto& lane = owner.lanes[prio];
+    if (lane.draining.exchange(true, std::memory_order_acquire))
+        return 0;
+    auto& deque = self.lanes[prio].deque;
+    int n = 0;
+    while (TaskNode* nodep = lane.inbox.Pop()) {
+        deque.Push(nodep);
+        ++n;
+    }
+    lane.draining.store(false, std::memory_order_release);
+    return n;
+}
+
+void ThreadPool::OnTaken(Worker& self, const TaskNode& node) {
+    std::int64_t wait_ns = NowNs() - node.enqueue_ns;
+    self.wait_ns.store(self.wait_ns.load(std::memory_order_relaxed) + wait_ns,
+                       std::memory_order_relaxed);
+    if (wait_ns > self.max_wait_ns.load(std::memory_order_relaxed))
+        self.max_wait_ns.store(wait_ns, std::memory_order_relaxed);
+    prio_queued_num_[node.prio].fetch_sub(1, std::memory_order_relaxed);
+    queued_num_.fetch_sub(1);
+    if (blocked_num_.load() > 0) {
+        std::lock_guard<std::mutex> lock{room_mutex_};
+        room_cv_.notify_one();
+    }
+}
+
+void ThreadPool::Park(Worker& self) {
+    std::unique_lock<std::mutex> lock{self.park_mutex};
+    self.parked.store(true, std::memory_order_relaxed);
+    sleeper_num_.fetch_add(1, std::memory_order_relaxed);
+    // Pairs with the fence in Wake() and WakeOneSleeper(): either they see
+    // this worker parked, or this worker sees their tasks below.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool has_work = false;
+    for (std::size_t i = 0; i < workers_.size() && !has_work; ++i) {
+        for (auto& lane : workers_[i]->lanes)
+            has_work = has_work || !lane.deque.Empty() || !lane.inbox.Empty();
+    }
+    while (!has_work && running_ && self.parked.load(std::memory_order_relaxed))
+        self.park_cv.wait(lock);
+    self.parked.store(false, std::memory_order_relaxed);
+    sleeper_num_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool ThreadPool::Wake(Worker& worker) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!worker.parked.load(std::memory_order_relaxed))
+        return false;
+    std::lock_guard<std::mutex> lock{worker.park_mutex};
+    worker.parked.store(false, std::memory_order_relaxed);
+    worker.park_cv.notify_one();
+    return true;
+}
+
+void ThreadPool::WakeOneSleeper() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeper_num_.load(std::memory_order_relaxed) == 0)
+        return;
+    for (auto& workerp : workers_) {
+        if (workerp->parked.load(std::memory_order_relaxed)) {
+            Wake(*workerp);
+            return;
+        }
     }
 }
 
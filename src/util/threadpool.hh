@@ -1,44 +1,160 @@
 #ifndef _AXN_THREADPOOL_HH_
 #define _AXN_THREADPOOL_HH_
 
-#include <functional>
-#include <deque>
+#include <array>
 #include <vector>
+#include <memory>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <thread>
+#include <future>
+#include <chrono>
+#include <cstdint>
+#include <type_traits>
 #include <boost/core/noncopyable.hpp>
 
+#include "task.hh"
+#include "wsdeque.hh"
+
 namespace axn {
 
+// Workers always take a task of a higher priority first, then the older one
+// within the same priority if it is from another thread.
+enum class TaskPriority { kHigh, kNormal, kLow };
+constexpr int kTaskPriorityNum = 3;
+
+// What AddTask() does when the queue is bounded and full.
+enum class QueueFullPolicy {
+    // Wait for the room. AddTask() from the workers or before Start() runs
+    // the task in the caller instead, which would wait forever otherwise.
+    kBlock,
+    // Drop the task and return false.
+    kReject,
+    // Run the task in the calling thread, slowing down the producer.
+    kRunInCaller
+};
+
+struct ThreadPoolStats {
+    // Tasks added but not started yet.
+    std::size_t queue_depth;
+    // The largest queue depth seen.
+    std::size_t max_queue_depth;
+    std::uint64_t executed;
+    std::uint64_t rejected;
+    std::uint64_t run_in_caller;
+    // Time from being added to being started, of the executed tasks.
+    std::chrono::nanoseconds avg_wait;
+    std::chrono::nanoseconds max_wait;
+};
+
+// Work-stealing thread pool. Every worker owns a lock-free deque per priority.
+// Tasks added by a worker go to the bottom of its own deque and are run LIFO,
+// tasks added by other threads are spread over the workers' inboxes, and idle
+// workers steal from the top of random victims' deques, or take over their
+// inboxes so that a busy worker does not hold back the tasks sent to it. A
+// worker out of work spins for a while before sleeping.
 class ThreadPool : private boost::noncopyable {
 public:
-    using Functor = std::function<void()>;
+    using Functor = Task;
 
-    ThreadPool() = default;
+    ThreadPool();
     ~ThreadPool();
 
-    void SetThreadNum(int n) { thread_num_ = n; }
-    void SetThreadInitCallback(Functor f) { thread_init_cb_ = f; }
+    // Must be called before Start() and AddTask().
+    void SetThreadNum(int n);
+    // Pin the i-th thread to cpus[i % cpus.size()] before the thread init
+    // callback. Must be called before Start().
+    void SetCpuList(std::vector<int> cpus) { cpus_ = std::move(cpus); }
+    void SetThreadInitCallback(Functor f) { thread_init_cb_ = std::move(f); }
+    // Bound the number of tasks not started yet, 0 (default) for no bound.
+    void SetMaxQueueSize(std::size_t n) { max_queue_size_ = n; }
+    void SetQueueFullPolicy(QueueFullPolicy policy) { full_policy_ = policy; }
     bool IsRunning() const { return running_; }
     void Start();
+    // Tasks not run yet are kept until the next Start() or the destruction.
     void Stop();
-    void AddTask(Functor f);
+
+    // All of the following are thread safe.
+    // Return false if the task is rejected by the full queue.
+    bool AddTask(Functor f, TaskPriority prio = TaskPriority::kNormal);
+    // Like AddTask(), but never waits for the room, e.g., for an EventLoop
+    // thread. The full queue rejects the task with kBlock too.
+    bool TryAddTask(Functor f, TaskPriority prio = TaskPriority::kNormal);
+    // Add the tasks in one go, which is cheaper than adding them one by one.
+    // Return the number of tasks not rejected.
+    std::size_t AddTasks(std::vector<Functor> fs,
+                         TaskPriority prio = TaskPriority::kNormal);
+    // Like AddTask(), but the result, or the exception thrown, is delivered
+    // by the returned future. A rejected task breaks the promise, so get()
+    // throws std::future_error.
+    template <typename F>
+    std::future<std::result_of_t<F&()>>
+    Submit(F f, TaskPriority prio = TaskPriority::kNormal) {
+        std::packaged_task<std::result_of_t<F&()>()> task{std::move(f)};
+        auto fut = task.get_future();
+        AddTask(std::move(task), prio);
+        return fut;
+    }
+
+    std::size_t QueueDepth() const {
+        return queued_num_.load(std::memory_order_relaxed); }
+    ThreadPoolStats GetStats() const;
 
 private:
-    Functor GetTask();
-    void ThreadFunc();
+    struct TaskNode;
+    // Intrusive multi-producer single-consumer queue of TaskNode.
+    class Inbox;
+    struct Worker;
+
+    void ThreadFunc(int id);
+    TaskNode* FindTask(Worker& self);
+    TaskNode* Steal(Worker& self, int prio);
+    // Move the tasks of the inbox of owner into the deque of self. Return the
+    // number of them, 0 if another worker is draining it.
+    int DrainInbox(Worker& self, Worker& owner, int prio);
+    // Account a task taken out of the queue.
+    void OnTaken(Worker& self, const TaskNode& node);
+    // Reserve the room for at most n tasks and return the number reserved.
+    std::size_t Reserve(std::size_t n);
+    // Wait until some room can be reserved. Return 0 if stopped.
+    std::size_t WaitForRoom(std::size_t n);
+    // Handle the tasks not having room according to the policy. Return the
+    // number of them not rejected.
+    std::size_t HandleFull(Functor* fs, std::size_t n, TaskPriority prio);
+    // Queue the tasks whose room have been reserved.
+    void Enqueue(Functor* fs, std::size_t n, TaskPriority prio);
+    void Park(Worker& self);
+    // Return false if the worker is not sleeping.
+    bool Wake(Worker& worker);
+    // Wake a sleeping worker, if any, to steal from the others.
+    void WakeOneSleeper();
+    bool IsWorkerThread() const;
 
     // Normal bool may cause worker thread to wait for tasks, not
     // responding to the stop command.
     std::atomic_bool running_{false};
     int thread_num_{1};
-    mutable std::mutex tasks_mutex_{};
-    mutable std::condition_variable not_empty_{};
-    std::deque<Functor> tasks_{};
+    std::vector<std::unique_ptr<Worker>> workers_{};
+    // For spreading the tasks added by other threads.
+    std::atomic<unsigned> next_worker_{0};
+    std::atomic<int> sleeper_num_{0};
     std::vector<std::thread> pool_{};
+    std::vector<int> cpus_{};
     Functor thread_init_cb_{};
+
+    std::size_t max_queue_size_{0};
+    QueueFullPolicy full_policy_{QueueFullPolicy::kBlock};
+    // Tasks added but not taken by the workers, in total and per priority.
+    alignas(64) std::atomic<std::size_t> queued_num_{0};
+    std::array<std::atomic<std::size_t>, kTaskPriorityNum> prio_queued_num_{};
+    std::atomic<std::size_t> max_queued_num_{0};
+    std::atomic<std::uint64_t> rejected_num_{0};
+    std::atomic<std::uint64_t> run_in_caller_num_{0};
+    // For the producers blocked by the full queue.
+    std::mutex room_mutex_{};
+    std::condition_variable room_cv_{};
+    std::atomic<int> blocked_num_{0};
 };
 
 }
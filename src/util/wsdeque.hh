@@ -0,0 +1,114 @@
+#ifndef _AXN_WSDEQUE_HH_
+#define _AXN_WSDEQUE_HH_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <boost/core/noncopyable.hpp>
+
+namespace axn {
+
+// Lock-free work-stealing deque of pointers (Chase-Lev, with the memory
+// orderings of Le et al., "Correct and Efficient Work-Stealing for Weak
+// Memory Models"). Push() and Pop() must only be called by the owner thread,
+// which uses the bottom end as a stack, while Steal() can be called from any
+// thread and takes from the top end. The deque does not own the pointees.
+template <typename T>
+class WsDeque : private boost::noncopyable {
+public:
+    explicit WsDeque(std::int64_t capacity = 256)
+        : arrayp_{new Array{capacity}} {
+        arrays_.emplace_back(arrayp_.load(std::memory_order_relaxed));
+    }
+
+    void Push(T* p) {
+        std::int64_t b = bottom_.load(std::memory_order_relaxed);
+        std::int64_t t = top_.load(std::memory_order_acquire);
+        Array* ap = arrayp_.load(std::memory_order_relaxed);
+        if (b - t > ap->capacity - 1)
+            ap = Grow(ap, t, b);
+        ap->Put(b, p);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Return nullptr if empty.
+    T* Pop() {
+        std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+        Array* ap = arrayp_.load(std::memory_order_relaxed);
+        bottom_.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top_.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* p = ap->Get(b);
+        if (t == b) {
+            // The last one, race with the thieves.
+            if (!top_.compare_exchange_strong(t, t + 1,
+                                              std::memory_order_seq_cst,
+                                              std::memory_order_relaxed))
+                p = nullptr;
+            bottom_.store(b + 1, std::memory_order_relaxed);
+        }
+        return p;
+    }
+
+    // Return nullptr if empty or if another thread won the race.
+    T* Steal() {
+        std::int64_t t = top_.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = bottom_.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        Array* ap = arrayp_.load(std::memory_order_acquire);
+        T* p = ap->Get(t);
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+            return nullptr;
+        return p;
+    }
+
+    // A hint only, since thieves may change it at any time.
+    bool Empty() const {
+        return bottom_.load(std::memory_order_relaxed) <=
+               top_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Array {
+        explicit Array(std::int64_t cap)
+            : capacity{cap}, slots{new std::atomic<T*>[cap]} {}
+        T* Get(std::int64_t i) const {
+            return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void Put(std::int64_t i, T* p) {
+            slots[i & (capacity - 1)].store(p, std::memory_order_relaxed); }
+
+        // A power of 2.
+        std::int64_t capacity;
+        std::unique_ptr<std::atomic<T*>[]> slots;
+    };
+
+    Array* Grow(Array* ap, std::int64_t t, std::int64_t b) {
+        Array* new_ap = new Array{ap->capacity * 2};
+        for (std::int64_t i = t; i < b; ++i)
+            new_ap->Put(i, ap->Get(i));
+        // Thieves may still be reading the old array, so it is only freed
+        // with the deque.
+        arrays_.emplace_back(new_ap);
+        arrayp_.store(new_ap, std::memory_order_release);
+        return new_ap;
+    }
+
+    // Thieves and the owner touch the two ends, so keep them apart.
+    alignas(64) std::atomic<std::int64_t> top_{0};
+    alignas(64) std::atomic<std::int64_t> bottom_{0};
+    std::atomic<Array*> arrayp_;
+    // Only accessed by the owner.
+    std::vector<std::unique_ptr<Array>> arrays_{};
+};
+
+}
+#endif
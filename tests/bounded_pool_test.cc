@@ -0,0 +1,182 @@
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#include "util/threadpool.hh"
+
+using namespace axn;
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+// A burst of cpu-heavy tasks from several producers into a bounded pool with
+// each of the queue full policies, then high and low priority tasks competing
+// for one worker, and finally Submit(), AddTasks() and TryAddTask().
+
+// About 50us of work.
+void Work() {
+    volatile unsigned x = 0;
+    for (int i = 0; i < 20000; ++i)
+        x = x + i;
+}
+
+const char* PolicyName(QueueFullPolicy policy) {
+    switch (policy) {
+    case QueueFullPolicy::kBlock:
+        return "block";
+    case QueueFullPolicy::kReject:
+        return "reject";
+    default:
+        return "run-in-caller";
+    }
+}
+
+void PrintStats(const ThreadPoolStats& stats) {
+    std::cout << "  executed " << stats.executed << ", rejected "
+              << stats.rejected << ", run in caller " << stats.run_in_caller
+              << ", max depth " << stats.max_queue_depth << ", avg wait "
+              << stats.avg_wait.count() / 1000 << " us, max wait "
+              << stats.max_wait.count() / 1000 << " us" << std::endl;
+}
+
+bool Burst(QueueFullPolicy policy, int thread_num, int producer_num,
+           int tasks_per_producer, std::size_t max_queue_size) {
+    ThreadPool pool{};
+    pool.SetThreadNum(thread_num);
+    pool.SetMaxQueueSize(max_queue_size);
+    pool.SetQueueFullPolicy(policy);
+    pool.Start();
+    std::atomic<long> done{0};
+    auto start = Clock::now();
+    std::vector<std::thread> producers{};
+    for (int i = 0; i < producer_num; ++i) {
+        producers.emplace_back([&]() {
+            for (int j = 0; j < tasks_per_producer; ++j)
+                pool.AddTask([&done]() { Work(); ++done; });
+        });
+    }
+    for (auto& t : producers)
+        t.join();
+    ThreadPoolStats stats = pool.GetStats();
+    long expected = static_cast<long>(producer_num) * tasks_per_producer -
+                    static_cast<long>(stats.rejected);
+    while (done < expected)
+        std::this_thread::sleep_for(1ms);
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "Policy " << PolicyName(policy) << ": " << done / elapsed
+              << " tasks/s" << std::endl;
+    stats = pool.GetStats();
+    PrintStats(stats);
+    if (stats.max_queue_depth > max_queue_size) {
+        std::cout << "  queue depth exceeds the bound" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Low priority tasks flood a single worker, while high priority ones keep
+// arriving. The high ones should wait far less.
+bool Priorities() {
+    ThreadPool pool{};
+    pool.SetThreadNum(1);
+    pool.Start();
+    const int kTaskNum = 2000;
+    std::atomic<long> high_wait_us{0};
+    std::atomic<long> low_wait_us{0};
+    std::atomic<int> done{0};
+    for (int i = 0; i < kTaskNum; ++i) {
+        for (auto prio : {TaskPriority::kLow, TaskPriority::kHigh}) {
+            auto added = Clock::now();
+            auto& wait_us = prio == TaskPriority::kHigh ? high_wait_us
+                                                        : low_wait_us;
+            pool.AddTask([added, &wait_us, &done]() {
+                             wait_us += std::chrono::duration_cast<
+                                 std::chrono::microseconds>(
+                                     Clock::now() - added).count();
+                             Work();
+                             ++done;
+                         }, prio);
+        }
+    }
+    while (done < 2 * kTaskNum)
+        std::this_thread::sleep_for(1ms);
+    std::cout << "Priorities: avg wait of high " << high_wait_us / kTaskNum
+              << " us, low " << low_wait_us / kTaskNum << " us" << std::endl;
+    return high_wait_us < low_wait_us;
+}
+
+bool FuturesAndBulk() {
+    ThreadPool pool{};
+    pool.SetThreadNum(4);
+    pool.Start();
+    auto sum = pool.Submit([]() {
+        long s = 0;
+        for (int i = 1; i <= 100; ++i)
+            s += i;
+        return s;
+    });
+    auto err = pool.Submit([]() -> int { throw std::runtime_error{"oops"}; });
+    if (sum.get() != 5050)
+        return false;
+    try {
+        err.get();
+        return false;
+    } catch (const std::runtime_error&) {
+    }
+    std::atomic<int> done{0};
+    std::vector<ThreadPool::Functor> fs{};
+    for (int i = 0; i < 1000; ++i)
+        fs.emplace_back([&done]() { ++done; });
+    if (pool.AddTasks(std::move(fs)) != 1000)
+        return false;
+    while (done < 1000)
+        std::this_thread::sleep_for(1ms);
+
+    // Rejected by a full queue before Start().
+    ThreadPool stopped_pool{};
+    stopped_pool.SetMaxQueueSize(1);
+    stopped_pool.SetQueueFullPolicy(QueueFullPolicy::kReject);
+    stopped_pool.AddTask([]() {});
+    auto rejected = stopped_pool.Submit([]() { return 1; });
+    try {
+        rejected.get();
+        return false;
+    } catch (const std::future_error&) {
+    }
+    // TryAddTask() rejects instead of waiting, or running in the caller.
+    ThreadPool blocking_pool{};
+    blocking_pool.SetMaxQueueSize(1);
+    blocking_pool.AddTask([]() {});
+    bool ran = false;
+    if (blocking_pool.TryAddTask([&ran]() { ran = true; }) || ran)
+        return false;
+    std::cout << "Futures and bulk submission work" << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: bounded_pool_test <thread_num> [producer_num] "
+                  << "[tasks_per_producer] [max_queue_size]" << std::endl;
+        return 1;
+    }
+    int thread_num = std::max(std::atoi(argv[1]), 1);
+    int producer_num = argc > 2 ? std::atoi(argv[2]) : 4;
+    int tasks_per_producer = argc > 3 ? std::atoi(argv[3]) : 5000;
+    std::size_t max_queue_size = argc > 4 ? std::atoi(argv[4]) : 256;
+    bool ok = true;
+    for (auto policy : {QueueFullPolicy::kBlock, QueueFullPolicy::kReject,
+                        QueueFullPolicy::kRunInCaller})
+        ok = Burst(policy, thread_num, producer_num, tasks_per_producer,
+                   max_queue_size) && ok;
+    ok = Priorities() && ok;
+    ok = FuturesAndBulk() && ok;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
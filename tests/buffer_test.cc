@@ -1,7 +1,14 @@
+#include <iostream>
 #include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstring>
 #include <cassert>
+#include <sys/uio.h>
 
 #include "util/buffer.hh"
+#include "util/chainbuffer.hh"
 
 void buffer_test() {
     axn::Buffer buf(256);
@@ -39,6 +46,140 @@ void buffer_test() {
     assert(buf.WritableSize() == 512);
 }
 
+void chain_buffer_test() {
+    axn::ChainBuffer buf(8);
+    // Initial state.
+    assert(buf.ReadableSize() == 0);
+    assert(buf.WritableSize() == 0);
+    assert(buf.Retrieve(100).size() == 0);
+
+    // Read and write across slabs.
+    buf.Append("test string");
+    assert(buf.ReadableSize() == 11);
+    assert(buf.WritableSize() == 5);
+    assert(buf.SlabNum() == 2);
+    assert(buf.Retrieve(3) == "tes");
+    buf.Append("something");
+    assert(buf.ReadableSize() == 17);
+    struct iovec iov[4];
+    assert(buf.ReadableIov(iov, 4) == 3);
+    assert(iov[0].iov_len == 5 && iov[1].iov_len == 8 && iov[2].iov_len == 4);
+    assert(std::memcmp(iov[0].iov_base, "t str", 5) == 0);
+    assert(buf.ReadableIov(iov, 1) == 1);
+    char peeked[8];
+    assert(buf.Peek(peeked, 8) == 8);
+    assert(std::memcmp(peeked, "t string", 8) == 0);
+    assert(buf.ReadableSize() == 17);
+    // The drained slab is kept as the spare one.
+    buf.Read(5);
+    assert(buf.SlabNum() == 3);
+    assert(buf.RetrieveAll() == "ingsomething");
+    assert(buf.ReadableSize() == 0);
+
+    // Scatter reading. The drained write slab is reused from the start.
+    assert(buf.WritableIov(iov, 4, 20) == 3);
+    assert(iov[0].iov_len == 8 && iov[1].iov_len == 8 && iov[2].iov_len == 4);
+    std::memcpy(iov[0].iov_base, "abcdefgh", 8);
+    std::memcpy(iov[1].iov_base, "ijklmn", 6);
+    buf.Written(14);
+    assert(buf.ReadableSize() == 14);
+    assert(buf.Retrieve(14) == "abcdefghijklmn");
+
+    // Space management.
+    buf.ReserveWritable(30);
+    assert(buf.WritableSize() >= 30);
+    buf.Append("xyz");
+    buf.Shrink();
+    assert(buf.ReadableSize() == 3);
+    assert(buf.SlabNum() == 1);
+    assert(buf.RetrieveAll() == "xyz");
+    buf.Shrink();
+    assert(buf.SlabNum() == 0);
+    assert(buf.WritableSize() == 0);
+    buf.Append("again");
+    assert(buf.RetrieveAll() == "again");
+
+    // Shared bytes chained between copied ones.
+    auto sharedp = std::make_shared<const std::string>("0123456789");
+    buf.Append("abc");
+    buf.AppendShared(sharedp->data(), sharedp->size(), sharedp);
+    assert(sharedp.use_count() == 2);
+    buf.Append("xyz");
+    assert(buf.ReadableSize() == 16);
+    assert(buf.ReadableIov(iov, 4) == 3);
+    assert(iov[1].iov_base == sharedp->data() && iov[1].iov_len == 10);
+    assert(buf.Retrieve(5) == "abc01");
+    assert(buf.RetrieveAll() == "23456789xyz");
+    assert(sharedp.use_count() == 1);
+    // Into an empty buffer, then consumed before anything else.
+    buf.AppendShared(sharedp->data(), 4, sharedp);
+    buf.Append("!");
+    assert(buf.RetrieveAll() == "0123!");
+    buf.Append("end");
+    assert(buf.RetrieveAll() == "end");
+}
+
+// Both buffers used the way TcpConn uses send_buf_: messages are appended
+// while a socket takes a part of the backlog now and then. The consumed bytes
+// are copied out as send() would.
+std::vector<char> sink(1 << 20);
+
+void Consume(axn::Buffer& buf, std::size_t n) {
+    std::memcpy(sink.data(), buf.ReadableBegin(), n);
+    buf.Read(n);
+}
+
+void Consume(axn::ChainBuffer& buf, std::size_t n) {
+    struct iovec iov[64];
+    int iov_num = buf.ReadableIov(iov, 64);
+    std::size_t copied = 0;
+    for (int i = 0; i < iov_num && copied < n; ++i) {
+        std::size_t m = std::min(n - copied, iov[i].iov_len);
+        std::memcpy(sink.data() + copied, iov[i].iov_base, m);
+        copied += m;
+    }
+    buf.Read(copied);
+}
+
+// Keep the backlog around `backlog` bytes, appending messages of msg_size
+// and consuming chunks of chunk_size. Return MB/s through the buffer.
+template <typename Buf>
+double Throughput(Buf& buf, std::size_t msg_size, std::size_t chunk_size,
+                  std::size_t backlog, std::size_t total) {
+    std::string msg(msg_size, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t appended = 0; appended < total; appended += msg_size) {
+        buf.Append(msg);
+        if (buf.ReadableSize() > backlog)
+            Consume(buf, std::min(chunk_size, buf.ReadableSize()));
+    }
+    while (buf.ReadableSize() > 0)
+        Consume(buf, std::min(chunk_size, buf.ReadableSize()));
+    double sec = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start).count();
+    return total / sec / (1 << 20);
+}
+
+void Benchmark(const char* name, std::size_t msg_size, std::size_t chunk_size,
+               std::size_t backlog, std::size_t total) {
+    axn::Buffer buf{};
+    axn::ChainBuffer chain_buf{};
+    double old_mbps = Throughput(buf, msg_size, chunk_size, backlog, total);
+    double new_mbps = Throughput(chain_buf, msg_size, chunk_size, backlog,
+                                 total);
+    std::cout << name << ": Buffer " << old_mbps << " MB/s, ChainBuffer "
+              << new_mbps << " MB/s" << std::endl;
+}
+
 int main() {
     buffer_test();
+    chain_buffer_test();
+    const std::size_t kTotal = 1ul << 28;
+    Benchmark("Small messages (64B, 1KB backlog)", 64, 1024, 1024, kTotal / 4);
+    Benchmark("Small messages (64B, 1MB backlog)", 64, 64 * 1024, 1 << 20,
+              kTotal / 4);
+    Benchmark("Bulk (64KB, 8MB backlog)", 64 * 1024, 256 * 1024, 8 << 20,
+              kTotal);
+    Benchmark("Bulk (1MB, 64MB backlog)", 1 << 20, 1 << 20, 64 << 20,
+              kTotal);
 }
@@ -0,0 +1,153 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <algorithm>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+#include "util/slabpool.hh"
+
+// Short connection churn: every client connects, sends one request, waits for
+// the response and the closing of the server, then starts over. The number
+// of completed connections per second shows how the connection setup and
+// teardown path scales with the server thread number. The heap allocations
+// per connection show what the slab pool saves, which is disabled with "n".
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::string kRequest{"ping"};
+std::atomic<bool> stopped{false};
+std::atomic<long> completed{0};
+std::atomic<long> allocations{0};
+
+// Count every heap allocation of the process. Client threads allocate
+// nothing in their loop, so nearly all of them come from the server.
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+// Server Callbacks.
+void ServerRespond(TcpConnPtr connp, std::string msg) {
+    connp->Send(msg);
+    // Let the server close first so that TIME_WAIT does not pile up on the
+    // client side and exhaust the ephemeral ports.
+    connp->Shutdown();
+}
+
+void StartServer(int thread_num, bool per_loop_acceptor, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    server.SetPerLoopAcceptor(per_loop_acceptor);
+    server.SetRecvCallback(ServerRespond);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+// One request per connection with plain blocking sockets.
+void ClientFunc() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    char buf[64];
+    while (!stopped) {
+        int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (sk < 0) {
+            std::cout << "socket() failed: " << std::strerror(errno)
+                      << std::endl;
+            return;
+        }
+        int on = 1;
+        ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                      sizeof(addr)) < 0) {
+            ::close(sk);
+            std::this_thread::sleep_for(1ms);
+            continue;
+        }
+        ::send(sk, kRequest.data(), kRequest.size(), 0);
+        // Read the response until the server closes the connection.
+        while (::recv(sk, buf, sizeof(buf), 0) > 0) {}
+        ::close(sk);
+        completed.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: churn_test <server_thread_num> <client_num> "
+                  << "[seconds] [r (accept in every loop with SO_REUSEPORT)] "
+                  << "[n (no slab pool)] [h (huge pages for the slab pool)]"
+                  << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::atoi(argv[1]);
+    int client_num = std::atoi(argv[2]);
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 10;
+    bool per_loop_acceptor = false;
+    for (int i = 4; i < argc; ++i) {
+        if (argv[i][0] == 'r')
+            per_loop_acceptor = true;
+        else if (argv[i][0] == 'n')
+            SlabPool::SetEnabled(false);
+        else if (argv[i][0] == 'h')
+            SlabPool::SetHugePages(true);
+    }
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num,
+                              per_loop_acceptor, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int i = 0; i < client_num; ++i)
+        clients.emplace_back(ClientFunc);
+    long last_completed = 0;
+    long last_allocations = allocations.load(std::memory_order_relaxed);
+    for (int i = 0; i < seconds; ++i) {
+        std::this_thread::sleep_for(1s);
+        long now_completed = completed.load(std::memory_order_relaxed);
+        long now_allocations = allocations.load(std::memory_order_relaxed);
+        long conns = std::max(now_completed - last_completed, 1L);
+        std::cout << now_completed - last_completed << " conn/s, "
+                  << static_cast<double>(now_allocations - last_allocations) /
+                     conns << " allocations per connection" << std::endl;
+        last_completed = now_completed;
+        last_allocations = now_allocations;
+    }
+    stopped = true;
+    for (auto& client : clients)
+        client.join();
+    loopp->Quit();
+    server_thread.join();
+    std::cout << "Average: " << completed / seconds << " conn/s, "
+              << SlabPool::ChunkNum() << " slab pool chunks" << std::endl;
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+
+// Every response is made of kPieceNum small Send() calls, like a handler
+// writing a status line, headers and a body separately. Without corking each
+// of them is a send() system call and a tiny segment. With "a" (auto cork)
+// or "k" (Cork() and Uncork() around the handler) they are written together.
+// The clients keep one request in flight per connection. Nagle's algorithm
+// is disabled on both ends, as latency-sensitive servers do, so the pieces
+// are not merged by the kernel either.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::string kRequest{"GET\n"};
+const int kPieceNum = 10;
+const std::string kPiece{"X-Header-Field: value\r\n"};
+std::atomic<bool> stopped{false};
+std::atomic<long> requests{0};
+std::atomic<long> write_calls{0};
+
+// Count the writing system calls of the server. Clients use write() so
+// they are not counted, and neither are the writes batched by io_uring with
+// "a", which cost no call of their own.
+extern "C" ssize_t send(int sk, const void* buf, std::size_t size,
+                        int flags) {
+    write_calls.fetch_add(1, std::memory_order_relaxed);
+    return ::syscall(SYS_sendto, sk, buf, size, flags, nullptr, 0);
+}
+
+extern "C" ssize_t sendmsg(int sk, const struct msghdr* msg, int flags) {
+    write_calls.fetch_add(1, std::memory_order_relaxed);
+    return ::syscall(SYS_sendmsg, sk, msg, flags);
+}
+
+// Server Callbacks.
+void ServerOnConnected(TcpConnPtr connp) {
+    int on = 1;
+    ::setsockopt(connp->SocketFd(), IPPROTO_TCP, TCP_NODELAY, &on,
+                 sizeof(on));
+}
+
+void ServerRespond(bool explicit_cork, TcpConnPtr connp) {
+    if (explicit_cork)
+        connp->Cork();
+    for (int i = 0; i < kPieceNum; ++i)
+        connp->Send(kPiece);
+    if (explicit_cork)
+        connp->Uncork();
+}
+
+void StartServer(int thread_num, bool auto_cork, bool explicit_cork,
+                 bool edge_triggered, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    server.SetEdgeTriggered(edge_triggered);
+    server.SetAutoCork(auto_cork);
+    server.SetConnectedCallback(ServerOnConnected);
+    server.SetRecvCallback([explicit_cork](TcpConnPtr connp, std::string) {
+                               ServerRespond(explicit_cork, connp); });
+    server.Start();
+    server_main_loop.Loop();
+}
+
+void ClientFunc() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    const std::size_t response_size = kPieceNum * kPiece.size();
+    std::vector<char> buf(response_size);
+    while (!stopped) {
+        if (::write(sk, kRequest.data(), kRequest.size()) < 0)
+            break;
+        std::size_t received = 0;
+        while (received < response_size) {
+            ssize_t n = ::read(sk, buf.data() + received,
+                               response_size - received);
+            if (n <= 0) {
+                ::close(sk);
+                return;
+            }
+            received += n;
+        }
+        requests.fetch_add(1, std::memory_order_relaxed);
+    }
+    ::close(sk);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: cork_test <server_thread_num> <client_num> "
+                  << "[seconds] [a (auto cork)] [k (Cork() and Uncork())] "
+                  << "[et]" << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::atoi(argv[1]);
+    int client_num = std::atoi(argv[2]);
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 10;
+    bool auto_cork = false;
+    bool explicit_cork = false;
+    bool edge_triggered = false;
+    for (int i = 4; i < argc; ++i) {
+        if (std::strcmp(argv[i], "a") == 0)
+            auto_cork = true;
+        else if (std::strcmp(argv[i], "k") == 0)
+            explicit_cork = true;
+        else if (std::strcmp(argv[i], "et") == 0)
+            edge_triggered = true;
+    }
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num, auto_cork,
+                              explicit_cork, edge_triggered, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int i = 0; i < client_num; ++i)
+        clients.emplace_back(ClientFunc);
+    long last_requests = 0;
+    long last_write_calls = write_calls.load(std::memory_order_relaxed);
+    for (int i = 0; i < seconds; ++i) {
+        std::this_thread::sleep_for(1s);
+        long now_requests = requests.load(std::memory_order_relaxed);
+        long now_write_calls = write_calls.load(std::memory_order_relaxed);
+        long reqs = std::max(now_requests - last_requests, 1L);
+        std::cout << now_requests - last_requests << " req/s, "
+                  << static_cast<double>(now_write_calls - last_write_calls) /
+                     reqs << " write calls per request" << std::endl;
+        last_requests = now_requests;
+        last_write_calls = now_write_calls;
+    }
+    stopped = true;
+    for (auto& client : clients)
+        client.join();
+    loopp->Quit();
+    server_thread.join();
+    std::cout << "Average: " << requests / seconds << " req/s" << std::endl;
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <cstdlib>
+#include <chrono>
 #include <sys/eventfd.h>
 
 #include "eventloop.hh"
@@ -55,7 +56,26 @@ void LoopTest() {
     ctl_fd.RemoveFromLoop();
 }
 
+// A task queued by an after-events task has to wake up the loop instead of
+// waiting for the poll timeout.
+int AfterEventsTest() {
+    using namespace std::chrono_literals;
+    EventLoop l;
+    l.RunAfter(10ms, [&l]() {
+        l.RunAfterEvents([&l]() {
+            l.QueueInLoop([&l]() { Output("QueueInLoop4"); l.Quit(); }); });
+    });
+    auto begin = std::chrono::steady_clock::now();
+    l.Loop();
+    if (std::chrono::steady_clock::now() - begin > 1s) {
+        Output("AfterEventsTest failed");
+        return 1;
+    }
+    return 0;
+}
+
 int main() {
     // AssertionTest();
     LoopTest();
+    return AfterEventsTest();
 }
@@ -1,23 +1,87 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
+#include <algorithm>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
 
 #include "eventloop.hh"
 #include "tcpserver.hh"
 #include "tcpconn.hh"
+#include "util/threadpool.hh"
 
 using namespace axn;
 using std::placeholders::_1;
 using std::placeholders::_2;
+using namespace std::chrono_literals;
 
-void FakeHttpRecvCallback(bool keep_alive, TcpConnPtr connp, std::string msg) {
-    // Pretend to handle http requests.
+// With "c", every request takes about 100 times the cpu time of the default
+// one, which stalls the other connections of the loop unless it is offloaded
+// to a thread pool with "o". The worst delay of a 10ms timer in the io loops
+// shows how responsive they are.
+
+const auto kProbeInterval = 10ms;
+std::atomic<long> conn_count{0};
+std::atomic<long> req_count{0};
+std::mutex probes_mutex{};
+std::vector<std::shared_ptr<std::atomic<long>>> probes{};
+
+void CountConnected(TcpConnPtr) {
+    conn_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Track the worst lateness of a periodic timer in the loop.
+void StartProbe(EventLoop& loop) {
+    auto max_delay_usp = std::make_shared<std::atomic<long>>(0);
+    {
+        std::lock_guard<std::mutex> lock{probes_mutex};
+        probes.push_back(max_delay_usp);
+    }
+    auto lastp = std::make_shared<EventLoop::Clock::time_point>(
+                     EventLoop::Clock::now());
+    loop.RunEvery(kProbeInterval, [max_delay_usp, lastp]() {
+        auto now = EventLoop::Clock::now();
+        long delay_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                            now - *lastp - kProbeInterval).count();
+        *lastp = now;
+        if (delay_us > max_delay_usp->load(std::memory_order_relaxed))
+            max_delay_usp->store(delay_us, std::memory_order_relaxed);
+    });
+}
+
+// Report accepted connections and handled requests per second, and the
+// worst timer delay of the io loops.
+void ReportRates() {
+    static long last_conn_count = 0;
+    static long last_req_count = 0;
+    long conns = conn_count.load(std::memory_order_relaxed);
+    long reqs = req_count.load(std::memory_order_relaxed);
+    long max_delay_us = 0;
+    {
+        std::lock_guard<std::mutex> lock{probes_mutex};
+        for (auto& probep : probes)
+            max_delay_us = std::max(max_delay_us, probep->exchange(0));
+    }
+    std::cout << conns - last_conn_count << " conn/s, "
+              << reqs - last_req_count << " req/s, max loop delay "
+              << max_delay_us << " us" << std::endl;
+    last_conn_count = conns;
+    last_req_count = reqs;
+}
+
+// Pretend to handle http requests.
+void FakeHandle(int rounds) {
     // Use volatile to prevent compiler optimization.
     volatile int counter;
-    for (int i = 0; i < 50000; ++i) {
+    for (int i = 0; i < rounds; ++i) {
         ++counter;
     }
+}
+
+void FakeRespond(bool keep_alive, TcpConnPtr connp) {
     std::string fake_http_response{"HTTP/1.1 200 OK\r\n"
                                    "Content-Length: 14\r\n"
                                    "Connection: Keep-Alive\r\n"
@@ -27,26 +91,66 @@ void FakeHttpRecvCallback(bool keep_alive, TcpConnPtr connp, std::string msg) {
     connp->Send(fake_http_response);
     if (!keep_alive)
         connp->Shutdown();
+    req_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FakeHttpRecvCallback(bool keep_alive, int rounds, ThreadPool* poolp,
+                          TcpConnPtr connp, std::string) {
+    if (poolp == nullptr) {
+        FakeHandle(rounds);
+        FakeRespond(keep_alive, connp);
+    } else {
+        connp->Offload(*poolp, [rounds]() { FakeHandle(rounds); },
+                       std::bind(FakeRespond, keep_alive, _1));
+    }
 }
 
-void fake_http_test(int thread_num, bool keep_alive) {
+void fake_http_test(int thread_num, bool keep_alive, bool per_loop_acceptor,
+                    bool compute_heavy, bool offload) {
     EventLoop loop{};
     TcpServer fake_http_server{loop, InetAddr{"127.0.0.1", 9939}};
+    ThreadPool pool{};
+    if (offload) {
+        pool.SetThreadNum(std::max(thread_num, 1));
+        pool.Start();
+    }
+    int rounds = compute_heavy ? 5000000 : 50000;
     fake_http_server.SetThreadNum(thread_num);
+    fake_http_server.SetPerLoopAcceptor(per_loop_acceptor);
+    fake_http_server.SetThreadInitCallback(StartProbe);
+    fake_http_server.SetConnectedCallback(CountConnected);
     fake_http_server.SetRecvCallback(
-                         std::bind(FakeHttpRecvCallback, keep_alive, _1, _2));
+                         std::bind(FakeHttpRecvCallback, keep_alive, rounds,
+                                   offload ? &pool : nullptr, _1, _2));
     fake_http_server.Start();
+    loop.RunEvery(1s, ReportRates);
     loop.Loop();
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
+    if (argc < 3) {
         std::cout << "Usage: fake_http_test <thread_num> "
-                  << "<l/s (long/short connection)>" << std::endl;
+                  << "<l/s (long/short connection)> "
+                  << "[r (accept in every loop with SO_REUSEPORT)] "
+                  << "[c (compute-heavy requests)] "
+                  << "[o (offload requests to a thread pool)]"
+                  << std::endl;
         return -1;
     }
     int thread_num = std::atoi(argv[1]);
     bool keep_alive = (argv[2][0] == 'l');
-    fake_http_test(thread_num, keep_alive);
+    bool per_loop_acceptor = false;
+    bool compute_heavy = false;
+    bool offload = false;
+    for (int i = 3; i < argc; ++i) {
+        if (argv[i][0] == 'r')
+            per_loop_acceptor = true;
+        else if (argv[i][0] == 'c')
+            compute_heavy = true;
+        else if (argv[i][0] == 'o')
+            offload = true;
+    }
+    fake_http_test(thread_num, keep_alive, per_loop_acceptor,
+                   compute_heavy, offload);
     return 0;
 }
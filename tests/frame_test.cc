@@ -0,0 +1,169 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+#include "util/chainbuffer.hh"
+
+// Length-prefixed frames parsed with RecvBufferCallback. The client writes
+// the frames in pieces cut at random points, so the server sees partial
+// headers and bodies, which have to stay in the buffer until the rest comes.
+// Every complete frame is echoed back with SendV() of the header and the body
+// and compared by the client. At last the client asks for a farewell, which
+// another thread sends with SendV() of more fragments than a writev() takes
+// followed by Shutdown(), and the client checks all of it comes before the
+// end of the stream.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::size_t kHeaderSize = 4;
+// The header asking for the farewell instead of a frame.
+const std::uint32_t kFarewellLen = 0xffffffff;
+const std::size_t kFarewellFragNum = 100;
+const std::size_t kFarewellFragSize = 1000;
+std::atomic<long> server_frames{0};
+
+std::string FarewellFrag(std::size_t i) {
+    return std::string(kFarewellFragSize, static_cast<char>('A' + i % 26));
+}
+
+std::string MakeFrame(const std::string& body) {
+    std::uint32_t len = htonl(static_cast<std::uint32_t>(body.size()));
+    std::string frame(reinterpret_cast<const char*>(&len), kHeaderSize);
+    return frame + body;
+}
+
+// Server Callbacks.
+void ServerOnFrames(TcpConnPtr connp, ChainBuffer& buf) {
+    while (buf.ReadableSize() >= kHeaderSize) {
+        std::uint32_t len = 0;
+        buf.Peek(reinterpret_cast<char*>(&len), kHeaderSize);
+        len = ntohl(len);
+        if (len == kFarewellLen) {
+            buf.Read(kHeaderSize);
+            std::thread farewell{[connp]() {
+                std::vector<SharedBuffer> frags{};
+                for (std::size_t i = 0; i < kFarewellFragNum; ++i)
+                    frags.push_back(std::make_shared<const std::string>(
+                                        FarewellFrag(i)));
+                connp->SendV(std::move(frags));
+                connp->Shutdown();
+            }};
+            farewell.join();
+            continue;
+        }
+        if (buf.ReadableSize() < kHeaderSize + len)
+            break;
+        auto headerp = std::make_shared<const std::string>(
+                           buf.Retrieve(kHeaderSize));
+        auto bodyp = std::make_shared<const std::string>(buf.Retrieve(len));
+        connp->SendV({headerp, bodyp});
+        server_frames.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void StartServer(bool edge_triggered, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(1);
+    server.SetEdgeTriggered(edge_triggered);
+    server.SetRecvBufferCallback(ServerOnFrames);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+bool RecvAll(int sk, char* p, std::size_t n) {
+    while (n > 0) {
+        ssize_t m = ::recv(sk, p, n, 0);
+        if (m <= 0)
+            return false;
+        p += m;
+        n -= m;
+    }
+    return true;
+}
+
+bool ClientFunc(int frame_num) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    std::mt19937 rng{42};
+    // Sizes from empty up to several slabs.
+    std::uniform_int_distribution<std::size_t> size_dist{0, 100000};
+    bool ok = true;
+    for (int i = 0; i < frame_num && ok; ++i) {
+        std::string body(size_dist(rng), static_cast<char>('a' + i % 26));
+        std::string frame = MakeFrame(body);
+        // Write in up to 4 pieces with pauses in between, so that the server
+        // reads them separately.
+        std::size_t sent = 0;
+        for (int piece = 0; piece < 4 && sent < frame.size(); ++piece) {
+            std::uniform_int_distribution<std::size_t> cut_dist{
+                1, frame.size() - sent};
+            std::size_t n = piece == 3 ? frame.size() - sent : cut_dist(rng);
+            ::send(sk, frame.data() + sent, n, 0);
+            sent += n;
+            std::this_thread::sleep_for(1ms);
+        }
+        std::string echo(frame.size(), '\0');
+        ok = RecvAll(sk, &echo[0], echo.size()) && echo == frame;
+    }
+    std::uint32_t farewell_len = htonl(kFarewellLen);
+    ::send(sk, &farewell_len, kHeaderSize, 0);
+    std::string farewell{};
+    std::vector<char> buf(65536);
+    ssize_t n = 0;
+    while ((n = ::recv(sk, buf.data(), buf.size(), 0)) > 0)
+        farewell.append(buf.data(), n);
+    std::string expected{};
+    for (std::size_t i = 0; i < kFarewellFragNum; ++i)
+        expected += FarewellFrag(i);
+    if (farewell != expected) {
+        std::cout << "Farewell of " << farewell.size() << " bytes, "
+                  << expected.size() << " expected" << std::endl;
+        ok = false;
+    }
+    ::close(sk);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int frame_num = argc > 1 ? std::atoi(argv[1]) : 200;
+    bool edge_triggered = (argc > 2 && std::strcmp(argv[2], "et") == 0);
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, edge_triggered, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    bool ok = ClientFunc(frame_num);
+    loopp->Quit();
+    server_thread.join();
+    ok = ok && server_frames == frame_num;
+    std::cout << server_frames << " frames echoed" << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+
+// Open N connections to an echo server, then leave them idle, before and
+// after one message on each, and report the growth of the RSS of the process
+// per connection. Client sockets keep no user space buffer, so the growth is
+// the server side cost, mostly TcpConn and its buffers.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::size_t kMsgSize = 4096;
+std::atomic<int> connected{0};
+
+long RssBytes() {
+    std::ifstream statm{"/proc/self/statm"};
+    long size = 0;
+    long resident = 0;
+    statm >> size >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+// Server Callbacks.
+void ServerOnConnected(TcpConnPtr) {
+    connected.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ServerEcho(TcpConnPtr connp, std::string msg) {
+    connp->Send(msg);
+}
+
+void StartServer(int thread_num, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    server.SetConnectedCallback(ServerOnConnected);
+    server.SetRecvCallback(ServerEcho);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+int Connect() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+void Report(const char* stage, long rss, long base_rss, int conn_num) {
+    std::cout << stage << ": RSS " << rss / 1024 << " KB, "
+              << (rss - base_rss) / conn_num << " bytes per connection"
+              << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: idle_conn_test <conn_num> [server_thread_num]"
+                  << std::endl;
+        return 1;
+    }
+    int conn_num = std::max(std::atoi(argv[1]), 1);
+    int thread_num = argc > 2 ? std::atoi(argv[2]) : 4;
+    // Both ends of every connection are in this process.
+    struct rlimit lim{};
+    ::getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &lim);
+    if (static_cast<long>(lim.rlim_cur) < 2L * conn_num + 64) {
+        std::cout << "Too many connections for the fd limit "
+                  << lim.rlim_cur << std::endl;
+        return 1;
+    }
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, thread_num, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    long base_rss = RssBytes();
+    std::cout << "Before connecting: RSS " << base_rss / 1024 << " KB"
+              << std::endl;
+    std::vector<int> sks{};
+    for (int i = 0; i < conn_num; ++i)
+        sks.push_back(Connect());
+    while (connected < conn_num)
+        std::this_thread::sleep_for(10ms);
+    std::this_thread::sleep_for(500ms);
+    Report("Idle after connecting", RssBytes(), base_rss, conn_num);
+
+    std::string msg(kMsgSize, 'x');
+    std::string echo(kMsgSize, '\0');
+    for (int sk : sks) {
+        ::send(sk, msg.data(), msg.size(), 0);
+        std::size_t received = 0;
+        while (received < echo.size()) {
+            ssize_t n = ::recv(sk, &echo[received], echo.size() - received, 0);
+            if (n <= 0) {
+                std::cout << "Lost a connection" << std::endl;
+                return 1;
+            }
+            received += n;
+        }
+    }
+    std::this_thread::sleep_for(500ms);
+    Report("Idle after one message each", RssBytes(), base_rss, conn_num);
+
+    for (int sk : sks)
+        ::close(sk);
+    loopp->Quit();
+    server_thread.join();
+    return 0;
+}
@@ -0,0 +1,247 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "eventloop_pool.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+#include "util/threadpool.hh"
+
+// Pingpong traffic with random sized blocks while the server connections keep
+// migrating between loops, both from another thread and from inside their
+// receiving callbacks. Every echoed block must match the sent one exactly.
+// With "f", the server echoes from a worker thread so that the cross-thread
+// Send() calls race with the migrations as well. With "o", the blocks are
+// offloaded to several workers which finish them out of order, and the
+// continuations must still echo them in order.
+
+using namespace axn;
+using namespace std::chrono_literals;
+using std::placeholders::_1;
+using std::placeholders::_2;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::size_t kMaxBlockSize = 64 * 1024;
+std::atomic<bool> stopped{false};
+std::atomic<bool> failed{false};
+std::atomic<long> verified_bytes{0};
+std::atomic<long> migrations{0};
+std::mutex loops_mutex{};
+std::vector<EventLoop*> loops{};
+std::mutex conns_mutex{};
+std::vector<std::weak_ptr<TcpConn>> conns{};
+
+EventLoop& RandomLoop() {
+    thread_local std::mt19937 rng{std::random_device{}()};
+    std::lock_guard<std::mutex> lock{loops_mutex};
+    return *loops[rng() % loops.size()];
+}
+
+// Server Callbacks.
+void ServerOnConnected(TcpConnPtr connp) {
+    std::lock_guard<std::mutex> lock{conns_mutex};
+    conns.push_back(connp);
+}
+
+void ServerEcho(ThreadPool* worker_poolp, bool offload, TcpConnPtr connp,
+                std::string msg) {
+    thread_local std::mt19937 rng{std::random_device{}()};
+    // Migrate from inside the callback once in a while.
+    if (rng() % 64 == 0) {
+        connp->MigrateTo(RandomLoop());
+        migrations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (offload) {
+        auto delay = std::chrono::microseconds{rng() % 200};
+        connp->Offload(*worker_poolp,
+                       [delay, msg]() {
+                           std::this_thread::sleep_for(delay);
+                           return msg; },
+                       [](TcpConnPtr connp, std::string echo) {
+                           connp->Send(echo); });
+    } else if (worker_poolp != nullptr) {
+        worker_poolp->AddTask([connp, msg]() { connp->Send(msg); });
+    } else {
+        connp->Send(msg);
+    }
+}
+
+void StartServer(int thread_num, bool edge_triggered, bool foreign_send,
+                 bool offload, bool rebalance, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    // One worker keeps the order of the echoed blocks of each connection,
+    // unless they are offloaded. Destructed before the server, since its
+    // tasks hold the connections.
+    ThreadPool worker_pool{};
+    worker_pool.SetThreadNum(offload ? 4 : 1);
+    if (foreign_send || offload)
+        worker_pool.Start();
+    server.SetThreadNum(thread_num);
+    server.SetEdgeTriggered(edge_triggered);
+    if (rebalance)
+        server.SetRebalanceInterval(100ms);
+    server.SetThreadInitCallback([](EventLoop& loop) {
+                                     std::lock_guard<std::mutex> lock{
+                                         loops_mutex};
+                                     loops.push_back(&loop); });
+    server.SetConnectedCallback(ServerOnConnected);
+    server.SetRecvCallback(std::bind(ServerEcho,
+                                     foreign_send || offload ? &worker_pool
+                                                             : nullptr,
+                                     offload, _1, _2));
+    server.Start();
+    server_main_loop.Loop();
+}
+
+// Keep migrating random connections from another thread.
+void MigratorFunc() {
+    std::mt19937 rng{std::random_device{}()};
+    while (!stopped) {
+        TcpConnPtr connp{};
+        {
+            std::lock_guard<std::mutex> lock{conns_mutex};
+            if (!conns.empty())
+                connp = conns[rng() % conns.size()].lock();
+        }
+        if (connp) {
+            connp->MigrateTo(RandomLoop());
+            migrations.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::this_thread::sleep_for(100us);
+    }
+}
+
+int Connect() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+bool SendAll(int sk, const std::string& block) {
+    std::size_t sent = 0;
+    while (sent < block.size()) {
+        ssize_t n = ::send(sk, block.data() + sent, block.size() - sent, 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+bool RecvAll(int sk, std::string& block) {
+    std::size_t received = 0;
+    while (received < block.size()) {
+        ssize_t n = ::recv(sk, &block[received], block.size() - received, 0);
+        if (n <= 0)
+            return false;
+        received += n;
+    }
+    return true;
+}
+
+// Send a random block and check the echo, one block at a time.
+void ClientFunc(int id) {
+    int sk = Connect();
+    std::mt19937 rng{static_cast<std::mt19937::result_type>(id)};
+    std::string block{};
+    std::string echo{};
+    while (!stopped && !failed) {
+        block.resize(rng() % kMaxBlockSize + 1);
+        for (char& c : block)
+            c = static_cast<char>(rng());
+        echo.assign(block.size(), '\0');
+        if (!SendAll(sk, block) || !RecvAll(sk, echo)) {
+            std::cout << "Client " << id << " lost the connection"
+                      << std::endl;
+            failed = true;
+            break;
+        }
+        if (echo != block) {
+            std::cout << "Client " << id << " got a corrupted echo"
+                      << std::endl;
+            failed = true;
+            break;
+        }
+        verified_bytes.fetch_add(block.size(), std::memory_order_relaxed);
+    }
+    ::close(sk);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: migration_test <server_thread_num> <client_num> "
+                  << "[seconds] [et] [f (send from a worker thread)] "
+                  << "[o (offload to worker threads)] "
+                  << "[b (rebalance by busy time)]" << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::max(std::atoi(argv[1]), 2);
+    int client_num = std::atoi(argv[2]);
+    int seconds = argc > 3 ? std::atoi(argv[3]) : 10;
+    bool edge_triggered = false;
+    bool foreign_send = false;
+    bool offload = false;
+    bool rebalance = false;
+    for (int i = 4; i < argc; ++i) {
+        if (std::strcmp(argv[i], "et") == 0)
+            edge_triggered = true;
+        else if (std::strcmp(argv[i], "f") == 0)
+            foreign_send = true;
+        else if (std::strcmp(argv[i], "o") == 0)
+            offload = true;
+        else if (std::strcmp(argv[i], "b") == 0)
+            rebalance = true;
+    }
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num, edge_triggered,
+                              foreign_send, offload, rebalance, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int i = 0; i < client_num; ++i)
+        clients.emplace_back(ClientFunc, i);
+    std::thread migrator{MigratorFunc};
+    for (int i = 0; i < seconds && !failed; ++i)
+        std::this_thread::sleep_for(1s);
+    stopped = true;
+    migrator.join();
+    for (auto& client : clients)
+        client.join();
+    loopp->Quit();
+    server_thread.join();
+    std::cout << "Verified: " << verified_bytes << " bytes" << std::endl;
+    std::cout << "Migrations: " << migrations << std::endl;
+    if (failed) {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED" << std::endl;
+    return 0;
+}
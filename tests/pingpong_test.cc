@@ -5,13 +5,17 @@
 #include <thread>
 #include <mutex>
 #include <fstream>
+#include <cstring>
+#include <sys/resource.h>
 #include <boost/ptr_container/ptr_vector.hpp>
 
 #include "eventloop.hh"
 #include "eventloop_pool.hh"
+#include "poller.hh"
 #include "tcpserver.hh"
 #include "tcpclient.hh"
 #include "tcpconn.hh"
+#include "util/chainbuffer.hh"
 
 using namespace axn;
 using namespace std::chrono_literals;
@@ -22,6 +26,15 @@ InetAddr server_addr{"127.0.0.1", 9939};
 std::mutex total_sent_size_mutex{};
 std::size_t total_sent_size = 0;
 int completed_clients = 0;
+bool edge_triggered = false;
+// Echo the receiving buffers with RecvBufferCallback instead of copying them
+// into strings.
+bool zero_copy = false;
+// Echo the received strings with Send(std::string&&).
+bool move_send = false;
+// Write the echoes at the end of the loop iterations, all of them with one
+// system call with io_uring.
+bool auto_cork = false;
 
 
 // Client Callbacks.
@@ -30,12 +43,21 @@ void ClientOnConnected(const std::string& init_msg, TcpConnPtr connp) {
 }
 
 void ClientEcho(std::size_t* sent_sizep, TcpConnPtr connp, std::string msg) {
-    connp->Send(msg);
     *sent_sizep += msg.size();
+    if (move_send)
+        connp->Send(std::move(msg));
+    else
+        connp->Send(msg);
+}
+
+void ClientEchoBuffer(std::size_t* sent_sizep, TcpConnPtr connp,
+                      ChainBuffer& buf) {
+    *sent_sizep += buf.ReadableSize();
+    connp->Send(buf);
 }
 
 void ClientOnDisconnected(int conn_num, std::size_t* sent_sizep,
-                          TcpConnPtr connp) {
+                          TcpConnPtr) {
     std::lock_guard<std::mutex> lock{total_sent_size_mutex};
     ++completed_clients;
     total_sent_size += *sent_sizep;
@@ -49,7 +71,14 @@ void ClientOnDisconnected(int conn_num, std::size_t* sent_sizep,
 
 // Server Callbacks.
 void ServerEcho(TcpConnPtr connp, std::string msg) {
-    connp->Send(msg);
+    if (move_send)
+        connp->Send(std::move(msg));
+    else
+        connp->Send(msg);
+}
+
+void ServerEchoBuffer(TcpConnPtr connp, ChainBuffer& buf) {
+    connp->Send(buf);
 }
 
 void StartServer(int thread_num, EventLoop** loop_addrp) {
@@ -58,6 +87,10 @@ void StartServer(int thread_num, EventLoop** loop_addrp) {
     TcpServer server{server_main_loop, server_addr};
     server.SetThreadNum(thread_num);
     server.SetRecvCallback(ServerEcho);
+    if (zero_copy)
+        server.SetRecvBufferCallback(ServerEchoBuffer);
+    server.SetEdgeTriggered(edge_triggered);
+    server.SetAutoCork(auto_cork);
     server.Start();
     server_main_loop.Loop();
 }
@@ -107,6 +140,12 @@ void ClientCtl(int thread_num, int conn_num, std::size_t block_size) {
                              &clients_statistics[i], _1));
         clients[i].SetRecvCallback(
                    std::bind(ClientEcho, &clients_statistics[i], _1, _2));
+        if (zero_copy)
+            clients[i].SetRecvBufferCallback(
+                       std::bind(ClientEchoBuffer, &clients_statistics[i],
+                                 _1, _2));
+        clients[i].SetEdgeTriggered(edge_triggered);
+        clients[i].SetAutoCork(auto_cork);
         clients[i].Connect();
     }
     std::this_thread::sleep_for(60s);
@@ -120,13 +159,44 @@ void ClientCtl(int thread_num, int conn_num, std::size_t block_size) {
     // loop_pool.Stop();
 }
 
+// CPU time consumed by the whole process, in seconds.
+double CpuSeconds() {
+    struct rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
+    if (argc < 5) {
         std::cout << "Usage: pingpong_test <server_thread_num> "
                   << "<client_thread_num> <connection_num> "
-                  << "<block_size>" << std::endl;
+                  << "<block_size> [epoll/uring] [et] "
+                  << "[zc (zero-copy receiving)] [mv (moving sent strings)] "
+                  << "[ac (auto cork)]" << std::endl;
         return 1;
     }
+    for (int i = 5; i < argc; ++i) {
+        if (std::strcmp(argv[i], "uring") == 0) {
+            SetDefaultPollerBackend(PollerBackend::kUring);
+            std::cout << "Poller: io_uring" << std::endl;
+        } else if (std::strcmp(argv[i], "epoll") == 0) {
+            SetDefaultPollerBackend(PollerBackend::kEpoll);
+            std::cout << "Poller: epoll" << std::endl;
+        } else if (std::strcmp(argv[i], "et") == 0) {
+            edge_triggered = true;
+            std::cout << "Edge-triggered" << std::endl;
+        } else if (std::strcmp(argv[i], "zc") == 0) {
+            zero_copy = true;
+            std::cout << "Zero-copy receiving" << std::endl;
+        } else if (std::strcmp(argv[i], "mv") == 0) {
+            move_send = true;
+            std::cout << "Moving sent strings" << std::endl;
+        } else if (std::strcmp(argv[i], "ac") == 0) {
+            auto_cork = true;
+            std::cout << "Auto cork" << std::endl;
+        }
+    }
     int server_thread_num = std::atoi(argv[1]);
     int client_thread_num = std::atoi(argv[2]);
     int conn_num = std::atoi(argv[3]);
@@ -137,5 +207,14 @@ int main(int argc, char* argv[]) {
     std::thread client_ctl_thread{ClientCtl, client_thread_num, conn_num, block_size};
     server_ctl_thread.join();
     client_ctl_thread.join();
+    // Clients run for 60 seconds.
+    std::cout << "Poller ctl calls: " << PollerCtlCount() / 60.0 << " /s"
+              << std::endl;
+    double cpu_seconds = CpuSeconds();
+    std::cout << "CPU time: " << cpu_seconds << " s" << std::endl;
+    if (total_sent_size > 0)
+        std::cout << "CPU per MiB: "
+                  << cpu_seconds * 1e6 / (total_sent_size / (1024.0 * 1024))
+                  << " us" << std::endl;
     return 0;
 }
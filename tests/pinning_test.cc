@@ -0,0 +1,159 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <sched.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+#include "util/affinity.hh"
+
+// Request-response echo over persistent connections, with the server loops
+// pinned to cpus 0..n-1 and the clients to the rest of the cpus, or with no
+// pinning at all. Reports throughput and round-trip latency percentiles.
+
+using namespace axn;
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+std::atomic<bool> measuring{false};
+std::atomic<bool> stopped{false};
+std::mutex latencies_mutex{};
+std::vector<double> latencies{};
+
+// Server Callbacks.
+void ServerEcho(TcpConnPtr connp, std::string msg) {
+    connp->Send(msg);
+}
+
+void StartServer(int thread_num, bool pin, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    if (pin) {
+        std::vector<int> cpus{};
+        for (int i = 0; i < thread_num; ++i)
+            cpus.push_back(i);
+        server.SetCpuList(cpus);
+    }
+    server.SetThreadInitCallback([](EventLoop&) {
+                                     std::cout << "Loop thread runs on cpu "
+                                               << ::sched_getcpu()
+                                               << std::endl; });
+    server.SetRecvCallback(ServerEcho);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+int Connect() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+// One request at a time with plain blocking sockets.
+void ClientFunc(int cpu, std::size_t block_size) {
+    if (cpu >= 0)
+        PinThisThread(cpu);
+    int sk = Connect();
+    std::string block(block_size, 'x');
+    std::vector<double> local_latencies{};
+    while (!stopped) {
+        auto begin = Clock::now();
+        ::send(sk, block.data(), block.size(), 0);
+        std::size_t received = 0;
+        while (received < block_size) {
+            ssize_t n = ::recv(sk, &block[0], block_size - received, 0);
+            if (n <= 0) {
+                stopped = true;
+                break;
+            }
+            received += n;
+        }
+        if (measuring)
+            local_latencies.push_back(
+                std::chrono::duration<double, std::micro>(
+                    Clock::now() - begin).count());
+    }
+    ::close(sk);
+    std::lock_guard<std::mutex> lock{latencies_mutex};
+    latencies.insert(latencies.end(), local_latencies.begin(),
+                     local_latencies.end());
+}
+
+double Percentile(double p) {
+    std::size_t index = static_cast<std::size_t>(p * (latencies.size() - 1));
+    return latencies[index];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cout << "Usage: pinning_test <server_thread_num> <client_num> "
+                  << "<pin/nopin> [block_size] [seconds]" << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::atoi(argv[1]);
+    int client_num = std::atoi(argv[2]);
+    bool pin = (std::strcmp(argv[3], "pin") == 0);
+    std::size_t block_size = argc > 4 ? std::atoll(argv[4]) : 64;
+    int seconds = argc > 5 ? std::atoi(argv[5]) : 10;
+    int cpu_num = static_cast<int>(std::thread::hardware_concurrency());
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num, pin, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int i = 0; i < client_num; ++i) {
+        // Clients share the cpus not used by the server loops.
+        int cpu = -1;
+        if (pin && cpu_num > server_thread_num)
+            cpu = server_thread_num + i % (cpu_num - server_thread_num);
+        clients.emplace_back(ClientFunc, cpu, block_size);
+    }
+    // Warm up.
+    std::this_thread::sleep_for(1s);
+    measuring = true;
+    std::this_thread::sleep_for(std::chrono::seconds{seconds});
+    stopped = true;
+    for (auto& client : clients)
+        client.join();
+    loopp->Quit();
+    server_thread.join();
+    if (latencies.empty()) {
+        std::cout << "No request completed" << std::endl;
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << (pin ? "Pinned" : "Not pinned") << std::endl;
+    std::cout << "Throughput: " << latencies.size() / seconds << " req/s, "
+              << latencies.size() * block_size / (1024.0 * 1024 * seconds)
+              << " MiB/s" << std::endl;
+    std::cout << "p50: " << Percentile(0.5) << " us" << std::endl;
+    std::cout << "p99: " << Percentile(0.99) << " us" << std::endl;
+    return 0;
+}
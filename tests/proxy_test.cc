@@ -0,0 +1,254 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpclient.hh"
+#include "tcpconn.hh"
+
+// A proxy forwards what an upstream client writes as fast as it can to a
+// downstream sink reading about 1.6MB/s. With "p" the proxy stops reading
+// the upstream connection when the downstream one reaches the high water
+// mark and starts again at the low one, so the upstream client is blocked by
+// TCP flow control instead of filling the memory of the proxy. Without it
+// the backlog grows up to everything written. The sink checks that no byte
+// is lost or reordered through the pauses. With "r" the sink reads nothing,
+// and the upstream client resets its connection once pushed back, which the
+// proxy has to find out while the reading of it is stopped.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kIp = "127.0.0.1";
+const int kProxyPort = 9939;
+const int kSinkPort = 9940;
+const std::size_t kHighMark = 1 << 20;
+const std::size_t kLowMark = 256 << 10;
+// Written at most by the upstream client, which bounds the backlog without
+// flow control.
+const long kMaxUpstreamBytes = 256L << 20;
+const std::size_t kSlowReadSize = 16384;
+std::atomic<bool> stopped{false};
+std::atomic<long> upstream_bytes{0};
+std::atomic<long> sink_bytes{0};
+std::atomic<bool> sink_ok{true};
+std::atomic<std::size_t> max_backlog{0};
+std::atomic<int> pauses{0};
+std::atomic<bool> upstream_reset{false};
+std::atomic<bool> upstream_closed{false};
+
+// The bytes of the stream follow a pattern the sink can check.
+char PatternAt(long pos) {
+    return static_cast<char>(pos % 251);
+}
+
+// Proxy. Only accessed in the proxy loop.
+struct Tunnel {
+    std::unique_ptr<TcpClient> downstreamp;
+    TcpConnPtr downstream_connp;
+};
+std::unordered_map<TcpConn*, Tunnel> tunnels{};
+
+void ProxyOnUpstreamConnected(EventLoop& loop, bool flow_control,
+                              TcpConnPtr upstream_connp) {
+    // Nothing is read until the downstream connection is established.
+    upstream_connp->StopReading();
+    Tunnel& tunnel = tunnels[upstream_connp.get()];
+    tunnel.downstreamp = std::make_unique<TcpClient>(
+                             loop, InetAddr{kIp, kSinkPort});
+    TcpClient& downstream = *tunnel.downstreamp;
+    downstream.SetConnectedCallback([upstream_connp](TcpConnPtr connp) {
+        tunnels[upstream_connp.get()].downstream_connp = connp;
+        upstream_connp->StartReading();
+    });
+    downstream.SetRecvCallback([](TcpConnPtr, std::string) {});
+    if (flow_control) {
+        downstream.SetHighWaterMarkCallback(
+            [upstream_connp](TcpConnPtr, std::size_t) {
+                ++pauses;
+                upstream_connp->StopReading(); },
+            kHighMark);
+        downstream.SetLowWaterMarkCallback(
+            [upstream_connp](TcpConnPtr) { upstream_connp->StartReading(); },
+            kLowMark);
+    }
+    downstream.Connect();
+}
+
+void ProxyOnUpstreamRecv(TcpConnPtr upstream_connp, std::string msg) {
+    TcpConnPtr& connp = tunnels[upstream_connp.get()].downstream_connp;
+    connp->Send(std::move(msg));
+    max_backlog = std::max(max_backlog.load(), connp->SendBacklog());
+}
+
+void StartProxy(bool flow_control, bool edge_triggered,
+                EventLoop** loop_addrp) {
+    EventLoop proxy_loop{};
+    *loop_addrp = &proxy_loop;
+    TcpServer proxy{proxy_loop, InetAddr{kIp, kProxyPort}};
+    proxy.SetEdgeTriggered(edge_triggered);
+    proxy.SetConnectedCallback([&proxy_loop, flow_control](TcpConnPtr connp) {
+        ProxyOnUpstreamConnected(proxy_loop, flow_control, connp); });
+    proxy.SetRecvCallback(ProxyOnUpstreamRecv);
+    proxy.SetDisconnectedCallback([](TcpConnPtr) { upstream_closed = true; });
+    proxy.Start();
+    proxy_loop.Loop();
+    for (auto& entry : tunnels) {
+        if (entry.second.downstream_connp)
+            entry.second.downstream_connp->ForceClose();
+    }
+    tunnels.clear();
+}
+
+int Listen(int port) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    ::inet_pton(AF_INET, kIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (::bind(sk, reinterpret_cast<struct sockaddr*>(&addr),
+               sizeof(addr)) < 0 || ::listen(sk, 16) < 0) {
+        std::cout << "Listening failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+int Connect(int port) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    ::inet_pton(AF_INET, kIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+void SinkFunc(int listen_sk, bool reset) {
+    int sk = ::accept(listen_sk, nullptr, nullptr);
+    std::vector<char> buf(kSlowReadSize);
+    long pos = 0;
+    while (!stopped && !reset) {
+        ssize_t n = ::recv(sk, buf.data(), buf.size(), 0);
+        if (n <= 0)
+            break;
+        for (ssize_t i = 0; i < n; ++i) {
+            if (buf[i] != PatternAt(pos++))
+                sink_ok = false;
+        }
+        sink_bytes += n;
+        std::this_thread::sleep_for(10ms);
+    }
+    while (!stopped)
+        std::this_thread::sleep_for(10ms);
+    ::close(sk);
+}
+
+void UpstreamFunc(bool reset) {
+    int sk = Connect(kProxyPort);
+    std::vector<char> buf(65536);
+    long pos = 0;
+    while (!stopped && pos < kMaxUpstreamBytes) {
+        for (char& c : buf)
+            c = PatternAt(pos++);
+        std::size_t sent = 0;
+        while (!stopped && sent < buf.size()) {
+            ssize_t n = ::send(sk, buf.data() + sent, buf.size() - sent,
+                               MSG_DONTWAIT);
+            if (n > 0) {
+                sent += n;
+                upstream_bytes += n;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Pushed back by the proxy.
+                if (reset && pauses > 0) {
+                    struct linger lg{1, 0};
+                    ::setsockopt(sk, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                    ::close(sk);
+                    upstream_reset = true;
+                    return;
+                }
+                std::this_thread::sleep_for(1ms);
+            } else {
+                break;
+            }
+        }
+    }
+    while (!stopped)
+        std::this_thread::sleep_for(10ms);
+    ::close(sk);
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? std::max(std::atoi(argv[1]), 1) : 5;
+    bool flow_control = false;
+    bool edge_triggered = false;
+    bool reset = false;
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "p") == 0) {
+            flow_control = true;
+        } else if (std::strcmp(argv[i], "r") == 0) {
+            flow_control = true;
+            reset = true;
+        } else if (std::strcmp(argv[i], "et") == 0) {
+            edge_triggered = true;
+        }
+    }
+    int sink_listen_sk = Listen(kSinkPort);
+    std::thread sink{SinkFunc, sink_listen_sk, reset};
+    EventLoop* loopp = nullptr;
+    std::thread proxy_thread{StartProxy, flow_control, edge_triggered,
+                             &loopp};
+    // Leave 1s for proxy's starting.
+    std::this_thread::sleep_for(1s);
+    std::thread upstream{UpstreamFunc, reset};
+    for (int i = 0; i < seconds; ++i) {
+        std::this_thread::sleep_for(1s);
+        std::cout << "Upstream wrote " << upstream_bytes / 1024 << " KB, "
+                  << "sink read " << sink_bytes / 1024 << " KB, "
+                  << "largest downstream backlog " << max_backlog / 1024
+                  << " KB, " << pauses << " pauses" << std::endl;
+    }
+    // Before the connections are closed by stopping the proxy.
+    bool closed_after_reset = upstream_closed;
+    stopped = true;
+    upstream.join();
+    loopp->Quit();
+    proxy_thread.join();
+    sink.join();
+    ::close(sink_listen_sk);
+    if (reset) {
+        std::cout << "Upstream connection reset: " << upstream_reset
+                  << ", closed by the proxy: " << closed_after_reset
+                  << std::endl;
+        bool ok = upstream_reset && closed_after_reset;
+        std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+        return ok ? 0 : 1;
+    }
+    if (!flow_control)
+        return 0;
+    // The upstream data delivered with the high mark reached come on top of
+    // it, up to 16 reads of the scratch space in edge-triggered mode.
+    bool ok = sink_ok && sink_bytes > 0 &&
+              max_backlog <= kHighMark + (2 << 20);
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
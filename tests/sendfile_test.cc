@@ -0,0 +1,195 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+
+// Serve a file of the given size over loopback to a client discarding it,
+// either with SendFile(), or with the buffered path reading kChunkSize at a
+// time into a string passed to Send() and reading the next one once it is
+// written. The file is written first, so it is served from the page cache.
+// A small header is sent before the file and a trailer after it, to check
+// the order of the buffered bytes and the file. The cpu time of the server
+// loop is reported along with the throughput.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::size_t kChunkSize = 1 << 20;
+const std::string kHeader{"HEADER\n"};
+const std::string kTrailer{"TRAILER\n"};
+std::atomic<bool> file_done{false};
+std::atomic<bool> file_ok{false};
+std::atomic<double> server_cpu{0};
+
+double ThreadCpuSeconds() {
+    struct rusage usage{};
+    ::getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// The buffered path.
+class ChunkReader {
+public:
+    ChunkReader(int fd, std::size_t size) : fd_{fd}, left_{size} {}
+
+    // Called whenever the last chunk, or the header, is written.
+    void SendNext(TcpConnPtr connp) {
+        if (left_ == 0) {
+            if (!done_) {
+                done_ = true;
+                file_ok = true;
+                connp->Send(kTrailer);
+            }
+            return;
+        }
+        std::string chunk(std::min(kChunkSize, left_), '\0');
+        ssize_t n = ::pread(fd_, &chunk[0], chunk.size(), offset_);
+        if (n <= 0) {
+            connp->ForceClose();
+            return;
+        }
+        chunk.resize(n);
+        offset_ += n;
+        left_ -= n;
+        connp->Send(std::move(chunk));
+    }
+
+private:
+    int fd_;
+    off_t offset_{0};
+    std::size_t left_;
+    bool done_{false};
+};
+
+void StartServer(int fd, std::size_t size, bool use_sendfile,
+                 bool edge_triggered, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    double cpu_begin = 0;
+    ChunkReader reader{fd, size};
+    server.SetEdgeTriggered(edge_triggered);
+    server.SetConnectedCallback([&](TcpConnPtr connp) {
+        cpu_begin = ThreadCpuSeconds();
+        connp->Send(kHeader);
+        if (use_sendfile) {
+            connp->SendFile(fd, 0, size, [](TcpConnPtr, bool ok) {
+                                             file_ok = ok; });
+            connp->Send(kTrailer);
+        }
+        // Otherwise the chunks follow from the writing of the header.
+    });
+    server.SetWriteCompCallback([&](TcpConnPtr connp) {
+        if (!use_sendfile)
+            reader.SendNext(connp);
+        if (file_ok && !file_done) {
+            file_done = true;
+            server_cpu = ThreadCpuSeconds() - cpu_begin;
+        }
+    });
+    server.Start();
+    server_main_loop.Loop();
+}
+
+// Return the bytes of the file received, or -1 if the header or the
+// trailer is wrong.
+long ClientFunc(std::size_t size) {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    std::size_t total = kHeader.size() + size + kTrailer.size();
+    std::vector<char> buf(1 << 20);
+    std::string head{};
+    std::string tail{};
+    std::size_t received = 0;
+    while (received < total) {
+        ssize_t n = ::recv(sk, buf.data(), buf.size(), 0);
+        if (n <= 0)
+            break;
+        // Only the bytes of the header and the trailer are kept.
+        std::size_t end = received + n;
+        for (std::size_t pos = received; pos < end && pos < kHeader.size();
+             ++pos)
+            head += buf[pos - received];
+        for (std::size_t pos = std::max(received, kHeader.size() + size);
+             pos < end; ++pos)
+            tail += buf[pos - received];
+        received = end;
+    }
+    ::close(sk);
+    if (head != kHeader || tail != kTrailer)
+        return -1;
+    return received - kHeader.size() - kTrailer.size();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: sendfile_test <file_size_mb> [b (buffered)] "
+                  << "[et]" << std::endl;
+        return 1;
+    }
+    std::size_t size = std::atol(argv[1]) * (1UL << 20);
+    bool use_sendfile = true;
+    bool edge_triggered = false;
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "b") == 0)
+            use_sendfile = false;
+        else if (std::strcmp(argv[i], "et") == 0)
+            edge_triggered = true;
+    }
+    char path[] = "/tmp/axn_sendfile_XXXXXX";
+    int fd = ::mkstemp(path);
+    ::unlink(path);
+    std::string block(kChunkSize, 'f');
+    for (std::size_t written = 0; written < size; written += block.size())
+        ::write(fd, block.data(), std::min(block.size(), size - written));
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, fd, size, use_sendfile,
+                              edge_triggered, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    auto begin = std::chrono::steady_clock::now();
+    long received = ClientFunc(size);
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - begin).count();
+    // The server reports its cpu time once the trailer is written.
+    while (!file_done && received >= 0)
+        std::this_thread::sleep_for(10ms);
+    loopp->Quit();
+    server_thread.join();
+    ::close(fd);
+    bool ok = file_ok && received == static_cast<long>(size);
+    std::cout << (use_sendfile ? "sendfile: " : "buffered: ")
+              << size / seconds / (1 << 20) << " MiB/s, server cpu "
+              << server_cpu << " s ("
+              << server_cpu / (size / double(1 << 30)) << " s/GiB)"
+              << std::endl;
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
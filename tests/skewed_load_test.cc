@@ -0,0 +1,158 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "eventloop_pool.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+
+// Skewed load: every group of connections has one heavy connection whose
+// requests cost 2ms of CPU each and several light ones whose requests are
+// nearly free. Connections are made group by group, heavy first, which puts
+// all the heavy connections onto the same loop with round-robin. The tail
+// latency of the light requests shows how well the selection policy spreads
+// the load.
+
+using namespace axn;
+using namespace std::chrono_literals;
+using Clock = std::chrono::steady_clock;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const auto kHeavyCost = 2ms;
+std::atomic<bool> measuring{false};
+std::atomic<bool> stopped{false};
+std::mutex latencies_mutex{};
+std::vector<double> latencies{};
+
+// Server Callbacks.
+void ServerRespond(TcpConnPtr connp, std::string msg) {
+    for (char c : msg) {
+        if (c == 'H') {
+            // Spin to pretend to be busy.
+            auto until = Clock::now() + kHeavyCost;
+            while (Clock::now() < until) {}
+        }
+    }
+    connp->Send(msg);
+}
+
+void StartServer(int thread_num, LoopSelectPolicy policy,
+                 EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    server.SetLoopSelectPolicy(policy);
+    server.SetRecvCallback(ServerRespond);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+int Connect() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+// One request at a time with plain blocking sockets.
+void ClientFunc(int sk, bool heavy) {
+    char req = heavy ? 'H' : 'L';
+    char resp;
+    std::vector<double> local_latencies{};
+    while (!stopped) {
+        auto begin = Clock::now();
+        ::send(sk, &req, 1, 0);
+        if (::recv(sk, &resp, 1, 0) <= 0)
+            break;
+        if (heavy)
+            continue;
+        if (measuring)
+            local_latencies.push_back(
+                std::chrono::duration<double, std::micro>(
+                    Clock::now() - begin).count());
+        std::this_thread::sleep_for(1ms);
+    }
+    ::close(sk);
+    std::lock_guard<std::mutex> lock{latencies_mutex};
+    latencies.insert(latencies.end(), local_latencies.begin(),
+                     local_latencies.end());
+}
+
+double Percentile(double p) {
+    std::size_t index = static_cast<std::size_t>(p * (latencies.size() - 1));
+    return latencies[index];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: skewed_load_test <server_thread_num> "
+                  << "<rr/lc/lb/hash> [light_per_group] [seconds]"
+                  << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::atoi(argv[1]);
+    LoopSelectPolicy policy{LoopSelectPolicy::kRoundRobin};
+    if (std::strcmp(argv[2], "lc") == 0)
+        policy = LoopSelectPolicy::kLeastConns;
+    else if (std::strcmp(argv[2], "lb") == 0)
+        policy = LoopSelectPolicy::kLeastBusy;
+    else if (std::strcmp(argv[2], "hash") == 0)
+        policy = LoopSelectPolicy::kHashKey;
+    // Make a group take exactly one round of round-robin by default.
+    int light_per_group = argc > 3 ? std::atoi(argv[3]) :
+                                     std::max(server_thread_num - 1, 1);
+    int seconds = argc > 4 ? std::atoi(argv[4]) : 10;
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num, policy, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int group = 0; group < std::max(server_thread_num, 1); ++group) {
+        clients.emplace_back(ClientFunc, Connect(), true);
+        for (int i = 0; i < light_per_group; ++i)
+            clients.emplace_back(ClientFunc, Connect(), false);
+        // Let the heavy connection show up in the busy time.
+        std::this_thread::sleep_for(300ms);
+    }
+    measuring = true;
+    std::this_thread::sleep_for(std::chrono::seconds{seconds});
+    stopped = true;
+    for (auto& client : clients)
+        client.join();
+    loopp->Quit();
+    server_thread.join();
+    if (latencies.empty()) {
+        std::cout << "No light request completed" << std::endl;
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "Light requests: " << latencies.size() << std::endl;
+    std::cout << "p50: " << Percentile(0.5) << " us" << std::endl;
+    std::cout << "p99: " << Percentile(0.99) << " us" << std::endl;
+    std::cout << "p99.9: " << Percentile(0.999) << " us" << std::endl;
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+
+// A server pushes kChunkSize bytes every millisecond to each of its clients,
+// one reading as fast as it can and one reading a little every 10ms. Without
+// backpressure the backlog of the slow client grows for as long as the test
+// runs. With "w" the producer skips the connections above the high water
+// mark until they fall to the low one, with "c" the slow client is closed
+// once its backlog hits the limit, and with "d" the chunks over the limit are
+// dropped. "v" drops too, but each chunk is sent by SendV() in kPieceNum
+// pieces, more than a single writev() takes, and the clients check that no
+// chunk is cut. The slow client only reads the bytes around the first drops
+// after several seconds, so run "v" for 10 seconds or more. The test passes
+// if the largest backlog stays bounded in these modes while the fast client
+// keeps receiving.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const std::size_t kChunkSize = 16384;
+const std::size_t kHighMark = 1 << 20;
+const std::size_t kLowMark = 256 << 10;
+const std::size_t kSendLimit = 4 << 20;
+const std::size_t kSlowReadSize = 16384;
+const std::size_t kPieceNum = 100;
+const std::size_t kPieceSize = kChunkSize / kPieceNum;
+std::atomic<bool> stopped{false};
+std::atomic<bool> pieces_ok{true};
+std::atomic<long> fast_bytes{0};
+std::atomic<long> slow_bytes{0};
+// Set by the server, since the slow client only finds out after reading
+// what the socket still holds.
+std::atomic<bool> slow_closed{false};
+std::atomic<std::size_t> max_backlog{0};
+
+enum class Mode { kNone, kWaterMarks, kClose, kDrop, kDropPieces };
+
+long RssBytes() {
+    std::ifstream statm{"/proc/self/statm"};
+    long size = 0;
+    long resident = 0;
+    statm >> size >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+// Only accessed in the server loop.
+std::vector<TcpConnPtr> conns{};
+std::unordered_set<TcpConn*> paused{};
+
+// Server Callbacks.
+void ServerOnConnected(TcpConnPtr connp) {
+    conns.push_back(connp);
+}
+
+void ServerOnDisconnected(TcpConnPtr connp) {
+    // Only the slow client is closed before the end.
+    if (!stopped)
+        slow_closed = true;
+    conns.erase(std::remove(conns.begin(), conns.end(), connp), conns.end());
+    paused.erase(connp.get());
+}
+
+void ServerOnHighWaterMark(TcpConnPtr connp, std::size_t) {
+    paused.insert(connp.get());
+}
+
+void ServerOnLowWaterMark(TcpConnPtr connp) {
+    paused.erase(connp.get());
+}
+
+// The byte at pos of the stream of chunks made of pieces.
+char PieceByteAt(std::size_t pos) {
+    return static_cast<char>('a' + pos % (kPieceNum * kPieceSize) /
+                                   kPieceSize % 26);
+}
+
+void Produce(const std::string& chunk,
+             const std::vector<SharedBuffer>& pieces) {
+    for (const TcpConnPtr& connp : conns) {
+        if (paused.count(connp.get()) == 0 && connp->IsConnected()) {
+            if (pieces.empty())
+                connp->Send(chunk);
+            else
+                connp->SendV(pieces);
+        }
+        // Closed for going over the limit by the Send() above.
+        if (connp->IsConnected())
+            max_backlog = std::max(max_backlog.load(), connp->SendBacklog());
+    }
+}
+
+void StartServer(Mode mode, EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetConnectedCallback(ServerOnConnected);
+    server.SetDisconnectedCallback(ServerOnDisconnected);
+    if (mode == Mode::kWaterMarks) {
+        server.SetHighWaterMarkCallback(ServerOnHighWaterMark, kHighMark);
+        server.SetLowWaterMarkCallback(ServerOnLowWaterMark, kLowMark);
+    } else if (mode == Mode::kClose) {
+        server.SetSendBufferLimit(kSendLimit, OverflowPolicy::kClose);
+    } else if (mode == Mode::kDrop || mode == Mode::kDropPieces) {
+        server.SetSendBufferLimit(kSendLimit, OverflowPolicy::kDrop);
+    }
+    server.Start();
+    std::string chunk(kChunkSize, 'x');
+    std::vector<SharedBuffer> pieces{};
+    if (mode == Mode::kDropPieces) {
+        for (std::size_t i = 0; i < kPieceNum; ++i)
+            pieces.push_back(std::make_shared<const std::string>(
+                                 kPieceSize, PieceByteAt(i * kPieceSize)));
+    }
+    server_main_loop.RunEvery(1ms, [&chunk, &pieces]() {
+                                  Produce(chunk, pieces); });
+    server_main_loop.Loop();
+    conns.clear();
+}
+
+int Connect() {
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                  sizeof(addr)) < 0) {
+        std::cout << "connect() failed: " << std::strerror(errno) << std::endl;
+        std::exit(1);
+    }
+    return sk;
+}
+
+void ClientFunc(bool slow, bool check_pieces) {
+    int sk = Connect();
+    std::vector<char> buf(slow ? kSlowReadSize : 65536);
+    std::size_t pos = 0;
+    while (!stopped) {
+        ssize_t n = ::recv(sk, buf.data(), buf.size(), 0);
+        if (n <= 0)
+            break;
+        (slow ? slow_bytes : fast_bytes).fetch_add(n);
+        for (ssize_t i = 0; check_pieces && i < n; ++i) {
+            if (buf[i] != PieceByteAt(pos++))
+                pieces_ok = false;
+        }
+        if (slow)
+            std::this_thread::sleep_for(10ms);
+    }
+    ::close(sk);
+}
+
+int main(int argc, char* argv[]) {
+    int seconds = argc > 1 ? std::max(std::atoi(argv[1]), 1) : 5;
+    Mode mode = Mode::kNone;
+    if (argc > 2) {
+        if (std::strcmp(argv[2], "w") == 0)
+            mode = Mode::kWaterMarks;
+        else if (std::strcmp(argv[2], "c") == 0)
+            mode = Mode::kClose;
+        else if (std::strcmp(argv[2], "d") == 0)
+            mode = Mode::kDrop;
+        else if (std::strcmp(argv[2], "v") == 0)
+            mode = Mode::kDropPieces;
+    }
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, mode, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    long base_rss = RssBytes();
+    bool check_pieces = mode == Mode::kDropPieces;
+    std::thread fast_client{ClientFunc, false, check_pieces};
+    std::thread slow_client{ClientFunc, true, check_pieces};
+    for (int i = 0; i < seconds; ++i) {
+        std::this_thread::sleep_for(1s);
+        std::cout << "Fast client " << fast_bytes / (1 << 20) << " MB, "
+                  << "slow client " << slow_bytes / 1024 << " KB"
+                  << (slow_closed ? " (closed)" : "") << ", largest backlog "
+                  << max_backlog / 1024 << " KB, RSS growth "
+                  << (RssBytes() - base_rss) / 1024 << " KB" << std::endl;
+    }
+    stopped = true;
+    loopp->Quit();
+    server_thread.join();
+    fast_client.join();
+    slow_client.join();
+    if (mode == Mode::kNone)
+        return 0;
+    // One chunk may go over the high mark before the producer pauses.
+    std::size_t bound = mode == Mode::kWaterMarks ? kHighMark + kChunkSize
+                                                  : kSendLimit;
+    bool ok = max_backlog <= bound && fast_bytes > 0 && pieces_ok &&
+              (mode != Mode::kClose || slow_closed);
+    std::cout << (ok ? "PASSED" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
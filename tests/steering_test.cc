@@ -0,0 +1,150 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "eventloop_pool.hh"
+#include "tcpserver.hh"
+#include "tcpconn.hh"
+#include "util/affinity.hh"
+
+// Server loops are pinned to cpus 0..n-1 and so are the clients. On loopback
+// the packets of a connection are processed on the cpu of the sending client,
+// so steering by SO_INCOMING_CPU should put most connections onto the loop of
+// that cpu, which shows up as incoming cpu hits of the loops.
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+const char* kServerIp = "127.0.0.1";
+const int kServerPort = 9939;
+const int kRequestsPerConn = 10;
+std::atomic<bool> stopped{false};
+std::atomic<long> completed{0};
+std::mutex loops_mutex{};
+std::vector<EventLoop*> loops{};
+
+// Server Callbacks.
+void ServerEcho(TcpConnPtr connp, std::string msg) {
+    connp->Send(msg);
+}
+
+void StartServer(int thread_num, bool steering, bool per_loop_acceptor,
+                 EventLoop** loop_addrp) {
+    EventLoop server_main_loop{};
+    *loop_addrp = &server_main_loop;
+    TcpServer server{server_main_loop, InetAddr{kServerIp, kServerPort}};
+    server.SetThreadNum(thread_num);
+    std::vector<int> cpus{};
+    for (int i = 0; i < thread_num; ++i)
+        cpus.push_back(i);
+    server.SetCpuList(cpus);
+    server.SetThreadInitCallback([](EventLoop& loop) {
+                                     std::lock_guard<std::mutex> lock{
+                                         loops_mutex};
+                                     loops.push_back(&loop); });
+    if (steering)
+        server.SetLoopSelectPolicy(LoopSelectPolicy::kIncomingCpu);
+    server.SetPerLoopAcceptor(per_loop_acceptor);
+    server.SetIncomingCpuStats(true);
+    server.SetRecvCallback(ServerEcho);
+    server.Start();
+    server_main_loop.Loop();
+}
+
+// A few requests per connection with plain blocking sockets.
+void ClientFunc(int cpu) {
+    PinThisThread(cpu);
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kServerPort);
+    ::inet_pton(AF_INET, kServerIp, &addr.sin_addr);
+    char buf[64] = {};
+    while (!stopped) {
+        int sk = ::socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        ::setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (::connect(sk, reinterpret_cast<struct sockaddr*>(&addr),
+                      sizeof(addr)) < 0) {
+            ::close(sk);
+            std::this_thread::sleep_for(1ms);
+            continue;
+        }
+        for (int i = 0; i < kRequestsPerConn; ++i) {
+            ::send(sk, buf, sizeof(buf), 0);
+            std::size_t received = 0;
+            while (received < sizeof(buf)) {
+                ssize_t n = ::recv(sk, buf, sizeof(buf) - received, 0);
+                if (n <= 0)
+                    break;
+                received += n;
+            }
+        }
+        // Reset the connection to avoid TIME_WAIT on the client side.
+        struct linger lin{1, 0};
+        ::setsockopt(sk, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        ::close(sk);
+        completed.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: steering_test <server_thread_num> <rr/cpu> "
+                  << "[clients_per_cpu] [seconds] "
+                  << "[r (accept in every loop with SO_REUSEPORT)]"
+                  << std::endl;
+        return 1;
+    }
+    int server_thread_num = std::max(std::atoi(argv[1]), 1);
+    bool steering = (std::strcmp(argv[2], "cpu") == 0);
+    int clients_per_cpu = argc > 3 ? std::atoi(argv[3]) : 2;
+    int seconds = argc > 4 ? std::atoi(argv[4]) : 10;
+    bool per_loop_acceptor = (argc > 5 && argv[5][0] == 'r');
+    EventLoop* loopp = nullptr;
+    std::thread server_thread{StartServer, server_thread_num, steering,
+                              per_loop_acceptor, &loopp};
+    // Leave 1s for server's starting.
+    std::this_thread::sleep_for(1s);
+    std::vector<std::thread> clients{};
+    for (int i = 0; i < server_thread_num * clients_per_cpu; ++i)
+        clients.emplace_back(ClientFunc, i % server_thread_num);
+    std::this_thread::sleep_for(std::chrono::seconds{seconds});
+    stopped = true;
+    for (auto& client : clients)
+        client.join();
+    std::cout << (steering ? "Steered by incoming cpu" : "Round-robin")
+              << std::endl;
+    long total_hits = 0;
+    long total_misses = 0;
+    {
+        std::lock_guard<std::mutex> lock{loops_mutex};
+        for (EventLoop* conn_loopp : loops) {
+            std::cout << "Loop on cpu " << conn_loopp->PinnedCpu()
+                      << ": incoming cpu hits " << conn_loopp->IncomingCpuHits()
+                      << ", misses " << conn_loopp->IncomingCpuMisses()
+                      << std::endl;
+            total_hits += conn_loopp->IncomingCpuHits();
+            total_misses += conn_loopp->IncomingCpuMisses();
+        }
+    }
+    loopp->Quit();
+    server_thread.join();
+    if (total_hits + total_misses > 0)
+        std::cout << "Hit ratio: "
+                  << 100.0 * total_hits / (total_hits + total_misses) << "%"
+                  << std::endl;
+    std::cout << "Average: " << completed / seconds << " conn/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <string>
+#include <memory>
+#include <thread>
+#include <future>
+#include <new>
+#include <cstdlib>
+#include <cassert>
+#include <sys/socket.h>
+
+#include "eventloop.hh"
+#include "tcpconn.hh"
+#include "util/task.hh"
+
+using namespace axn;
+
+// Only count allocations made by the current thread so that the loop thread
+// does not disturb the result.
+thread_local std::size_t tlocal_alloc_count = 0;
+
+void* operator new(std::size_t size) {
+    ++tlocal_alloc_count;
+    if (void* p = std::malloc(size))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void TaskTest() {
+    int count = 0;
+    auto ptr = std::make_shared<int>(1);
+    std::string msg{"a message longer than the small string buffer"};
+    std::size_t before = tlocal_alloc_count;
+    // shared_ptr + std::string + reference, which std::function has to put on
+    // the heap.
+    Task t1{[ptr, msg = std::move(msg), &count]() { count += *ptr; }};
+    Task t2{std::move(t1)};
+    assert(!t1);
+    t2();
+    t1 = std::move(t2);
+    t1();
+    assert(tlocal_alloc_count == before);
+    assert(count == 2);
+    // Move-only captures.
+    auto uptr = std::make_unique<int>(2);
+    Task t3{[uptr = std::move(uptr), &count]() { count += *uptr; }};
+    t3();
+    assert(count == 4);
+    // Large captures fall back to the heap.
+    char large[Task::kInlineSize * 2] = {};
+    before = tlocal_alloc_count;
+    Task t4{[large, &count]() { count += large[0] + 1; }};
+    assert(tlocal_alloc_count == before + 1);
+    t4();
+    assert(count == 5);
+    // Empty callables stay empty.
+    assert(!Task{std::function<void()>{}});
+}
+
+void CrossThreadSendTest() {
+    int sks[2];
+    int ret = ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sks);
+    assert(ret == 0);
+    // Set once connp is ready, which publishes it to this thread.
+    std::promise<EventLoop*> loop_ready{};
+    TcpConnPtr connp{};
+    std::thread loop_thread{[&]() {
+        EventLoop loop;
+        connp = std::make_shared<TcpConn>(loop, sks[0]);
+        connp->SetRecvCallback(DefaultRecvCallback);
+        connp->SetCloseCallback([](TcpConnPtr) {});
+        connp->OnConnected();
+        loop_ready.set_value(&loop);
+        loop.Loop();
+        connp->ForceClose();
+        loop.RunInLoop([&]() { connp->OnDisconnected(); });
+        connp.reset();
+    }};
+    EventLoop* loopp = loop_ready.get_future().get();
+    // Short enough for the small string optimization, so what is left is the
+    // cost of the task and the queue.
+    std::string msg{"ping"};
+    // Warm up.
+    for (int i = 0; i < 100; ++i)
+        connp->Send(msg);
+    std::size_t before = tlocal_alloc_count;
+    const int kSendNum = 1000;
+    for (int i = 0; i < kSendNum; ++i)
+        connp->Send(msg);
+    std::size_t allocs = tlocal_alloc_count - before;
+    std::cout << "Allocations per cross-thread Send: "
+              << static_cast<double>(allocs) / kSendNum << std::endl;
+    // The task is inline in the node of the pending task queue, which comes
+    // from the slab pool, so nothing is left on the heap.
+    assert(allocs == 0);
+    loopp->Quit();
+    loop_thread.join();
+    ::close(sks[1]);
+}
+
+int main() {
+    TaskTest();
+    CrossThreadSendTest();
+    std::cout << "task_test passed" << std::endl;
+}
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "eventloop.hh"
+
+using namespace axn;
+
+// Measure how many cross-thread tasks per second one EventLoop can take from
+// n producer threads, compared with the former pending task queue.
+
+// The former pending task queue of EventLoop, a vector guarded by a mutex
+// and swapped out by the loop, with a write to the wakeup fd for every task.
+class MutexLoop {
+public:
+    MutexLoop() : wakeup_fd_{::eventfd(0, EFD_NONBLOCK)} {}
+    ~MutexLoop() { ::close(wakeup_fd_); }
+
+    void QueueInLoop(EventLoop::Functor f) {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            pending_tasks_.push_back(std::move(f));
+        }
+        Wakeup();
+    }
+    // Only called by the tasks.
+    void Quit() { quit_ = true; }
+    void Loop() {
+        while (!quit_) {
+            struct pollfd pfd{wakeup_fd_, POLLIN, 0};
+            ::poll(&pfd, 1, 10000);
+            std::uint64_t n = 0;
+            ::read(wakeup_fd_, &n, sizeof(n));
+            std::vector<EventLoop::Functor> workload{};
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                workload.swap(pending_tasks_);
+            }
+            for (auto& f : workload)
+                f();
+        }
+    }
+
+private:
+    void Wakeup() {
+        std::uint64_t one = 1;
+        ::write(wakeup_fd_, &one, sizeof(one));
+    }
+
+    int wakeup_fd_;
+    bool quit_{false};
+    std::mutex mutex_{};
+    std::vector<EventLoop::Functor> pending_tasks_{};
+};
+
+template <typename F>
+void Produce(EventLoop& loop, const F& task, int task_num, bool batch) {
+    if (!batch) {
+        for (int j = 0; j < task_num; ++j)
+            loop.QueueInLoop(task);
+        return;
+    }
+    const int kBatchSize = 64;
+    for (int j = 0; j < task_num; j += kBatchSize) {
+        std::vector<EventLoop::Functor> fs{};
+        for (int k = j; k < j + kBatchSize && k < task_num; ++k)
+            fs.emplace_back(task);
+        loop.QueueInLoopBatch(std::move(fs));
+    }
+}
+
+// It had no batch submission.
+template <typename F>
+void Produce(MutexLoop& loop, const F& task, int task_num, bool) {
+    for (int j = 0; j < task_num; ++j)
+        loop.QueueInLoop(task);
+}
+
+template <typename Loop>
+double TasksPerSec(int producer_num, int tasks_per_producer, bool batch) {
+    Loop loop;
+    long long done = 0;
+    long long target =
+        static_cast<long long>(producer_num) * tasks_per_producer;
+    auto task = [&]() {
+        if (++done == target)
+            loop.Quit();
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers{};
+    for (int i = 0; i < producer_num; ++i) {
+        producers.emplace_back([&]() {
+            Produce(loop, task, tasks_per_producer, batch); });
+    }
+    loop.Loop();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    for (auto& t : producers)
+        t.join();
+    return target / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cout << "Usage: taskqueue_test <max_producer_num> "
+                  << "<tasks_per_producer>" << std::endl;
+        return 1;
+    }
+    int max_producer_num = std::atoi(argv[1]);
+    int tasks_per_producer = std::atoi(argv[2]);
+    for (int n = 1; n <= max_producer_num; ++n) {
+        std::cout << "Producers: " << n << std::endl;
+        std::cout << "  mutex queue: QueueInLoop "
+                  << TasksPerSec<MutexLoop>(n, tasks_per_producer, false)
+                  << " tasks/s" << std::endl;
+        std::cout << "  EventLoop:   QueueInLoop "
+                  << TasksPerSec<EventLoop>(n, tasks_per_producer, false)
+                  << " tasks/s, QueueInLoopBatch "
+                  << TasksPerSec<EventLoop>(n, tasks_per_producer, true)
+                  << " tasks/s" << std::endl;
+    }
+    return 0;
+}
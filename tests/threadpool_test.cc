@@ -0,0 +1,198 @@
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+#include "util/threadpool.hh"
+#include "util/task.hh"
+
+using namespace axn;
+using Clock = std::chrono::steady_clock;
+
+// Compare the work-stealing ThreadPool with a single queue pool guarded by one
+// mutex, for 1, 2, 4, ... threads. In the "external" mode one thread submits
+// all the tasks, in the "fan-out" mode each root task submits its children from
+// the worker running it, so that the idle workers have to steal them.
+
+// The former ThreadPool.
+class MutexPool {
+public:
+    explicit MutexPool(int n) {
+        for (int i = 0; i < n; ++i)
+            pool_.emplace_back([this]() { ThreadFunc(); });
+    }
+    ~MutexPool() {
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            running_ = false;
+        }
+        not_empty_.notify_all();
+        for (auto& t : pool_)
+            t.join();
+    }
+    void AddTask(Task f) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        tasks_.push_back(std::move(f));
+        not_empty_.notify_one();
+    }
+
+private:
+    void ThreadFunc() {
+        while (true) {
+            std::unique_lock<std::mutex> lock{mutex_};
+            while (tasks_.empty() && running_)
+                not_empty_.wait(lock);
+            if (!running_)
+                return;
+            Task f = std::move(tasks_.front());
+            tasks_.pop_front();
+            lock.unlock();
+            f();
+        }
+    }
+
+    bool running_{true};
+    std::mutex mutex_{};
+    std::condition_variable not_empty_{};
+    std::deque<Task> tasks_{};
+    std::vector<std::thread> pool_{};
+};
+
+struct WsPool {
+    explicit WsPool(int n) {
+        pool.SetThreadNum(n);
+        pool.Start();
+    }
+    void AddTask(Task f) { pool.AddTask(std::move(f)); }
+
+    ThreadPool pool{};
+};
+
+struct Result {
+    double tasks_per_sec;
+    double p50_us;
+    double p99_us;
+};
+
+// A few hundred nanoseconds of work.
+void Work() {
+    volatile unsigned x = 0;
+    for (int i = 0; i < 100; ++i)
+        x = x + i;
+}
+
+template <typename Pool>
+Result RunExternal(int thread_num, int task_num) {
+    Pool pool{thread_num};
+    std::vector<Clock::time_point> submitted(task_num);
+    std::vector<double> latencies(task_num);
+    std::atomic<int> done{0};
+    std::promise<void> all_done{};
+    auto start = Clock::now();
+    for (int i = 0; i < task_num; ++i) {
+        submitted[i] = Clock::now();
+        pool.AddTask([&, i]() {
+            latencies[i] = std::chrono::duration<double, std::micro>(
+                               Clock::now() - submitted[i]).count();
+            Work();
+            if (done.fetch_add(1) + 1 == task_num)
+                all_done.set_value();
+        });
+    }
+    all_done.get_future().wait();
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(latencies.begin(), latencies.end());
+    return {task_num / elapsed, latencies[task_num / 2],
+            latencies[task_num * 99 / 100]};
+}
+
+template <typename Pool>
+Result RunFanOut(int thread_num, int task_num) {
+    const int kChildren = 64;
+    int root_num = std::max(task_num / kChildren, 1);
+    int total = root_num * kChildren;
+    Pool pool{thread_num};
+    std::vector<double> latencies(total);
+    std::atomic<int> done{0};
+    std::promise<void> all_done{};
+    auto start = Clock::now();
+    for (int r = 0; r < root_num; ++r) {
+        pool.AddTask([&, r]() {
+            for (int c = 0; c < kChildren; ++c) {
+                auto submitted = Clock::now();
+                pool.AddTask([&, r, c, submitted]() {
+                    latencies[r * kChildren + c] =
+                        std::chrono::duration<double, std::micro>(
+                            Clock::now() - submitted).count();
+                    Work();
+                    if (done.fetch_add(1) + 1 == total)
+                        all_done.set_value();
+                });
+            }
+        });
+    }
+    all_done.get_future().wait();
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(latencies.begin(), latencies.end());
+    return {total / elapsed, latencies[total / 2], latencies[total * 99 / 100]};
+}
+
+// A task sent to a worker busy with a long one must be taken by another
+// worker instead of waiting behind it.
+bool CheckBusyWorkerInbox() {
+    const int kThreadNum = 2;
+    ThreadPool pool{};
+    pool.SetThreadNum(kThreadNum);
+    pool.Start();
+    std::promise<void> release{};
+    std::shared_future<void> released = release.get_future().share();
+    pool.AddTask([released]() { released.wait(); });
+    // Let the worker take the blocking task before the others are added.
+    std::this_thread::sleep_for(std::chrono::milliseconds{10});
+    std::vector<std::future<void>> futs{};
+    for (int i = 0; i < kThreadNum * 2; ++i)
+        futs.push_back(pool.Submit([]() {}));
+    bool ok = true;
+    for (auto& fut : futs)
+        ok = ok && fut.wait_for(std::chrono::seconds{1}) ==
+                   std::future_status::ready;
+    release.set_value();
+    pool.Stop();
+    std::cout << "Tasks behind a busy worker: " << (ok ? "taken" : "blocked")
+              << std::endl;
+    return ok;
+}
+
+void Print(const char* name, const Result& r) {
+    std::cout << "  " << name << ": " << r.tasks_per_sec << " tasks/s, p50 "
+              << r.p50_us << " us, p99 " << r.p99_us << " us" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "Usage: threadpool_test <task_num> [max_thread_num]"
+                  << std::endl;
+        return 1;
+    }
+    int task_num = std::max(std::atoi(argv[1]), 64);
+    int max_thread_num = argc > 2 ? std::atoi(argv[2]) : 64;
+    if (!CheckBusyWorkerInbox())
+        return 1;
+    for (int n = 1; n <= max_thread_num; n *= 2) {
+        std::cout << "Threads: " << n << std::endl;
+        Print("external, mutex pool   ", RunExternal<MutexPool>(n, task_num));
+        Print("external, work-stealing", RunExternal<WsPool>(n, task_num));
+        Print("fan-out,  mutex pool   ", RunFanOut<MutexPool>(n, task_num));
+        Print("fan-out,  work-stealing", RunFanOut<WsPool>(n, task_num));
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <cassert>
+
+#include "eventloop.hh"
+
+using namespace axn;
+using namespace std::chrono_literals;
+
+void TimerTest() {
+    EventLoop loop;
+    EventLoop::Clock::time_point start = EventLoop::Clock::now();
+    int once_count = 0;
+    int every_count = 0;
+    int cancelled_count = 0;
+    loop.RunAfter(100ms, [&]() {
+        ++once_count;
+        assert(EventLoop::Clock::now() - start >= 100ms);
+    });
+    TimerId cancelled = loop.RunAfter(200ms, [&]() { ++cancelled_count; });
+    loop.CancelTimer(cancelled);
+    TimerId every{};
+    every = loop.RunEvery(50ms, [&]() {
+        // Cancel itself inside its own callback.
+        if (++every_count == 5)
+            loop.CancelTimer(every);
+    });
+    loop.RunAfter(500ms, [&]() { loop.Quit(); });
+    loop.Loop();
+    assert(once_count == 1);
+    assert(every_count == 5);
+    assert(cancelled_count == 0);
+}
+
+void CrossThreadTest() {
+    EventLoop loop;
+    int count = 0;
+    std::thread t{[&]() {
+        loop.RunAfter(50ms, [&]() { ++count; });
+        TimerId id = loop.RunAfter(100ms, [&]() { ++count; });
+        loop.CancelTimer(id);
+        std::this_thread::sleep_for(300ms);
+        // Quit() must wake up a loop blocking in polling.
+        loop.Quit();
+    }};
+    loop.Loop();
+    t.join();
+    assert(count == 1);
+}
+
+void SameBatchCancelTest() {
+    EventLoop loop;
+    EventLoop::Clock::time_point when = EventLoop::Clock::now() + 50ms;
+    int later_count = 0;
+    TimerId later{};
+    // Both expire in the same batch and the earlier one cancels the later.
+    loop.RunAt(when, [&]() { loop.CancelTimer(later); });
+    later = loop.RunAt(when, [&]() { ++later_count; });
+    loop.RunAfter(200ms, [&]() { loop.Quit(); });
+    loop.Loop();
+    assert(later_count == 0);
+}
+
+int main() {
+    TimerTest();
+    CrossThreadTest();
+    SameBatchCancelTest();
+    std::cout << "timer_test passed" << std::endl;
+}